@@ -1,38 +1,374 @@
 #include <iostream>
 #include <cmath>
 #include <mutex>
+#include <chrono>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <vector>
+#include <algorithm>
 #include <modbus/modbus.h>
 #include "modbus_client.h"
 #include <utility>
 #include <sstream>
 
+const int TModbusConnectionSettings::DefaultResponseTimeoutMs;
+
+void SetupSerialOptions(int fd, const TModbusConnectionSettings& settings)
+{
+    if (settings.LowLatency) {
+        struct serial_struct serial;
+        if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+            std::cerr << "warning: can't enable low latency mode on " << settings.Device
+                      << ": " << strerror(errno) << std::endl;
+        } else if (!(serial.flags & ASYNC_LOW_LATENCY)) {
+            serial.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(fd, TIOCSSERIAL, &serial) < 0)
+                std::cerr << "warning: can't enable low latency mode on " << settings.Device
+                          << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    if (settings.RS485) {
+        struct serial_rs485 rs485;
+        memset(&rs485, 0, sizeof(rs485));
+        rs485.flags = SER_RS485_ENABLED |
+            (settings.RS485RtsOnSend ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+        rs485.delay_rts_before_send = settings.RS485DelayBeforeSendMs;
+        rs485.delay_rts_after_send = settings.RS485DelayAfterSendMs;
+        if (ioctl(fd, TIOCSRS485, &rs485) < 0)
+            throw TModbusException("can't enable RS-485 mode on " + settings.Device +
+                                   ": " + strerror(errno));
+    }
+}
+
+void TModbusTimingStats::AddSample(uint32_t turnaround_us, uint32_t transaction_us, uint32_t wire_us)
+{
+    if (!Responses || turnaround_us < MinTurnaroundUs)
+        MinTurnaroundUs = turnaround_us;
+    if (turnaround_us > MaxTurnaroundUs)
+        MaxTurnaroundUs = turnaround_us;
+    ++Responses;
+    TurnaroundUs += turnaround_us;
+    TransactionUs += transaction_us;
+    WireUs += wire_us;
+}
+
 TModbusConnector::~TModbusConnector() {}
 
 TModbusContext::~TModbusContext() {}
 
-class TDefaultModbusContext: public TModbusContext {
+TModbusTimingStats TModbusContext::GetTimingStats() const
+{
+    return TModbusTimingStats();
+}
+
+void TModbusContext::Interrupt() {}
+
+std::vector<uint8_t> TModbusContext::RawRequest(const std::vector<uint8_t>&)
+{
+    throw TModbusException("raw requests are not supported on this port");
+}
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    void ThrowModbusError(const std::string& message)
+    {
+        // libmodbus reports exception responses from the slave
+        // as errno values starting at MODBUS_ENOBASE
+        int code = errno - MODBUS_ENOBASE;
+        if (code > 0 && code < MODBUS_EXCEPTION_MAX)
+            throw TModbusSlaveException(code, message + ": " + modbus_strerror(errno));
+        throw TModbusException(message);
+    }
+
+    TModbusContext::TStatus ErrnoStatus(int& exception_code)
+    {
+        int code = errno - MODBUS_ENOBASE;
+        if (code > 0 && code < MODBUS_EXCEPTION_MAX) {
+            exception_code = code;
+            return TModbusContext::SLAVE_EXCEPTION;
+        }
+        switch (errno) {
+        case ETIMEDOUT:
+            return TModbusContext::TIMEOUT;
+        case EMBBADCRC:
+        case EMBBADDATA:
+        case EMBBADEXC:
+        case EMBUNKEXC:
+        case EMBMDATA:
+            return TModbusContext::BAD_RESPONSE;
+        default:
+            return TModbusContext::IO_ERROR;
+        }
+    }
+}
+
+const char* TModbusContext::StatusText(TStatus status)
+{
+    switch (status) {
+    case OK:
+        return "ok";
+    case SLAVE_EXCEPTION:
+        return "exception";
+    case TIMEOUT:
+        return "timeout";
+    case BAD_RESPONSE:
+        return "bad_response";
+    case IO_ERROR:
+    default:
+        return "io_error";
+    }
+}
+
+TModbusContext::TStatus TModbusContext::Execute(uint8_t function, int addr, int nb, uint16_t* data,
+                                                int& exception_code)
+{
+    try {
+        switch (function) {
+        case READ_COILS:
+        case READ_DISCRETE_INPUTS:
+            {
+                std::vector<uint8_t> bits(nb);
+                if (function == READ_COILS)
+                    ReadCoils(addr, nb, &bits[0]);
+                else
+                    ReadDisceteInputs(addr, nb, &bits[0]);
+                for (int i = 0; i < nb; ++i)
+                    data[i] = bits[i] & 1;
+            }
+            break;
+        case READ_HOLDING_REGISTERS:
+            ReadHoldingRegisters(addr, nb, data);
+            break;
+        case READ_INPUT_REGISTERS:
+            ReadInputRegisters(addr, nb, data);
+            break;
+        case WRITE_SINGLE_COIL:
+            WriteCoil(addr, data[0]);
+            break;
+        case WRITE_SINGLE_REGISTER:
+            WriteHoldingRegister(addr, data[0]);
+            break;
+        case WRITE_MULTIPLE_REGISTERS:
+            WriteHoldingRegisters(addr, nb, data);
+            break;
+        default:
+            exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+            return SLAVE_EXCEPTION;
+        }
+    } catch (const TModbusSlaveException& e) {
+        exception_code = e.GetCode();
+        return SLAVE_EXCEPTION;
+    } catch (const TModbusException&) {
+        return IO_ERROR;
+    }
+    return OK;
+}
+
+void TModbusStatusContext::Transaction(uint8_t function, int addr, int nb, uint16_t* data,
+                                       const char* what)
+{
+    int exception_code = 0;
+    TStatus status = Execute(function, addr, nb, data, exception_code);
+    if (status == OK)
+        return;
+    std::string message = "failed to " + std::string(what) + " @ " + std::to_string(addr) +
+        " (" + std::to_string(nb) + "): " + StatusText(status);
+    if (status == SLAVE_EXCEPTION)
+        throw TModbusSlaveException(exception_code, message + " " + std::to_string(exception_code));
+    throw TModbusException(message);
+}
+
+void TModbusStatusContext::ReadBits(uint8_t function, int addr, int nb, uint8_t *dest, const char* what)
+{
+    std::vector<uint16_t> bits(nb);
+    Transaction(function, addr, nb, &bits[0], what);
+    std::copy(bits.begin(), bits.end(), dest);
+}
+
+void TModbusStatusContext::ReadCoils(int addr, int nb, uint8_t *dest)
+{
+    ReadBits(READ_COILS, addr, nb, dest, "read coil(s)");
+}
+
+void TModbusStatusContext::WriteCoil(int addr, int value)
+{
+    uint16_t data = value ? 1 : 0;
+    Transaction(WRITE_SINGLE_COIL, addr, 1, &data, "write coil");
+}
+
+void TModbusStatusContext::ReadDisceteInputs(int addr, int nb, uint8_t *dest)
+{
+    ReadBits(READ_DISCRETE_INPUTS, addr, nb, dest, "read discrete input(s)");
+}
+
+void TModbusStatusContext::ReadHoldingRegisters(int addr, int nb, uint16_t *dest)
+{
+    Transaction(READ_HOLDING_REGISTERS, addr, nb, dest, "read holding register(s)");
+}
+
+void TModbusStatusContext::WriteHoldingRegisters(int addr, int nb, const uint16_t *data)
+{
+    std::vector<uint16_t> values(data, data + nb);
+    Transaction(WRITE_MULTIPLE_REGISTERS, addr, nb, &values[0], "write holding register(s)");
+}
+
+void TModbusStatusContext::WriteHoldingRegister(int addr, uint16_t value)
+{
+    Transaction(WRITE_SINGLE_REGISTER, addr, 1, &value, "write holding register");
+}
+
+void TModbusStatusContext::ReadInputRegisters(int addr, int nb, uint16_t *dest)
+{
+    Transaction(READ_INPUT_REGISTERS, addr, nb, dest, "read input register(s)");
+}
+
+const int TModbusErrorLog::DefaultIntervalMs;
+
+void TModbusErrorLog::WriteHeader(const char* event, const TModbusRegister& reg, bool write)
+{
+    Out << "modbus: event=" << event << " op=" << (write ? "write" : "read") <<
+        " slave=" << reg.Slave << " type=" << reg.TypeName() << " address=" << reg.Address;
+}
+
+void TModbusErrorLog::Error(const TModbusRegister& reg, bool write,
+                            TModbusContext::TStatus status, int exception_code)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto key = std::make_pair(reg.Index, write);
+    auto it = Entries.find(key);
+    if (it == Entries.end()) {
+        it = Entries.insert(std::make_pair(key, TEntry())).first;
+        it->second.Count = 0;
+    } else if (it->second.Status == status && it->second.ExceptionCode == exception_code &&
+               now - it->second.LastReport < std::chrono::milliseconds(IntervalMs)) {
+        ++it->second.Count;
+        ++it->second.Suppressed;
+        return;
+    }
+
+    TEntry& entry = it->second;
+    WriteHeader("error", reg, write);
+    Out << " status=" << TModbusContext::StatusText(status);
+    if (status == TModbusContext::SLAVE_EXCEPTION)
+        Out << " code=" << exception_code;
+    if (entry.Suppressed)
+        Out << " repeated=" << entry.Suppressed;
+    Out << std::endl;
+
+    entry.Status = status;
+    entry.ExceptionCode = exception_code;
+    ++entry.Count;
+    entry.Suppressed = 0;
+    entry.LastReport = now;
+}
+
+void TModbusErrorLog::Recovered(const TModbusRegister& reg, bool write)
+{
+    if (Entries.empty())
+        return;
+    auto it = Entries.find(std::make_pair(reg.Index, write));
+    if (it == Entries.end())
+        return;
+    WriteHeader("recovered", reg, write);
+    Out << " errors=" << it->second.Count << std::endl;
+    Entries.erase(it);
+}
+
+void TModbusErrorLog::Unavailable(const TModbusRegister& reg, int reprobe_interval_ms)
+{
+    WriteHeader("unavailable", reg, false);
+    Out << " reprobe=" << reprobe_interval_ms / 1000 << "s" << std::endl;
+}
+
+void TModbusErrorLog::Available(const TModbusRegister& reg)
+{
+    WriteHeader("available", reg, false);
+    Out << std::endl;
+}
+
+const int TResponseTimeEstimator::DefaultMinTimeoutUs;
+
+void TResponseTimeEstimator::AddSample(int slave, int usec)
+{
+    auto it = Slaves.find(slave);
+    if (it == Slaves.end()) {
+        TSlaveLatency& latency = Slaves[slave];
+        latency.SmoothedUs = usec;
+        latency.VariationUs = usec / 2.0;
+        return;
+    }
+
+    TSlaveLatency& latency = it->second;
+    latency.VariationUs = 0.75 * latency.VariationUs + 0.25 * std::fabs(latency.SmoothedUs - usec);
+    latency.SmoothedUs = 0.875 * latency.SmoothedUs + 0.125 * usec;
+    latency.Backoff = 0;
+}
+
+void TResponseTimeEstimator::AddTimeout(int slave)
+{
+    auto it = Slaves.find(slave);
+    // stop doubling once the cap is reached, so the shift can't overflow
+    if (it != Slaves.end() && BackedOffUs(it->second) < MaxTimeoutUs)
+        ++it->second.Backoff;
+}
+
+double TResponseTimeEstimator::BackedOffUs(const TSlaveLatency& latency)
+{
+    return std::ldexp(latency.SmoothedUs + 4 * latency.VariationUs, latency.Backoff);
+}
+
+int TResponseTimeEstimator::GetTimeoutUs(int slave) const
+{
+    auto it = Slaves.find(slave);
+    if (it == Slaves.end())
+        return MaxTimeoutUs;
+
+    double timeout = std::min<double>(MaxTimeoutUs, BackedOffUs(it->second));
+    return std::max(MinTimeoutUs, static_cast<int>(timeout));
+}
+
+class TDefaultModbusContext: public TModbusStatusContext {
 public:
     TDefaultModbusContext(const TModbusConnectionSettings& settings);
     void Connect();
     void Disconnect();
     void SetDebug(bool debug);
     void SetSlave(int slave);
-    void ReadCoils(int addr, int nb, uint8_t *dest);
-    void WriteCoil(int addr, int value);
-    void ReadDisceteInputs(int addr, int nb, uint8_t *dest);
-    void ReadHoldingRegisters(int addr, int nb, uint16_t *dest);
-    void WriteHoldingRegisters(int addr, int nb, const uint16_t *data);
-    void WriteHoldingRegister(int addr, uint16_t value);
-    void ReadInputRegisters(int addr, int nb, uint16_t *dest);
     void USleep(int usec);
+    std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
 private:
+    void StartRequest(bool adaptive_timeout, int frame_size = 0);
+    bool FinishRequest(bool ok);
+
     modbus_t* InnerContext;
+    TModbusConnectionSettings Settings;
+    TResponseTimeEstimator ResponseTime;
+    int Slave = 0;
+    int FrameGapUs;
+    int CharTimeUs;
+    int CurrentTimeoutUs = 0;
+    std::chrono::steady_clock::time_point RequestStartTime, LastFrameTime;
 };
 
 TDefaultModbusContext::TDefaultModbusContext(const TModbusConnectionSettings& settings)
+    : Settings(settings),
+      ResponseTime((settings.ResponseTimeoutMs > 0 ?
+                    settings.ResponseTimeoutMs :
+                    TModbusConnectionSettings::DefaultResponseTimeoutMs) * 1000)
 {
     InnerContext = modbus_new_rtu(settings.Device.c_str(), settings.BaudRate,
                                   settings.Parity, settings.DataBits, settings.StopBits);
@@ -40,18 +376,65 @@ TDefaultModbusContext::TDefaultModbusContext(const TModbusConnectionSettings& se
         throw TModbusException("failed to create modbus context");
     modbus_set_error_recovery(InnerContext, MODBUS_ERROR_RECOVERY_PROTOCOL); // FIXME
 
-    if (settings.ResponseTimeoutMs > 0) {
+    // Modbus RTU requires at least 3.5 character times of silence
+    // between frames, fixed at 1750us for baud rates above 19200
+    int char_bits = 1 + settings.DataBits + (settings.Parity == 'N' ? 0 : 1) + settings.StopBits;
+    FrameGapUs = settings.BaudRate > 19200 ? 1750 : 3500000 * char_bits / settings.BaudRate;
+    CharTimeUs = 1000000 * char_bits / settings.BaudRate + 1;
+}
+
+// frame_size is only needed for requests that may be broadcast
+void TDefaultModbusContext::StartRequest(bool adaptive_timeout, int frame_size)
+{
+    auto gap = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - LastFrameTime).count();
+    if (gap < FrameGapUs)
+        usleep(FrameGapUs - gap);
+
+    // writes may take noticeably longer on some devices (e.g. EEPROM
+    // updates) so only reads use the learned timeout
+    int timeout_us = adaptive_timeout ? ResponseTime.GetTimeoutUs(Slave) : ResponseTime.GetMaxTimeoutUs();
+    // there's no reply to broadcast requests, so libmodbus only
+    // has to wait until the frame leaves the tty buffer
+    if (Slave == 0)
+        timeout_us = frame_size * CharTimeUs + FrameGapUs;
+    if (timeout_us != CurrentTimeoutUs) {
         struct timeval tv;
-        tv.tv_sec = settings.ResponseTimeoutMs / 1000;
-        tv.tv_usec = (settings.ResponseTimeoutMs % 1000) * 1000;
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
         modbus_set_response_timeout(InnerContext, &tv);
+        CurrentTimeoutUs = timeout_us;
     }
+    RequestStartTime = std::chrono::steady_clock::now();
+}
+
+bool TDefaultModbusContext::FinishRequest(bool ok)
+{
+    int err = errno;
+    LastFrameTime = std::chrono::steady_clock::now();
+    if (Slave == 0)
+        return ok || err == ETIMEDOUT;
+
+    // exception responses still give us the response time
+    if (ok || (err > MODBUS_ENOBASE && err < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX))
+        ResponseTime.AddSample(Slave, std::chrono::duration_cast<std::chrono::microseconds>(
+                                   LastFrameTime - RequestStartTime).count());
+    else if (err == ETIMEDOUT)
+        ResponseTime.AddTimeout(Slave);
+    errno = err;
+    return ok;
 }
 
 void TDefaultModbusContext::Connect()
 {
     if (modbus_connect(InnerContext) != 0)
         throw TModbusException("couldn't initialize modbus connection");
+    try {
+        SetupSerialOptions(modbus_get_socket(InnerContext), Settings);
+    } catch (const TModbusException&) {
+        modbus_close(InnerContext);
+        throw;
+    }
     modbus_flush(InnerContext);
 }
 
@@ -68,58 +451,77 @@ void TDefaultModbusContext::SetDebug(bool debug)
 void TDefaultModbusContext::SetSlave(int slave)
 {
     modbus_set_slave(InnerContext, slave);
+    Slave = slave;
 }
 
-void TDefaultModbusContext::ReadCoils(int addr, int nb, uint8_t *dest)
+TModbusContext::TStatus TDefaultModbusContext::Execute(uint8_t function, int addr, int nb,
+                                                       uint16_t* data, int& exception_code)
 {
-    if (modbus_read_bits(InnerContext, addr, nb, dest) < nb)
-        throw TModbusException("failed to read " + std::to_string(nb) +
-                               " coil(s) @ " + std::to_string(addr));
-}
-
-void TDefaultModbusContext::WriteCoil(int addr, int value)
-{
-    if (modbus_write_bit(InnerContext, addr, value) < 0)
-        throw TModbusException("failed to write coil @ " + std::to_string(addr));
-}
-
-void TDefaultModbusContext::ReadDisceteInputs(int addr, int nb, uint8_t *dest)
-{
-    if (modbus_read_input_bits(InnerContext, addr, nb, dest) < nb)
-        throw TModbusException("failed to read " + std::to_string(nb) +
-                               "discrete input(s) @ " + std::to_string(addr));
-}
-
-void TDefaultModbusContext::ReadHoldingRegisters(int addr, int nb, uint16_t *dest)
-{
-    if (modbus_read_registers(InnerContext, addr, nb, dest) < nb)
-        throw TModbusException("failed to read " + std::to_string(nb) +
-                               " holding register(s) @ " + std::to_string(addr));
-}
-
-void TDefaultModbusContext::WriteHoldingRegisters(int addr, int nb, const uint16_t *data)
-{
-    if (modbus_write_registers(InnerContext, addr, nb, data) < nb)
-        throw TModbusException("failed to write " + std::to_string(nb) +
-                               " holding register(s) @ " + std::to_string(addr));
+    bool ok;
+    switch (function) {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+        {
+            uint8_t bits[MODBUS_MAX_READ_BITS];
+            StartRequest(true);
+            int rc = function == READ_COILS ?
+                modbus_read_bits(InnerContext, addr, nb, bits) :
+                modbus_read_input_bits(InnerContext, addr, nb, bits);
+            ok = FinishRequest(rc >= nb);
+            for (int i = 0; ok && i < nb; ++i)
+                data[i] = bits[i] & 1;
+        }
+        break;
+    case READ_HOLDING_REGISTERS:
+        StartRequest(true);
+        ok = FinishRequest(modbus_read_registers(InnerContext, addr, nb, data) >= nb);
+        break;
+    case READ_INPUT_REGISTERS:
+        StartRequest(true);
+        ok = FinishRequest(modbus_read_input_registers(InnerContext, addr, nb, data) >= nb);
+        break;
+    case WRITE_SINGLE_COIL:
+        StartRequest(false, 8);
+        ok = FinishRequest(modbus_write_bit(InnerContext, addr, data[0]) >= 0);
+        break;
+    case WRITE_SINGLE_REGISTER:
+        StartRequest(false, 8);
+        ok = FinishRequest(modbus_write_register(InnerContext, addr, data[0]) == 1);
+        break;
+    case WRITE_MULTIPLE_REGISTERS:
+        StartRequest(false, 9 + nb * 2);
+        ok = FinishRequest(modbus_write_registers(InnerContext, addr, nb, data) >= nb);
+        break;
+    default:
+        exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+        return SLAVE_EXCEPTION;
+    }
+    return ok ? OK : ErrnoStatus(exception_code);
 }
 
-void TDefaultModbusContext::WriteHoldingRegister(int addr, uint16_t value)
+void TDefaultModbusContext::USleep(int usec)
 {
-    if (modbus_write_register (InnerContext, addr, value) != 1)
-        throw TModbusException("failed to write holding register @ " + std::to_string(addr));
+    usleep(usec);
 }
 
-void TDefaultModbusContext::ReadInputRegisters(int addr, int nb, uint16_t *dest)
+std::vector<uint8_t> TDefaultModbusContext::RawRequest(const std::vector<uint8_t>& pdu)
 {
-    if (modbus_read_input_registers(InnerContext, addr, nb, dest) < nb)
-        throw TModbusException("failed to read " + std::to_string(nb) +
-                               " input register(s) @ " + std::to_string(addr));
-}
-
-void TDefaultModbusContext::USleep(int usec)
-{
-    usleep(usec);
+    // libmodbus expects the slave address in front of the PDU
+    // and appends the CRC itself
+    std::vector<uint8_t> request(1, Slave);
+    request.insert(request.end(), pdu.begin(), pdu.end());
+    uint8_t response[MODBUS_RTU_MAX_ADU_LENGTH];
+    StartRequest(false, request.size() + 2);
+    int rc = modbus_send_raw_request(InnerContext, request.data(), request.size());
+    if (rc > 0 && Slave)
+        rc = modbus_receive_confirmation(InnerContext, response);
+    // exception responses are valid responses here
+    if (!FinishRequest(rc > 0))
+        ThrowModbusError("raw request failed");
+    if (!Slave)
+        return std::vector<uint8_t>();
+    // strip the slave address and CRC
+    return std::vector<uint8_t>(response + 1, response + std::max(1, rc - 2));
 }
 
 PModbusContext TDefaultModbusConnector::CreateContext(const TModbusConnectionSettings& settings)
@@ -132,20 +534,36 @@ typedef std::pair<bool, int> TErrorMessage;
 class TRegisterHandler
 {
 public:
-    TRegisterHandler(const TModbusClient* client, std::shared_ptr<TModbusRegister> _reg)
-        : Client(client), reg(_reg) {}
+    TRegisterHandler(TModbusClient* client, TRegisterTable* table, int index,
+                     TModbusErrorLog* error_log)
+        : Client(client), reg(table->Registers[index]), Table(table), Index(index),
+          ErrorLog(error_log) {}
     virtual ~TRegisterHandler() {}
-    virtual std::vector<uint16_t> Read(PModbusContext ctx) = 0;
-    virtual void Write(PModbusContext ctx, const std::vector<uint16_t> & v);
+    virtual TModbusContext::TStatus Read(PModbusContext ctx, uint16_t* dest, int& exception_code) = 0;
+    virtual TModbusContext::TStatus Write(PModbusContext ctx, uint16_t* data, int& exception_code);
     std::shared_ptr<TModbusRegister> Register() const { return reg; }
     TErrorMessage Poll(PModbusContext ctx);
     int Flush(PModbusContext ctx);
     std::string TextValue() const;
 
     void SetTextValue(const std::string& v);
-    bool DidRead() const { return did_read; }
+    bool DidRead() const;
+    std::chrono::system_clock::time_point ReadTime() const;
+    bool IsDirty() const { return dirty; }
+    // false if Flush() has nothing to do
+    bool NeedsFlush() const { return dirty || flush_failed; }
+    std::vector<uint16_t> RawValue();
+    bool SetRawValue(const std::vector<uint16_t>& v, std::chrono::system_clock::time_point time);
+    void SetReadTime(std::chrono::system_clock::time_point time);
+    void WriteRawWords(int offset, int nb, const uint16_t* words);
+    bool IsUnavailable() const;
+
+    // number of consecutive ILLEGAL DATA ADDRESS responses
+    // after which the register is considered absent on the device
+    static const int UnavailableThreshold = 3;
+    static const int UnavailableReprobeIntervalMs = 300000;
 protected:
-    const TModbusClient* Client;
+    TModbusClient* Client;
 
 	template<typename T>
 	std::string ToScaledTextValue(T val) const;
@@ -156,20 +574,42 @@ protected:
 	std::vector<uint16_t> ConvertMasterValue(const std::string& v) const;
 
 private:
-    std::vector<uint16_t> value;
+    // the cached value lives in the word array of the register table
+    uint16_t* Value() { return &Table->Words[Table->Offset[Index]]; }
+    const uint16_t* Value() const { return &Table->Words[Table->Offset[Index]]; }
+    bool ValueEquals(const uint16_t* v) const;
+    void AssignValue(const uint16_t* v);
+
     std::shared_ptr<TModbusRegister> reg;
+    TRegisterTable* Table;
+    int Index;
+    TModbusErrorLog* ErrorLog;
     volatile bool dirty = false;
+    bool flush_failed = false;
     bool did_read = false;
-    std::mutex set_value_mutex;
+    int illegal_address_count = 0;
+    bool unavailable = false;
+    std::chrono::steady_clock::time_point reprobe_time;
+    // guards the value, dirty, did_read and the read time, which
+    // are also accessed by the TCP server and MQTT threads
+    mutable std::mutex set_value_mutex;
 };
 
-void TRegisterHandler::Write(PModbusContext, const std::vector<uint16_t> &)
+const int TRegisterHandler::UnavailableThreshold;
+const int TRegisterHandler::UnavailableReprobeIntervalMs;
+
+TModbusContext::TStatus TRegisterHandler::Write(PModbusContext, uint16_t*, int& exception_code)
 {
-    throw TModbusException("trying to write read-only register");
-};
+    // read-only register
+    exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+    return TModbusContext::SLAVE_EXCEPTION;
+}
 
 TErrorMessage TRegisterHandler::Poll(PModbusContext ctx)
 {
+    if (IsUnavailable())
+        return std::make_pair(false, 0);
+
     int message = 0;
     // set poll error message empty
     if (reg->ErrorMessage == "Poll") {
@@ -178,33 +618,54 @@ TErrorMessage TRegisterHandler::Poll(PModbusContext ctx)
     }
     if (!reg->Poll || dirty)
         return std::make_pair(false, 0); // write-only register
+    Table->LastPoll[Index] = Client->Now();
 
     bool first_poll = !did_read;
-    std::vector<uint16_t> new_value;
+    uint16_t new_value[TModbusRegister::MaxWidth];
+    int exception_code = 0;
     ctx->SetSlave(reg->Slave);
-    try {
-        new_value = Read(ctx);
-    } catch (const TModbusException& e) {
-        std::cerr << "TRegisterHandler::Poll(): warning: " << e.what() << " slave_id is "
-				  << 	reg->Slave << "(0x" << std::hex << reg->Slave << ")" << std::endl;
-        std::cerr << std::dec;
+    // errors are frequent on a bus with a dead slave, so they
+    // are reported by status and go to the rate-limited log
+    TModbusContext::TStatus status = Read(ctx, new_value, exception_code);
+    auto read_time = std::chrono::system_clock::now();
+    Client->TransactionDone(status);
+    if (status != TModbusContext::OK) {
         reg->ErrorMessage = "Poll";
+        if (status == TModbusContext::SLAVE_EXCEPTION) {
+            if (exception_code != TModbusSlaveException::ILLEGAL_DATA_ADDRESS)
+                illegal_address_count = 0;
+            else if (++illegal_address_count >= UnavailableThreshold) {
+                if (!unavailable)
+                    ErrorLog->Unavailable(*reg, UnavailableReprobeIntervalMs);
+                unavailable = true;
+                reprobe_time = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(UnavailableReprobeIntervalMs);
+                return std::make_pair(true, 1);
+            }
+        }
+        ErrorLog->Error(*reg, false, status, exception_code);
         return std::make_pair(true, 1);
     }
-    did_read = true;
+    if (unavailable)
+        ErrorLog->Available(*reg);
+    unavailable = false;
+    illegal_address_count = 0;
+    ErrorLog->Recovered(*reg, false);
     set_value_mutex.lock();
-    if (value != new_value) {
+    did_read = true;
+    Table->ReadTime[Index] = read_time;
+    if (!ValueEquals(new_value)) {
         if (dirty) {
             set_value_mutex.unlock();
             return std::make_pair(true, message);
         }
-        value = new_value;
+        AssignValue(new_value);
         set_value_mutex.unlock();
 
         if (Client->DebugEnabled()) {
             std::cerr << "new val for " << reg->ToString() << ": " ;
-            for (const auto & el : new_value) {
-				std::cerr << el << " ";
+            for (int i = 0; i < Table->Width[Index]; ++i) {
+				std::cerr << new_value[i] << " ";
 			}
 			std::cerr << std::endl;
 		}
@@ -214,6 +675,12 @@ TErrorMessage TRegisterHandler::Poll(PModbusContext ctx)
     return std::make_pair(first_poll, message);
 }
 
+bool TRegisterHandler::IsUnavailable() const
+{
+    // registers missing on the device are only re-probed occasionally
+    return unavailable && std::chrono::steady_clock::now() < reprobe_time;
+}
+
 int TRegisterHandler::Flush(PModbusContext ctx)
 {
     int message = 0;
@@ -222,19 +689,24 @@ int TRegisterHandler::Flush(PModbusContext ctx)
         reg->ErrorMessage = "";
         message = 2;
     }
+    flush_failed = false;
     set_value_mutex.lock();
     if (dirty) {
         dirty = false;
+        uint16_t data[TModbusRegister::MaxWidth];
+        std::copy_n(Value(), Table->Width[Index], data);
         set_value_mutex.unlock();
         ctx->SetSlave(reg->Slave);
-        try {
-            Write(ctx, value);
-        } catch (const TModbusException& e) {
-            std::cerr << "TRegisterHandler::Flush(): warning: " << e.what() << " slave_id is " << reg->Slave << "(0x" << std::hex << reg->Slave << ")" <<  std::endl;
-            std::cerr << std::dec;
+        int exception_code = 0;
+        TModbusContext::TStatus status = Write(ctx, data, exception_code);
+        Client->TransactionDone(status);
+        if (status != TModbusContext::OK) {
+            ErrorLog->Error(*reg, true, status, exception_code);
             reg->ErrorMessage = "Flush";
+            flush_failed = true;
             return 1;
         }
+        ErrorLog->Recovered(*reg, true);
     }
     else {
         set_value_mutex.unlock();
@@ -242,8 +714,22 @@ int TRegisterHandler::Flush(PModbusContext ctx)
     return message;
 }
 
+bool TRegisterHandler::DidRead() const
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    return did_read;
+}
+
+std::chrono::system_clock::time_point TRegisterHandler::ReadTime() const
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    return Table->ReadTime[Index];
+}
+
 std::string TRegisterHandler::TextValue() const
 {
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    const uint16_t* value = Value();
     switch (reg->Format) {
     case TModbusRegister::U16:
         return ToScaledTextValue(value[0]);
@@ -343,11 +829,58 @@ double TRegisterHandler::FromScaledTextValue(const std::string& str) const
 
 
 
+std::vector<uint16_t> TRegisterHandler::RawValue()
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    return std::vector<uint16_t>(Value(), Value() + Table->Width[Index]);
+}
+
+bool TRegisterHandler::ValueEquals(const uint16_t* v) const
+{
+    return std::equal(v, v + Table->Width[Index], Value());
+}
+
+void TRegisterHandler::AssignValue(const uint16_t* v)
+{
+    std::copy_n(v, Table->Width[Index], Value());
+}
+
+// Updates the cached value and its read time without writing it to the device.
+// Returns true if the value needs to be published.
+bool TRegisterHandler::SetRawValue(const std::vector<uint16_t>& v,
+                                   std::chrono::system_clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    // don't clobber the value that's about to be written
+    if (v.size() != Table->Width[Index])
+        return false;
+    if (dirty || (did_read && ValueEquals(&v[0])))
+        return false;
+    AssignValue(&v[0]);
+    did_read = true;
+    Table->ReadTime[Index] = time;
+    return true;
+}
+
+void TRegisterHandler::SetReadTime(std::chrono::system_clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    Table->ReadTime[Index] = time;
+}
+
+// Queues the words for writing, keeping the rest of the value intact
+void TRegisterHandler::WriteRawWords(int offset, int nb, const uint16_t* words)
+{
+    std::lock_guard<std::mutex> lock(set_value_mutex);
+    std::copy(words, words + nb, Value() + offset);
+    dirty = true;
+}
+
 void TRegisterHandler::SetTextValue(const std::string& v)
 {
     std::lock_guard<std::mutex> lock(set_value_mutex);
     dirty = true;
-    value = ConvertMasterValue(v);
+    AssignValue(&ConvertMasterValue(v)[0]);
 }
 
 
@@ -411,75 +944,70 @@ std::vector<uint16_t> TRegisterHandler::ConvertMasterValue(const std::string& st
 class TCoilHandler: public TRegisterHandler
 {
 public:
-    TCoilHandler(const TModbusClient* client, std::shared_ptr<TModbusRegister> _reg)
-        : TRegisterHandler(client, _reg) {}
+    TCoilHandler(TModbusClient* client, TRegisterTable* table, int index,
+                 TModbusErrorLog* error_log)
+        : TRegisterHandler(client, table, index, error_log) {}
 
-    std::vector<uint16_t> Read(PModbusContext ctx) {
-        unsigned char b;
-        ctx->ReadCoils(Register()->Address, 1, &b);
-        return {static_cast<uint16_t>(b & 1)};
+    TModbusContext::TStatus Read(PModbusContext ctx, uint16_t* dest, int& exception_code) {
+        return ctx->Execute(READ_COILS, Register()->Address, 1, dest, exception_code);
     }
 
-    void Write(PModbusContext ctx, const std::vector<uint16_t> & v) {
-        ctx->WriteCoil(Register()->Address, v[0]);
+    TModbusContext::TStatus Write(PModbusContext ctx, uint16_t* data, int& exception_code) {
+        return ctx->Execute(WRITE_SINGLE_COIL, Register()->Address, 1, data, exception_code);
     }
 };
 
 class TDiscreteInputHandler: public TRegisterHandler
 {
 public:
-    TDiscreteInputHandler(const TModbusClient* client, std::shared_ptr<TModbusRegister> _reg)
-        : TRegisterHandler(client, _reg) {}
+    TDiscreteInputHandler(TModbusClient* client, TRegisterTable* table, int index,
+                          TModbusErrorLog* error_log)
+        : TRegisterHandler(client, table, index, error_log) {}
 
-    std::vector<uint16_t> Read(PModbusContext ctx) {
-        uint8_t b;
-        ctx->ReadDisceteInputs(Register()->Address, 1, &b);
-        return {static_cast<uint16_t>(b & 1)};
+    TModbusContext::TStatus Read(PModbusContext ctx, uint16_t* dest, int& exception_code) {
+        return ctx->Execute(READ_DISCRETE_INPUTS, Register()->Address, 1, dest, exception_code);
     }
 };
 
 class THoldingRegisterHandler: public TRegisterHandler
 {
 public:
-    THoldingRegisterHandler(const TModbusClient* client, std::shared_ptr<TModbusRegister> _reg)
-        : TRegisterHandler(client, _reg) {}
+    THoldingRegisterHandler(TModbusClient* client, TRegisterTable* table, int index,
+                            TModbusErrorLog* error_log)
+        : TRegisterHandler(client, table, index, error_log) {}
 
-    std::vector<uint16_t> Read(PModbusContext ctx) {
-        std::vector<uint16_t> v;
-        v.resize(Register()->Width());
-        ctx->ReadHoldingRegisters(Register()->Address, Register()->Width(), &v[0]);
-        return v;
+    TModbusContext::TStatus Read(PModbusContext ctx, uint16_t* dest, int& exception_code) {
+        return ctx->Execute(READ_HOLDING_REGISTERS, Register()->Address, Register()->Width(),
+                            dest, exception_code);
     }
 
-    void Write(PModbusContext ctx, const std::vector<uint16_t> & v) {
+    TModbusContext::TStatus Write(PModbusContext ctx, uint16_t* data, int& exception_code) {
         // FIXME: use
         if (Client->DebugEnabled())
             std::cerr << "write: " << Register()->ToString() << std::endl;
-        if (Register()->Width() == 1) {
-            ctx->WriteHoldingRegister(Register()->Address, v[0]);
-        } else {
-            ctx->WriteHoldingRegisters(Register()->Address, Register()->Width(), &v[0]);
-        }
+        int width = Register()->Width();
+        return ctx->Execute(width == 1 ? WRITE_SINGLE_REGISTER : WRITE_MULTIPLE_REGISTERS,
+                            Register()->Address, width, data, exception_code);
     }
 };
 
 class TInputRegisterHandler: public TRegisterHandler
 {
 public:
-    TInputRegisterHandler(const TModbusClient* client, std::shared_ptr<TModbusRegister> _reg)
-        : TRegisterHandler(client, _reg) {}
+    TInputRegisterHandler(TModbusClient* client, TRegisterTable* table, int index,
+                          TModbusErrorLog* error_log)
+        : TRegisterHandler(client, table, index, error_log) {}
 
-    std::vector<uint16_t> Read(PModbusContext ctx) {
-        std::vector<uint16_t> v;
-        v.resize(Register()->Width());
-        ctx->ReadInputRegisters(Register()->Address, Register()->Width(), &v[0]);
-        return v;
+    TModbusContext::TStatus Read(PModbusContext ctx, uint16_t* dest, int& exception_code) {
+        return ctx->Execute(READ_INPUT_REGISTERS, Register()->Address, Register()->Width(),
+                            dest, exception_code);
     }
 };
 
 TModbusClient::TModbusClient(const TModbusConnectionSettings& settings,
                              PModbusConnector connector)
-    : Active(false),
+    : Device(settings.Device),
+      Active(false),
       PollInterval(1000)
 {
     if (!connector)
@@ -497,16 +1025,32 @@ void TModbusClient::AddRegister(std::shared_ptr<TModbusRegister> reg)
 {
     if (Active)
         throw TModbusException("can't add registers to the active client");
-    if (handlers.find(reg) != handlers.end())
-        throw TModbusException("duplicate register");
-    handlers[reg] = std::unique_ptr<TRegisterHandler>(CreateRegisterHandler(reg));
+    if (reg->Index >= 0) {
+        if (reg->Index < Table.Size() && Table.Registers[reg->Index] == reg)
+            throw TModbusException("duplicate register");
+        throw TModbusException("register is already added to another client");
+    }
+
+    reg->Index = Table.Size();
+    Table.Registers.push_back(reg);
+    Table.Slave.push_back(reg->Slave);
+    Table.Width.push_back(reg->Width());
+    Table.Offset.push_back(Table.Words.size());
+    Table.LastPoll.push_back(std::chrono::steady_clock::time_point());
+    Table.ReadTime.push_back(std::chrono::system_clock::time_point());
+    Table.Words.resize(Table.Words.size() + reg->Width());
+    Table.Handlers.emplace_back(CreateRegisterHandler(reg));
+    if (!reg->IsBroadcast()) {
+        for (int i = 0; i < reg->Width(); ++i)
+            RegisterWords[TWordAddress(reg->Slave, reg->Type, reg->Address + i)] = std::make_pair(reg->Index, i);
+    }
 }
 
 void TModbusClient::Connect()
 {
     if (Active)
         return;
-    if (!handlers.size())
+    if (!Table.Size())
         throw TModbusException("no registers defined");
     Context->Connect();
     Active = true;
@@ -520,35 +1064,267 @@ void TModbusClient::Disconnect()
 
 void TModbusClient::Cycle()
 {
-    Connect();
+    {
+        std::lock_guard<std::mutex> lock(TimingStatsMutex);
+        TimingStats = Context->GetTimingStats();
+    }
+
+    if (!Active && !Reopen()) {
+        // don't hold up the other ports while this one is gone
+        FailRawRequests("port " + Device + " is not available");
+        Context->USleep(IdlePollIntervalMs * 1000);
+        return;
+    }
+
+    auto now = Now();
+    std::set<int> interesting;
+    if (BackgroundPollInterval > 0) {
+        std::lock_guard<std::mutex> lock(InterestMutex);
+        for (auto it = InterestDeadlines.begin(); it != InterestDeadlines.end(); ) {
+            if (it->second <= now)
+                it = InterestDeadlines.erase(it);
+            else
+                interesting.insert((it++)->first);
+        }
+    }
 
     // FIXME: that's suboptimal polling implementation.
     // Need to implement bunching of Modbus registers.
     // Note that for multi-register values, all values
     // corresponding to single register should be retrieved
     // by single query.
-    for (const auto& p: handlers) {
-        for(const auto& q: handlers) {
-            int flush_message = q.second->Flush(Context);
+    bool polled = false;
+    int n = Table.Size();
+    for (int i = 0; i < n; ++i) {
+        ProcessRawRequests();
+        ProcessCachedWrites();
+
+        for (int j = 0; j < n; ++j) {
+            TRegisterHandler* handler = Table.Handlers[j].get();
+            if (!handler->NeedsFlush())
+                continue;
+            const auto& reg = Table.Registers[j];
+            bool broadcast = !Table.Slave[j] && handler->IsDirty();
+            int flush_message = handler->Flush(Context);
             if ((flush_message == 1) && (ErrorCallback)) {
-                ErrorCallback(q.first);
+                ErrorCallback(reg);
             }
             if ((flush_message == 2) && (DeleteErrorsCallback)) {
-                DeleteErrorsCallback(q.first);
+                DeleteErrorsCallback(reg);
             }
+            if (broadcast && flush_message != 1)
+                CompleteBroadcast(j);
+            if (!Active)
+                return;
         }
 
-        const auto& poll_message = p.second->Poll(Context);
-        if ((poll_message.second == 1) && (ErrorCallback)) {
-            ErrorCallback(p.first);
+        // check the actual state of the devices that received
+        // broadcast writes before continuing with regular polling
+        std::vector<int> verify;
+        verify.swap(PendingVerification);
+        for (int index: verify) {
+            PollRegister(index);
+            if (!Active)
+                return;
         }
-        if ((poll_message.second == 2) && (DeleteErrorsCallback)) {
-                DeleteErrorsCallback(p.first);
-        }
-        if ((poll_message.first) && (Callback) && (poll_message.second != 1)) {
-                Callback(p.first);
-            }
+
+        // registers known to be absent on the device
+        // don't take any bus time until re-probed.
+        // Broadcast registers are never polled.
+        if (!Table.Slave[i] || Table.Handlers[i]->IsUnavailable())
+            continue;
+
+        // the registers nobody looks at are polled at the background rate.
+        // Writes are flushed above regardless, so they are never delayed.
+        if (BackgroundPollInterval > 0 && !interesting.count(Table.Slave[i]) &&
+            Table.LastPoll[i].time_since_epoch().count() &&
+            now - Table.LastPoll[i] < std::chrono::milliseconds(BackgroundPollInterval))
+            continue;
+
+        PollRegister(i);
+        if (!Active)
+            return;
         Context->USleep(PollInterval * 1000);
+        polled = true;
+    }
+
+    // don't spin when no registers are due, but keep
+    // handling writes and raw requests
+    if (!polled)
+        Context->USleep(std::max(PollInterval, IdlePollIntervalMs) * 1000);
+}
+
+void TModbusClient::QueueRawRequest(int slave, const std::vector<uint8_t>& pdu,
+                                    const TRawRequestCallback& callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(RawRequestMutex);
+        RawRequests.push_back(TRawRequest{ slave, pdu, callback });
+    }
+    // don't keep the request waiting for the poll interval to pass
+    Context->Interrupt();
+}
+
+void TModbusClient::SetRawRequestsPerPoll(int n)
+{
+    RawRequestsPerPoll = n;
+}
+
+const int TModbusClient::IdlePollIntervalMs;
+const int TModbusClient::MaxInterestDurationMs;
+
+void TModbusClient::SetBackgroundPollInterval(int ms)
+{
+    BackgroundPollInterval = ms;
+}
+
+void TModbusClient::SetInterest(int slave, int duration_ms)
+{
+    duration_ms = std::max(0, std::min(duration_ms, MaxInterestDurationMs));
+    std::lock_guard<std::mutex> lock(InterestMutex);
+    auto deadline = Now() + std::chrono::milliseconds(duration_ms);
+    auto& current = InterestDeadlines[slave];
+    if (current < deadline)
+        current = deadline;
+}
+
+void TModbusClient::SetClock(const TClock& clock)
+{
+    Clock = clock;
+}
+
+std::chrono::steady_clock::time_point TModbusClient::Now() const
+{
+    return Clock();
+}
+
+bool TModbusClient::HasPendingRawRequests() const
+{
+    std::lock_guard<std::mutex> lock(RawRequestMutex);
+    return !RawRequests.empty();
+}
+
+void TModbusClient::ProcessRawRequests()
+{
+    for (int i = 0; !RawRequestsPerPoll || i < RawRequestsPerPoll; ++i) {
+        TRawRequest request;
+        {
+            std::lock_guard<std::mutex> lock(RawRequestMutex);
+            if (RawRequests.empty())
+                return;
+            request = RawRequests.front();
+            RawRequests.pop_front();
+        }
+
+        std::vector<uint8_t> response;
+        std::string error;
+        Context->SetSlave(request.Slave);
+        try {
+            response = Context->RawRequest(request.PDU);
+        } catch (const TModbusException& e) {
+            error = e.what();
+        }
+        if (request.Callback)
+            request.Callback(response, error);
+    }
+}
+
+void TModbusClient::FailRawRequests(const std::string& error)
+{
+    std::deque<TRawRequest> requests;
+    {
+        std::lock_guard<std::mutex> lock(RawRequestMutex);
+        requests.swap(RawRequests);
+    }
+    for (const auto& request: requests) {
+        if (request.Callback)
+            request.Callback(std::vector<uint8_t>(), error);
+    }
+}
+
+const int TModbusClient::PortFailureThreshold;
+const int TModbusClient::MinReopenDelayMs;
+const int TModbusClient::MaxReopenDelayMs;
+
+void TModbusClient::TransactionDone(TModbusContext::TStatus status)
+{
+    if (status != TModbusContext::IO_ERROR)
+        IOErrorCount = 0;
+    else if (++IOErrorCount >= PortFailureThreshold && Active)
+        ClosePort();
+}
+
+void TModbusClient::ClosePort()
+{
+    std::cerr << "TModbusClient: warning: port " << Device << " failed, reopening in " <<
+        ReopenDelayMs << "ms" << std::endl;
+    Disconnect();
+    ScheduleReopen();
+}
+
+void TModbusClient::ScheduleReopen()
+{
+    Failed = true;
+    ReopenTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(ReopenDelayMs);
+    ReopenDelayMs = std::min(ReopenDelayMs * 2, MaxReopenDelayMs);
+}
+
+bool TModbusClient::Reopen()
+{
+    if (Failed && std::chrono::steady_clock::now() < ReopenTime)
+        return false;
+    if (!Table.Size())
+        throw TModbusException("no registers defined");
+
+    try {
+        Connect();
+    } catch (const TModbusException& e) {
+        std::cerr << "TModbusClient: warning: " << e.what() << ", retrying in " <<
+            ReopenDelayMs << "ms" << std::endl;
+        ScheduleReopen();
+        return false;
+    }
+    if (Failed)
+        std::cerr << "TModbusClient: port " << Device << " reopened" << std::endl;
+    Failed = false;
+    IOErrorCount = 0;
+    ReopenDelayMs = MinReopenDelayMs;
+    return true;
+}
+
+void TModbusClient::PollRegister(int index)
+{
+    const auto& reg = Table.Registers[index];
+    const auto& poll_message = Table.Handlers[index]->Poll(Context);
+    if ((poll_message.second == 1) && (ErrorCallback)) {
+        ErrorCallback(reg);
+    }
+    if ((poll_message.second == 2) && (DeleteErrorsCallback)) {
+            DeleteErrorsCallback(reg);
+    }
+    if ((poll_message.first) && (Callback) && (poll_message.second != 1)) {
+            Callback(reg);
+        }
+}
+
+void TModbusClient::CompleteBroadcast(int index)
+{
+    auto it = BroadcastMembers.find(index);
+    if (it == BroadcastMembers.end())
+        return;
+
+    // the devices don't reply to broadcasts, so assume the write
+    // succeeded everywhere and let the following poll correct it
+    std::vector<uint16_t> value = Table.Handlers[index]->RawValue();
+    auto write_time = std::chrono::system_clock::now();
+    for (int member: it->second) {
+        const auto& reg = Table.Registers[member];
+        if (Table.Handlers[member]->SetRawValue(value, write_time)) {
+            if (Callback)
+                Callback(reg);
+        }
+        if (reg->Poll)
+            PendingVerification.push_back(member);
     }
 }
 
@@ -561,6 +1337,93 @@ void TModbusClient::WriteHoldingRegister(int slave, int address, uint16_t value)
 
 
 
+void TModbusClient::SetBroadcastMembers(std::shared_ptr<TModbusRegister> reg,
+                                        const std::vector<std::shared_ptr<TModbusRegister>>& members)
+{
+    if (!reg->IsBroadcast())
+        throw TModbusException("not a broadcast register: " + reg->ToString());
+    GetHandler(reg);
+    std::vector<int> indices;
+    for (const auto& member: members) {
+        GetHandler(member);
+        if (member->Type != reg->Type || member->Width() != reg->Width())
+            throw TModbusException("broadcast group member " + member->ToString() +
+                                   " doesn't match " + reg->ToString());
+        indices.push_back(member->Index);
+    }
+    BroadcastMembers[reg->Index] = indices;
+}
+
+void TModbusClient::ReadCachedValues(int slave, TModbusRegister::RegisterType type,
+                                     int addr, int nb, uint16_t* dest) const
+{
+    int index = -1;
+    std::vector<uint16_t> value;
+    for (int i = 0; i < nb; ++i) {
+        auto it = RegisterWords.find(TWordAddress(slave, type, addr + i));
+        if (it == RegisterWords.end())
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_ADDRESS,
+                                        "no register @ " + std::to_string(addr + i));
+        if (it->second.first != index) {
+            index = it->second.first;
+            TRegisterHandler* handler = Table.Handlers[index].get();
+            if (!handler->DidRead())
+                throw TModbusSlaveException(TModbusSlaveException::GATEWAY_TARGET_FAILED_TO_RESPOND,
+                                            "no value for " + Table.Registers[index]->ToString());
+            value = handler->RawValue();
+        }
+        *dest++ = value[it->second.second];
+    }
+}
+
+void TModbusClient::WriteCachedValues(int slave, TModbusRegister::RegisterType type,
+                                      int addr, int nb, const uint16_t* data)
+{
+    // check the whole range first so that nothing is written on error
+    std::vector<std::pair<int, int>> words;
+    for (int i = 0; i < nb; ++i) {
+        auto it = RegisterWords.find(TWordAddress(slave, type, addr + i));
+        if (it == RegisterWords.end() || Table.Registers[it->second.first]->IsReadOnly())
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_ADDRESS,
+                                        "no writable register @ " + std::to_string(addr + i));
+        words.push_back(it->second);
+    }
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<std::pair<int, std::chrono::system_clock::time_point>> written;
+    for (int i = 0; i < nb; ) {
+        int index = words[i].first;
+        int n = 1;
+        while (i + n < nb && words[i + n].first == index)
+            ++n;
+        Table.Handlers[index]->WriteRawWords(words[i].second, n, data + i);
+        written.push_back(std::make_pair(index, now));
+        i += n;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(CachedWritesMutex);
+        CachedWrites.insert(CachedWrites.end(), written.begin(), written.end());
+    }
+    Context->Interrupt();
+}
+
+// Reports the values written by WriteCachedValues(), so that the
+// callback and the read time are only used by the thread running Cycle()
+void TModbusClient::ProcessCachedWrites()
+{
+    std::vector<std::pair<int, std::chrono::system_clock::time_point>> written;
+    {
+        std::lock_guard<std::mutex> lock(CachedWritesMutex);
+        written.swap(CachedWrites);
+    }
+    for (const auto& item: written) {
+        Table.Handlers[item.first]->SetReadTime(item.second);
+        if (Callback)
+            Callback(Table.Registers[item.first]);
+    }
+}
+
 void TModbusClient::SetTextValue(std::shared_ptr<TModbusRegister> reg, const std::string& value)
 {
     GetHandler(reg)->SetTextValue(value);
@@ -576,6 +1439,17 @@ bool TModbusClient::DidRead(std::shared_ptr<TModbusRegister> reg) const
     return GetHandler(reg)->DidRead();
 }
 
+std::chrono::system_clock::time_point TModbusClient::GetReadTime(std::shared_ptr<TModbusRegister> reg) const
+{
+    return GetHandler(reg)->ReadTime();
+}
+
+TModbusTimingStats TModbusClient::GetTimingStats() const
+{
+    std::lock_guard<std::mutex> lock(TimingStatsMutex);
+    return TimingStats;
+}
+
 void TModbusClient::SetCallback(const TModbusCallback& callback)
 {
     Callback = callback;
@@ -606,25 +1480,29 @@ bool TModbusClient::DebugEnabled() const {
     return Debug;
 }
 
-const std::unique_ptr<TRegisterHandler>& TModbusClient::GetHandler(std::shared_ptr<TModbusRegister> reg) const
+void TModbusClient::SetErrorLogInterval(int ms)
+{
+    ErrorLog.SetInterval(ms);
+}
+
+TRegisterHandler* TModbusClient::GetHandler(std::shared_ptr<TModbusRegister> reg) const
 {
-    auto it = handlers.find(reg);
-    if (it == handlers.end())
+    if (reg->Index < 0 || reg->Index >= Table.Size() || Table.Registers[reg->Index] != reg)
         throw TModbusException("register not found");
-    return it->second;
+    return Table.Handlers[reg->Index].get();
 }
 
 TRegisterHandler* TModbusClient::CreateRegisterHandler(std::shared_ptr<TModbusRegister> reg)
 {
     switch (reg->Type) {
     case TModbusRegister::RegisterType::COIL:
-        return new TCoilHandler(this, reg);
+        return new TCoilHandler(this, &Table, reg->Index, &ErrorLog);
     case TModbusRegister::RegisterType::DISCRETE_INPUT:
-        return new TDiscreteInputHandler(this, reg);
+        return new TDiscreteInputHandler(this, &Table, reg->Index, &ErrorLog);
     case TModbusRegister::RegisterType::HOLDING_REGISTER:
-        return new THoldingRegisterHandler(this, reg);
+        return new THoldingRegisterHandler(this, &Table, reg->Index, &ErrorLog);
     case TModbusRegister::RegisterType::INPUT_REGISTER:
-        return new TInputRegisterHandler(this, reg);
+        return new TInputRegisterHandler(this, &Table, reg->Index, &ErrorLog);
     default:
         throw TModbusException("bad register type");
     }
@@ -1,12 +1,18 @@
 #pragma once
 
 #include <map>
+#include <tuple>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <deque>
+#include <set>
+#include <chrono>
 #include <sstream>
 #include <exception>
 #include <functional>
+#include <iostream>
 
 // #include <modbus/modbus.h>
 
@@ -14,6 +20,9 @@ class TRegisterHandler;
 
 struct TModbusConnectionSettings
 {
+    // used when response_timeout_ms is not specified (libmodbus default)
+    static const int DefaultResponseTimeoutMs = 500;
+
     TModbusConnectionSettings(std::string device = "/dev/ttyS0",
                               int baud_rate = 9600,
                               char parity = 'N',
@@ -30,6 +39,17 @@ struct TModbusConnectionSettings
     int DataBits;
     int StopBits;
     int ResponseTimeoutMs;
+    // Sets ASYNC_LOW_LATENCY on the port so that received data isn't
+    // held in the driver, the native transport also tunes VMIN to the
+    // expected response size
+    bool LowLatency = false;
+    // Kernel RS-485 direction control (TIOCSRS485) for the adapters
+    // that toggle the transceiver with RTS
+    bool RS485 = false;
+    // RTS level while sending, the opposite level is set afterwards
+    bool RS485RtsOnSend = true;
+    int RS485DelayBeforeSendMs = 0;
+    int RS485DelayAfterSendMs = 0;
 };
 
 inline ::std::ostream& operator<<(::std::ostream& os, const TModbusConnectionSettings& settings) {
@@ -38,9 +58,76 @@ inline ::std::ostream& operator<<(::std::ostream& os, const TModbusConnectionSet
         " timeout " << settings.ResponseTimeoutMs << ">";
 }
 
+// Applies LowLatency and RS-485 settings to the open serial port.
+// Low latency mode is optional, so its failure is only reported,
+// while unsupported RS-485 mode throws TModbusException.
+void SetupSerialOptions(int fd, const TModbusConnectionSettings& settings);
+
+// Bus timing for the contexts that can measure it (see
+// TModbusRtuTransport). Turnaround is the time from the end of the
+// request on the wire to the first byte of the response, i.e. how fast
+// the slave and the tty driver respond. Only transactions that got
+// a response are counted.
+struct TModbusTimingStats
+{
+    uint64_t Responses = 0;
+    // totals, divide by Responses for averages
+    uint64_t TurnaroundUs = 0;
+    uint64_t TransactionUs = 0;
+    // time spent transmitting the request and the response
+    uint64_t WireUs = 0;
+    uint32_t MinTurnaroundUs = 0;
+    uint32_t MaxTurnaroundUs = 0;
+
+    void AddSample(uint32_t turnaround_us, uint32_t transaction_us, uint32_t wire_us);
+};
+
+// Tracks per-slave response latency in TCP RTO fashion (RFC 6298):
+// the timeout is the smoothed round-trip time plus four times its
+// mean deviation, doubled on each consecutive timeout and capped
+// by the configured response timeout.
+class TResponseTimeEstimator
+{
+public:
+    static const int DefaultMinTimeoutUs = 10000;
+
+    TResponseTimeEstimator(int max_timeout_us, int min_timeout_us = DefaultMinTimeoutUs)
+        : MaxTimeoutUs(max_timeout_us), MinTimeoutUs(min_timeout_us) {}
+    void AddSample(int slave, int usec);
+    void AddTimeout(int slave);
+    int GetTimeoutUs(int slave) const;
+    int GetMaxTimeoutUs() const { return MaxTimeoutUs; }
+
+private:
+    struct TSlaveLatency
+    {
+        double SmoothedUs = 0;
+        double VariationUs = 0;
+        int Backoff = 0;
+    };
+
+    static double BackedOffUs(const TSlaveLatency& latency);
+
+    int MaxTimeoutUs;
+    int MinTimeoutUs;
+    std::map<int, TSlaveLatency> Slaves;
+};
+
 class TModbusContext
 {
 public:
+    // Outcome of Execute(). The values are also used in trace files
+    // (see modbus_trace.h), so don't reorder them.
+    enum TStatus {
+        OK = 0,
+        SLAVE_EXCEPTION = 1,
+        IO_ERROR = 2,
+        TIMEOUT = 3,
+        // CRC errors, malformed or unexpected responses
+        BAD_RESPONSE = 4
+    };
+    static const char* StatusText(TStatus status);
+
     virtual ~TModbusContext();
     virtual void Connect() = 0;
     virtual void Disconnect() = 0;
@@ -54,10 +141,48 @@ public:
     virtual void WriteHoldingRegister(int addr, uint16_t value) = 0;
     virtual void ReadInputRegisters(int addr, int nb, uint16_t *dest) = 0;
     virtual void USleep(int usec) = 0;
+    // Makes USleep() in progress (or the next one) return early, so
+    // that queued requests are served right away. May be called from
+    // any thread. Does nothing by default.
+    virtual void Interrupt();
+    // Sends the PDU (function code and data) to the current slave and
+    // returns the response PDU. Exception responses are returned as is.
+    // Broadcast requests return an empty response.
+    virtual std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
+    // Non-throwing register access used by the polling loop. Reads
+    // (functions 1-4) fill data, writes (5, 6 and 16) take the values
+    // from data, one word per coil or discrete input. exception_code is
+    // set when SLAVE_EXCEPTION is returned. The default implementation
+    // calls the functions above and converts their exceptions.
+    virtual TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data,
+                            int& exception_code);
+    // Empty unless the context measures bus timing
+    virtual TModbusTimingStats GetTimingStats() const;
 };
 
 typedef std::shared_ptr<TModbusContext> PModbusContext;
 
+// Base for the contexts that implement Execute() natively. The
+// throwing register access functions are implemented on top of it.
+class TModbusStatusContext: public TModbusContext
+{
+public:
+    void ReadCoils(int addr, int nb, uint8_t *dest);
+    void WriteCoil(int addr, int value);
+    void ReadDisceteInputs(int addr, int nb, uint8_t *dest);
+    void ReadHoldingRegisters(int addr, int nb, uint16_t *dest);
+    void WriteHoldingRegisters(int addr, int nb, const uint16_t *data);
+    void WriteHoldingRegister(int addr, uint16_t value);
+    void ReadInputRegisters(int addr, int nb, uint16_t *dest);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data,
+                    int& exception_code) = 0;
+
+private:
+    void ReadBits(uint8_t function, int addr, int nb, uint8_t *dest, const char* what);
+    // throws on errors
+    void Transaction(uint8_t function, int addr, int nb, uint16_t* data, const char* what);
+};
+
 class TModbusConnector
 {
 public:
@@ -91,12 +216,20 @@ struct TModbusRegister
     bool Poll;
     bool ForceReadOnly;
     std::string ErrorMessage;
+    // position of the register in the register table of
+    // the client that polls it, assigned by TModbusClient::AddRegister()
+    int Index = -1;
+
+    // slave 0 is the Modbus broadcast address
+    bool IsBroadcast() const { return Slave == 0; }
 
     bool IsReadOnly() const {
         return Type == RegisterType::DISCRETE_INPUT ||
             Type == RegisterType::INPUT_REGISTER || ForceReadOnly;
     }
 
+    // the widest formats take 4 registers
+    static const int MaxWidth = 4;
     uint8_t Width() const {
         switch (Format) {
             case S64:
@@ -112,14 +245,17 @@ struct TModbusRegister
         }
     }
 
+    const char* TypeName() const {
+        return Type == COIL ? "coil" :
+            Type == DISCRETE_INPUT ? "discrete" :
+            Type == HOLDING_REGISTER ? "holding" :
+            Type == INPUT_REGISTER ? "input" :
+            "bad";
+    }
+
     std::string ToString() const {
         std::stringstream s;
-        s << "<" << Slave << ":" <<
-            (Type == COIL ? "coil" :
-             Type == DISCRETE_INPUT ? "discrete" :
-             Type == HOLDING_REGISTER ? "holding" :
-             Type == INPUT_REGISTER ? "input" :
-             "bad") << ": " << Address << ">";
+        s << "<" << Slave << ":" << TypeName() << ": " << Address << ">";
         return s.str();
     }
 
@@ -150,14 +286,6 @@ inline ::std::ostream& operator<<(::std::ostream& os, const TModbusRegister& reg
     return os << reg.ToString();
 }
 
-namespace std {
-    template <> struct hash<std::shared_ptr<TModbusRegister>> {
-        size_t operator()(std::shared_ptr<TModbusRegister> p) const {
-            return hash<int>()(p->Slave) ^ hash<int>()(p->Type) ^ hash<int>()(p->Address);
-        }
-    };
-}
-
 class TModbusException: public std::exception {
 public:
     TModbusException(std::string _message): message("Modbus error: " + _message) {}
@@ -170,7 +298,94 @@ private:
     std::string message;
 };
 
+// Thrown when the slave replies with a Modbus exception response,
+// as opposed to timeouts and other communication failures.
+class TModbusSlaveException: public TModbusException {
+public:
+    enum ExceptionCode {
+        ILLEGAL_FUNCTION = 0x01,
+        ILLEGAL_DATA_ADDRESS = 0x02,
+        ILLEGAL_DATA_VALUE = 0x03,
+        SLAVE_DEVICE_FAILURE = 0x04,
+        GATEWAY_PATH_UNAVAILABLE = 0x0A,
+        GATEWAY_TARGET_FAILED_TO_RESPOND = 0x0B
+    };
+
+    TModbusSlaveException(int code, std::string _message)
+        : TModbusException(_message), Code(code) {}
+    int GetCode() const { return Code; }
+
+private:
+    int Code;
+};
+
 typedef std::function<void(std::shared_ptr<TModbusRegister> reg)> TModbusCallback;
+// Receives the response PDU, or an error message if the request failed
+typedef std::function<void(const std::vector<uint8_t>& response,
+                           const std::string& error)> TRawRequestCallback;
+
+// Transaction errors log. Errors are written as single key=value lines.
+// The first error of a register is reported right away, repeated
+// errors with the same status are only counted and summarized at most
+// once per interval, so a dead slave doesn't flood the log.
+class TModbusErrorLog
+{
+public:
+    static const int DefaultIntervalMs = 60000;
+
+    TModbusErrorLog(int interval_ms = DefaultIntervalMs, std::ostream& out = std::cerr)
+        : IntervalMs(interval_ms), Out(out) {}
+    void SetInterval(int ms) { IntervalMs = ms; }
+    void Error(const TModbusRegister& reg, bool write,
+               TModbusContext::TStatus status, int exception_code = 0);
+    // reports the end of errors if there were any
+    void Recovered(const TModbusRegister& reg, bool write);
+    // the register is considered absent on the device
+    // and only re-probed once per reprobe_interval_ms
+    void Unavailable(const TModbusRegister& reg, int reprobe_interval_ms);
+    void Available(const TModbusRegister& reg);
+
+private:
+    struct TEntry
+    {
+        TModbusContext::TStatus Status;
+        int ExceptionCode;
+        int Count;
+        int Suppressed;
+        std::chrono::steady_clock::time_point LastReport;
+    };
+    void WriteHeader(const char* event, const TModbusRegister& reg, bool write);
+
+    int IntervalMs;
+    std::ostream& Out;
+    // (register index, write) -> error state
+    std::map<std::pair<int, bool>, TEntry> Entries;
+};
+
+// Registers of a client, indexed by TModbusRegister::Index. The data
+// needed on every cycle is kept in contiguous arrays, the cached values
+// of all registers share a single word array. Built as the registers
+// are added and fixed once the client is connected.
+struct TRegisterTable
+{
+    int Size() const { return Registers.size(); }
+
+    // cold data
+    std::vector<std::shared_ptr<TModbusRegister>> Registers;
+    std::vector<std::unique_ptr<TRegisterHandler>> Handlers;
+
+    // hot data
+    std::vector<int> Slave;
+    std::vector<uint8_t> Width;
+    // offset of the register value in Words
+    std::vector<uint32_t> Offset;
+    // time of the last poll attempt, zero if not polled yet
+    std::vector<std::chrono::steady_clock::time_point> LastPoll;
+    // wall clock time of the last successful read or cached write,
+    // only updated by the thread running Cycle()
+    std::vector<std::chrono::system_clock::time_point> ReadTime;
+    std::vector<uint16_t> Words;
+};
 
 class TModbusClient
 {
@@ -187,28 +402,132 @@ public:
     void SetTextValue(std::shared_ptr<TModbusRegister> reg, const std::string& value);
     std::string GetTextValue(std::shared_ptr<TModbusRegister> reg) const;
     bool DidRead(std::shared_ptr<TModbusRegister> reg) const;
+    // Completion time of the bus transaction that produced the current
+    // value. Registers updated by the same transaction (e.g. broadcast
+    // group members) share it. Values written by WriteCachedValues()
+    // get the time of the write. Zero if the register wasn't read yet.
+    std::chrono::system_clock::time_point GetReadTime(std::shared_ptr<TModbusRegister> reg) const;
     void SetCallback(const TModbusCallback& callback);
     void SetErrorCallback(const TModbusCallback& callback);
     void SetDeleteErrorsCallback(const TModbusCallback& callback);
     void SetPollInterval(int ms);
     void SetModbusDebug(bool debug);
     bool DebugEnabled() const;
+    // Minimum interval between reports of the same repeated error
+    void SetErrorLogInterval(int ms);
+    // Bus timing of the port as of the start of the current cycle.
+    // Can be used from any thread.
+    TModbusTimingStats GetTimingStats() const;
     void WriteHoldingRegister(int slave, int address, uint16_t value);
+    // Registers of the devices that receive writes to the broadcast
+    // register. Their cached values are updated as soon as the broadcast
+    // is sent and then verified by polling.
+    void SetBroadcastMembers(std::shared_ptr<TModbusRegister> reg,
+                             const std::vector<std::shared_ptr<TModbusRegister>>& members);
+    // Queues a raw request from an external source (e.g. another
+    // program sharing the port). Queued requests are executed between
+    // register polls, see SetRawRequestsPerPoll(). The callback is
+    // invoked from the thread running Cycle(). Can be used from any thread.
+    void QueueRawRequest(int slave, const std::vector<uint8_t>& pdu,
+                         const TRawRequestCallback& callback);
+    // Maximum number of queued raw requests executed between two
+    // register polls (0 means all of them)
+    void SetRawRequestsPerPoll(int n);
+    bool HasPendingRawRequests() const;
+    // When set, registers of the slaves nobody is interested in are
+    // polled at most once per the interval (0 disables this)
+    void SetBackgroundPollInterval(int ms);
+    // Polls the registers of the slave on each cycle for the next
+    // duration_ms, clamped to [0, MaxInterestDurationMs]. Can be used
+    // from any thread.
+    void SetInterest(int slave, int duration_ms);
+    static const int MaxInterestDurationMs = 3600000;
+    // Time source of background polling and interest deadlines,
+    // steady_clock::now() by default. Set by tests before Cycle().
+    typedef std::function<std::chrono::steady_clock::time_point()> TClock;
+    void SetClock(const TClock& clock);
+    // Access to the cached register values by Modbus address, e.g. for
+    // serving them to other Modbus masters. Multi-register values are
+    // split into 16-bit words. Coils and discrete inputs are 0 or 1.
+    // Written values are queued for writing to the device, the callback
+    // for them is invoked from the thread running Cycle(). Both methods
+    // can be used from another thread and throw TModbusSlaveException
+    // with the exception code to be returned to the master.
+    void ReadCachedValues(int slave, TModbusRegister::RegisterType type,
+                          int addr, int nb, uint16_t* dest) const;
+    void WriteCachedValues(int slave, TModbusRegister::RegisterType type,
+                           int addr, int nb, const uint16_t* data);
+
+    // The port is closed after this many I/O errors in a row (e.g. an
+    // unplugged USB adapter) and reopened with a growing delay while
+    // the cached values are kept. Timeouts don't count, they only
+    // mean that a device doesn't respond.
+    static const int PortFailureThreshold = 3;
+    static const int MinReopenDelayMs = 500;
+    static const int MaxReopenDelayMs = 30000;
 
 private:
-
-
-    const std::unique_ptr<TRegisterHandler>& GetHandler(std::shared_ptr<TModbusRegister>) const;
+    friend class TRegisterHandler;
+    void ProcessRawRequests();
+    void FailRawRequests(const std::string& error);
+    void ProcessCachedWrites();
+    void PollRegister(int index);
+    void CompleteBroadcast(int index);
+    void TransactionDone(TModbusContext::TStatus status);
+    bool Reopen();
+    void ClosePort();
+    void ScheduleReopen();
+    std::chrono::steady_clock::time_point Now() const;
+
+    TRegisterHandler* GetHandler(std::shared_ptr<TModbusRegister>) const;
     TRegisterHandler* CreateRegisterHandler(std::shared_ptr<TModbusRegister> reg);
-    std::map<std::shared_ptr<TModbusRegister>, std::unique_ptr<TRegisterHandler> > handlers;
+    // registers are polled in the order they were added
+    TRegisterTable Table;
+    TModbusErrorLog ErrorLog;
+    // broadcast register index -> member register indices
+    std::map<int, std::vector<int>> BroadcastMembers;
+    std::vector<int> PendingVerification;
+    // (slave, type, address) -> index of the register containing the word and word index
+    typedef std::tuple<int, int, int> TWordAddress;
+    std::map<TWordAddress, std::pair<int, int>> RegisterWords;
     PModbusContext Context;
+    std::string Device;
     bool Active;
+    // the port failed and is waiting to be reopened
+    bool Failed = false;
+    int IOErrorCount = 0;
+    int ReopenDelayMs = MinReopenDelayMs;
+    std::chrono::steady_clock::time_point ReopenTime;
     int PollInterval;
     const int MAX_REGS = 65536;
+    // sleep between cycles that had no registers to poll
+    static const int IdlePollIntervalMs = 10;
     TModbusCallback Callback;
     TModbusCallback ErrorCallback;
     TModbusCallback DeleteErrorsCallback;
     bool Debug = false;
+    mutable std::mutex TimingStatsMutex;
+    TModbusTimingStats TimingStats;
+
+    struct TRawRequest
+    {
+        int Slave;
+        std::vector<uint8_t> PDU;
+        TRawRequestCallback Callback;
+    };
+    mutable std::mutex RawRequestMutex;
+    std::deque<TRawRequest> RawRequests;
+    int RawRequestsPerPoll = 1;
+
+    // registers written by WriteCachedValues() that weren't
+    // reported to the callback yet, with the time of the write
+    std::mutex CachedWritesMutex;
+    std::vector<std::pair<int, std::chrono::system_clock::time_point>> CachedWrites;
+
+    int BackgroundPollInterval = 0;
+    TClock Clock = std::chrono::steady_clock::now;
+    std::mutex InterestMutex;
+    std::map<int, std::chrono::steady_clock::time_point> InterestDeadlines;
 };
 
 typedef std::shared_ptr<TModbusClient> PModbusClient;
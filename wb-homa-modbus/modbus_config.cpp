@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string>
+#include <algorithm>
 
 #include "modbus_config.h"
 #include "wbmqtt/utils.h"
@@ -262,6 +263,12 @@ void TConfigParser::LoadDevice(PPortConfig port_config,
     device_config->Id = device_data.isMember("id") ? device_data["id"].asString() : default_id;
     device_config->Name = device_data.isMember("name") ? device_data["name"].asString() : "";
     device_config->SlaveId = GetInt(device_data, "slave_id");
+    // SmartBus ids are subnet * 256 + device id
+    int max_slave_id = port_config->Type == "smartbus" ? 0xffff : 247;
+    if (device_config->SlaveId < 0 || device_config->SlaveId > max_slave_id)
+        throw TConfigParserException("slave_id out of range [0, " + std::to_string(max_slave_id) +
+                                     "] for device " + device_config->Id + ": " +
+                                     std::to_string(device_config->SlaveId));
     if (device_data.isMember("device_type")){
         device_config->DeviceType = device_data["device_type"].asString();
         std::map<string, TDeviceJson>::iterator it = TemplatesMap.find(device_config->DeviceType);
@@ -288,9 +295,34 @@ void TConfigParser::LoadDevice(PPortConfig port_config,
     }
     LoadDeviceVectors(device_config, device_data);
 
+    if (!device_config->SlaveId)
+        LoadBroadcastGroup(device_config, device_data);
+
     port_config->AddDeviceConfig(device_config);
 }
 
+void TConfigParser::LoadBroadcastGroup(PDeviceConfig device_config, const Json::Value& device_data)
+{
+    if (!device_data["members"].isArray() || !device_data["members"].size())
+        throw TConfigParserException("no members specified for broadcast device " + device_config->Id);
+    const Json::Value array = device_data["members"];
+    for(unsigned int index = 0; index < array.size(); ++index)
+        device_config->BroadcastMembers.push_back(array[index].asString());
+
+    // nothing can be read via broadcast requests, and setup
+    // items would reach all the devices on the bus
+    device_config->SetupItems.clear();
+    auto& channels = device_config->ModbusChannels;
+    channels.erase(std::remove_if(channels.begin(), channels.end(),
+                                  [](PModbusChannel channel) {
+                                      return channel->ReadOnly;
+                                  }),
+                   channels.end());
+    for (auto channel: channels)
+        for (auto reg: channel->Registers)
+            reg->Poll = false;
+}
+
 void TConfigParser::LoadPort(const Json::Value& port_data,
                              const std::string& id_prefix)
 {
@@ -324,16 +356,127 @@ void TConfigParser::LoadPort(const Json::Value& port_data,
     if (port_data.isMember("poll_interval"))
         port_config->PollInterval = GetInt(port_data, "poll_interval");
 
+    if (port_data.isMember("background_poll_interval"))
+        port_config->BackgroundPollInterval = GetInt(port_data, "background_poll_interval");
+
     if (port_data.isMember("type"))
         port_config->Type = port_data["type"].asString();
 
+    if (port_data.isMember("transport"))
+        port_config->Transport = port_data["transport"].asString();
+
+    if (port_data.isMember("mux_socket"))
+        port_config->MuxSocket = port_data["mux_socket"].asString();
+
+    if (port_data.isMember("raw_requests_per_poll")) {
+        port_config->RawRequestsPerPoll = GetInt(port_data, "raw_requests_per_poll");
+        if (port_config->RawRequestsPerPoll < 0)
+            throw TConfigParserException("raw_requests_per_poll must not be negative");
+    }
+
+    if (port_data.isMember("record_trace"))
+        port_config->RecordTrace = port_data["record_trace"].asString();
+
+    if (port_data.isMember("replay_trace"))
+        port_config->ReplayTrace = port_data["replay_trace"].asString();
+
+    if (port_data.isMember("replay_time_scale")) {
+        port_config->ReplayTimeScale = port_data["replay_time_scale"].asDouble();
+        if (port_config->ReplayTimeScale < 0)
+            throw TConfigParserException("replay_time_scale must not be negative");
+    }
+
+    if (port_data.isMember("error_log_interval"))
+        port_config->ErrorLogInterval = GetInt(port_data, "error_log_interval");
+
+    if (port_data.isMember("publish_timestamps"))
+        port_config->PublishTimestamps = port_data["publish_timestamps"].asBool();
+
+    if (port_data.isMember("value_topics")) {
+        std::string value_topics = port_data["value_topics"].asString();
+        if (value_topics == "channels") {
+            port_config->PublishChannelValues = true;
+            port_config->PublishDeviceValues = false;
+        } else if (value_topics == "device") {
+            port_config->PublishChannelValues = false;
+            port_config->PublishDeviceValues = true;
+        } else if (value_topics == "both")
+            port_config->PublishChannelValues = port_config->PublishDeviceValues = true;
+        else
+            throw TConfigParserException("invalid value_topics: " + value_topics);
+    }
+
+    if (port_data.isMember("smartbus_read_status"))
+        port_config->SmartBusReadStatus = port_data["smartbus_read_status"].asBool();
+
+    if (port_data.isMember("low_latency"))
+        port_config->ConnSettings.LowLatency = port_data["low_latency"].asBool();
+
+    if (port_data.isMember("rs485"))
+        port_config->ConnSettings.RS485 = port_data["rs485"].asBool();
+
+    if (port_data.isMember("rs485_rts_on_send"))
+        port_config->ConnSettings.RS485RtsOnSend = port_data["rs485_rts_on_send"].asBool();
+
+    if (port_data.isMember("rs485_delay_before_send_ms")) {
+        port_config->ConnSettings.RS485DelayBeforeSendMs = GetInt(port_data, "rs485_delay_before_send_ms");
+        if (port_config->ConnSettings.RS485DelayBeforeSendMs < 0)
+            throw TConfigParserException("rs485_delay_before_send_ms must not be negative");
+    }
+
+    if (port_data.isMember("rs485_delay_after_send_ms")) {
+        port_config->ConnSettings.RS485DelayAfterSendMs = GetInt(port_data, "rs485_delay_after_send_ms");
+        if (port_config->ConnSettings.RS485DelayAfterSendMs < 0)
+            throw TConfigParserException("rs485_delay_after_send_ms must not be negative");
+    }
+
     const Json::Value array = port_data["devices"];
     for(unsigned int index = 0; index < array.size(); ++index)
             LoadDevice(port_config, array[index], id_prefix + std::to_string(index));
 
+    for (auto device_config: port_config->DeviceConfigs) {
+        for (const auto& member_id: device_config->BroadcastMembers) {
+            auto it = std::find_if(port_config->DeviceConfigs.begin(),
+                                   port_config->DeviceConfigs.end(),
+                                   [&member_id](PDeviceConfig c) {
+                                       return c->Id == member_id;
+                                   });
+            if (it == port_config->DeviceConfigs.end() || !(*it)->SlaveId)
+                throw TConfigParserException("bad broadcast group member '" + member_id +
+                                             "' for device " + device_config->Id);
+        }
+    }
+
     HandlerConfig->AddPortConfig(port_config);
 }
 
+void TConfigParser::LoadTCPServer(const Json::Value& server_data)
+{
+    if (!server_data.isObject())
+        throw TConfigParserException("malformed modbus_tcp_server section");
+
+    TTCPServerConfig& config = HandlerConfig->TCPServer;
+    config.Enabled = !server_data.isMember("enabled") || server_data["enabled"].asBool();
+
+    if (server_data.isMember("address"))
+        config.Address = server_data["address"].asString();
+
+    if (server_data.isMember("port"))
+        config.Port = GetInt(server_data, "port");
+
+    const Json::Value array = server_data["units"];
+    for(unsigned int index = 0; index < array.size(); ++index) {
+        const Json::Value& unit_data = array[index];
+        int unit_id = GetInt(unit_data, "unit_id");
+        if (unit_id < 1 || unit_id > 255)
+            throw TConfigParserException("bad Modbus TCP unit id: " + std::to_string(unit_id));
+        if (!unit_data.isMember("device"))
+            throw TConfigParserException("no device specified for Modbus TCP unit " +
+                                         std::to_string(unit_id));
+        config.Units[unit_id] = unit_data["device"].asString();
+    }
+}
+
 void TConfigParser::LoadConfig()
 {
     if (!root.isObject())
@@ -349,6 +492,9 @@ void TConfigParser::LoadConfig()
     for(unsigned int index = 0; index < array.size(); ++index)
         LoadPort(array[index], "wb-modbus-" + std::to_string(index) + "-");
 
+    if (root.isMember("modbus_tcp_server"))
+        LoadTCPServer(root["modbus_tcp_server"]);
+
     // check are there any devices defined
     for (const auto& port_config : HandlerConfig->PortConfigs) {
         if (!port_config->DeviceConfigs.empty()) { // found one
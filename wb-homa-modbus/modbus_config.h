@@ -54,6 +54,8 @@ struct TDeviceConfig
     std::string Name;
     int SlaveId;
     std::string DeviceType;
+    // ids of the devices addressed by the broadcast (slave_id 0) device
+    std::vector<std::string> BroadcastMembers;
     std::vector<PModbusChannel> ModbusChannels;
     std::vector<PDeviceSetupItem> SetupItems;
 };
@@ -65,13 +67,49 @@ struct TPortConfig
     void AddDeviceConfig(PDeviceConfig device_config) { DeviceConfigs.push_back(device_config); }
     TModbusConnectionSettings ConnSettings;
     int PollInterval = 20;
+    // poll interval for devices without active interest, 0 means
+    // all devices are polled on each cycle
+    int BackgroundPollInterval = 0;
     bool Debug = false;
     std::string Type;
+    std::string Transport;
+    // Unix socket for raw requests from external tools (see TModbusMux)
+    std::string MuxSocket;
+    // number of queued raw requests executed between two register polls,
+    // 0 means all of them
+    int RawRequestsPerPoll = 1;
+    // bus traffic trace to write (see TModbusRecordingContext)
+    std::string RecordTrace;
+    // bus traffic trace to serve the requests from instead of
+    // talking to the devices (see TModbusReplayContext)
+    std::string ReplayTrace;
+    double ReplayTimeScale = 1;
+    // minimum interval between reports of a repeated error (see TModbusErrorLog)
+    int ErrorLogInterval = TModbusErrorLog::DefaultIntervalMs;
+    // publish the bus read time of each value as .../meta/ts
+    bool PublishTimestamps = false;
+    // per-channel retained value topics (/devices/<id>/controls/<name>)
+    bool PublishChannelValues = true;
+    // a single JSON message per device with the values changed
+    // during the cycle (/devices/<id>/values)
+    bool PublishDeviceValues = false;
+    // SmartBus devices answer status requests (see TSmartBusModbusContext)
+    bool SmartBusReadStatus = true;
     std::vector<PDeviceConfig> DeviceConfigs;
 };
 
 typedef std::shared_ptr<TPortConfig> PPortConfig;
 
+struct TTCPServerConfig
+{
+    bool Enabled = false;
+    std::string Address = "0.0.0.0";
+    int Port = 502;
+    // unit id -> device id. If empty, devices are served
+    // using their slave ids as unit ids.
+    std::map<int, std::string> Units;
+};
+
 struct THandlerConfig
 {
     void AddPortConfig(PPortConfig port_config) {
@@ -80,6 +118,7 @@ struct THandlerConfig
     }
     bool Debug = false;
     std::vector<PPortConfig> PortConfigs;
+    TTCPServerConfig TCPServer;
 };
 
 typedef std::shared_ptr<THandlerConfig> PHandlerConfig;
@@ -140,7 +179,9 @@ public:
     PHandlerConfig Parse();
     void LoadDevice(PPortConfig port_config, const Json::Value& device_data,
                     const std::string& default_id);
+    void LoadBroadcastGroup(PDeviceConfig device_config, const Json::Value& device_data);
     void LoadPort(const Json::Value& port_data, const std::string& id_prefix);
+    void LoadTCPServer(const Json::Value& server_data);
     void LoadConfig();
 private:
 
@@ -0,0 +1,179 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "modbus_mux.h"
+#include "modbus_rtu.h"
+
+TModbusMux::TModbusMux(const std::string& path, PModbusClient client, bool debug)
+    : Path(path), Client(client), Debug(debug) {}
+
+TModbusMux::~TModbusMux()
+{
+    Stop();
+}
+
+void TModbusMux::Start()
+{
+    if (Thread.joinable())
+        return;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (Path.empty() || Path.size() >= sizeof(addr.sun_path))
+        throw TModbusException("bad multiplexer socket path: " + Path);
+    strncpy(addr.sun_path, Path.c_str(), sizeof(addr.sun_path) - 1);
+
+    ListenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ListenFd < 0)
+        throw TModbusException("socket() failed: " + std::string(strerror(errno)));
+    // remove the stale socket left by the previous instance
+    unlink(Path.c_str());
+    if (bind(ListenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(ListenFd, 16) < 0) {
+        std::string error = strerror(errno);
+        close(ListenFd);
+        ListenFd = -1;
+        throw TModbusException("can't listen on " + Path + ": " + error);
+    }
+
+    StopFd = eventfd(0, EFD_CLOEXEC);
+    if (StopFd < 0)
+        throw TModbusException("eventfd() failed: " + std::string(strerror(errno)));
+    Thread = std::thread([this]() { Run(); });
+}
+
+void TModbusMux::Stop()
+{
+    if (Thread.joinable()) {
+        uint64_t v = 1;
+        if (write(StopFd, &v, sizeof(v)) != sizeof(v))
+            std::cerr << "TModbusMux::Stop(): failed to stop the multiplexer thread" << std::endl;
+        Thread.join();
+    }
+    for (const auto& conn: Connections)
+        CloseConnection(conn);
+    Connections.clear();
+    if (ListenFd >= 0) {
+        close(ListenFd);
+        ListenFd = -1;
+        unlink(Path.c_str());
+    }
+    if (StopFd >= 0) {
+        close(StopFd);
+        StopFd = -1;
+    }
+}
+
+void TModbusMux::Run()
+{
+    for (;;) {
+        std::vector<struct pollfd> fds(Connections.size() + 2);
+        fds[0].fd = StopFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ListenFd;
+        fds[1].events = POLLIN;
+        for (size_t i = 0; i < Connections.size(); ++i) {
+            fds[i + 2].fd = Connections[i]->Fd;
+            fds[i + 2].events = POLLIN;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "TModbusMux: poll() failed: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        if (fds[0].revents)
+            return;
+
+        for (size_t i = fds.size() - 1; i >= 2; --i) {
+            if (fds[i].revents && !HandleInput(Connections[i - 2])) {
+                CloseConnection(Connections[i - 2]);
+                Connections.erase(Connections.begin() + (i - 2));
+            }
+        }
+
+        if (fds[1].revents)
+            Accept();
+    }
+}
+
+void TModbusMux::Accept()
+{
+    int fd = accept4(ListenFd, 0, 0, SOCK_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "TModbusMux: accept() failed: " << strerror(errno) << std::endl;
+        return;
+    }
+    Connections.push_back(std::make_shared<TConnection>(fd));
+}
+
+// Returns false if the connection must be closed
+bool TModbusMux::HandleInput(PConnection conn)
+{
+    uint8_t buf[TModbusRtuTransport::MaxFrameSize];
+    int n = recv(conn->Fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+        return false;
+
+    // slave address, function code and CRC at least
+    if (n < 4 || TModbusRtuTransport::CRC16(buf, n)) {
+        if (Debug)
+            std::cerr << "TModbusMux: dropping malformed request" << std::endl;
+        Reply(conn, std::vector<uint8_t>());
+        return true;
+    }
+
+    int slave = buf[0];
+    std::vector<uint8_t> pdu(buf + 1, buf + n - 2);
+    Client->QueueRawRequest(slave, pdu, [this, conn, slave](const std::vector<uint8_t>& response,
+                                                            const std::string& error) {
+            if (!error.empty()) {
+                if (Debug)
+                    std::cerr << "TModbusMux: request to slave " << slave << " failed: " <<
+                        error << std::endl;
+                Reply(conn, std::vector<uint8_t>());
+                return;
+            }
+            if (slave == 0) {
+                // broadcast requests have no response, but the client
+                // still needs to know when the request is done
+                Reply(conn, std::vector<uint8_t>());
+                return;
+            }
+            std::vector<uint8_t> adu;
+            adu.reserve(response.size() + 3);
+            adu.push_back(slave);
+            adu.insert(adu.end(), response.begin(), response.end());
+            uint16_t crc = TModbusRtuTransport::CRC16(adu.data(), adu.size());
+            adu.push_back(crc & 0xff);
+            adu.push_back(crc >> 8);
+            Reply(conn, adu);
+        });
+    return true;
+}
+
+void TModbusMux::Reply(PConnection conn, const std::vector<uint8_t>& adu)
+{
+    std::lock_guard<std::mutex> lock(conn->Mutex);
+    if (conn->Closed)
+        return;
+    if (send(conn->Fd, adu.data(), adu.size(), MSG_NOSIGNAL) < 0 && Debug)
+        std::cerr << "TModbusMux: send() failed: " << strerror(errno) << std::endl;
+}
+
+void TModbusMux::CloseConnection(PConnection conn)
+{
+    std::lock_guard<std::mutex> lock(conn->Mutex);
+    if (conn->Closed)
+        return;
+    close(conn->Fd);
+    conn->Closed = true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+// Unix socket multiplexer that lets external tools (e.g. firmware
+// updaters or configurators) talk to the devices on the bus without
+// stopping the driver. Each SOCK_SEQPACKET packet carries exactly one
+// Modbus RTU request ADU (slave address, PDU, CRC). Requests are executed
+// by the polling loop between regular transactions, the reply packet
+// contains the response ADU or is empty if the request has failed.
+class TModbusMux
+{
+public:
+    TModbusMux(const std::string& path, PModbusClient client, bool debug = false);
+    TModbusMux(const TModbusMux&) = delete;
+    TModbusMux& operator=(const TModbusMux&) = delete;
+    ~TModbusMux();
+    void Start();
+    void Stop();
+
+private:
+    struct TConnection
+    {
+        TConnection(int fd): Fd(fd) {}
+        // the replies are sent from the polling thread, so the
+        // connection may be closed while its requests are still queued
+        std::mutex Mutex;
+        int Fd;
+        bool Closed = false;
+    };
+    typedef std::shared_ptr<TConnection> PConnection;
+
+    void Run();
+    void Accept();
+    bool HandleInput(PConnection conn);
+    void Reply(PConnection conn, const std::vector<uint8_t>& adu);
+    void CloseConnection(PConnection conn);
+
+    std::string Path;
+    PModbusClient Client;
+    bool Debug;
+    int ListenFd = -1;
+    int StopFd = -1;
+    std::vector<PConnection> Connections;
+    std::thread Thread;
+};
+
+typedef std::shared_ptr<TModbusMux> PModbusMux;
@@ -1,5 +1,8 @@
 #include "modbus_observer.h"
 #include "uniel_context.h"
+#include "smartbus_context.h"
+#include "modbus_rtu_context.h"
+#include "modbus_trace.h"
 
 TMQTTModbusObserver::TMQTTModbusObserver(PMQTTClientBase mqtt_client,
                                          PHandlerConfig handler_config,
@@ -26,7 +29,48 @@ TMQTTModbusObserver::TMQTTModbusObserver(PMQTTClientBase mqtt_client,
 void TMQTTModbusObserver::SetUp()
 {
     MQTTClient->Observe(shared_from_this());
+    RPC = PModbusRPC(new TModbusRPC(MQTTClient));
+    for (const auto& port: Ports)
+        RPC->AddPort(port->GetConfig()->ConnSettings.Device, port->GetModbusClient());
+    RPC->SetUp();
     MQTTClient->Connect();
+    if (Config->TCPServer.Enabled)
+        SetUpTCPServer();
+}
+
+void TMQTTModbusObserver::SetUpTCPServer()
+{
+    const TTCPServerConfig& server_config = Config->TCPServer;
+    TCPServer = PModbusTCPServer(new TModbusTCPServer(server_config.Address,
+                                                      server_config.Port, Config->Debug));
+    for (const auto& port: Ports) {
+        for (const auto& device_config: port->GetConfig()->DeviceConfigs) {
+            if (!device_config->SlaveId)
+                continue;
+            if (server_config.Units.empty()) {
+                if (TCPServer->HasUnit(device_config->SlaveId)) {
+                    std::cerr << "warning: Modbus TCP unit " << device_config->SlaveId <<
+                        " is already used, not serving device " << device_config->Id << std::endl;
+                    continue;
+                }
+                TCPServer->AddUnit(device_config->SlaveId, port->GetModbusClient(),
+                                   device_config->SlaveId);
+                continue;
+            }
+            for (const auto& unit: server_config.Units) {
+                if (unit.second == device_config->Id)
+                    TCPServer->AddUnit(unit.first, port->GetModbusClient(), device_config->SlaveId);
+            }
+        }
+    }
+
+    for (const auto& unit: server_config.Units) {
+        if (!TCPServer->HasUnit(unit.first))
+            std::cerr << "warning: device '" << unit.second << "' for Modbus TCP unit " <<
+                unit.first << " not found" << std::endl;
+    }
+
+    TCPServer->Start();
 }
 
 void TMQTTModbusObserver::OnConnect(int rc)
@@ -39,12 +83,15 @@ void TMQTTModbusObserver::OnConnect(int rc)
 
     for (const auto& port: Ports)
         port->PubSubSetup();
+    RPC->PubSubSetup();
 }
 
 void TMQTTModbusObserver::OnMessage(const struct mosquitto_message *message)
 {
     std::string topic = message->topic;
     std::string payload = static_cast<const char *>(message->payload);
+    if (RPC->HandleMessage(topic, payload))
+        return;
     for (const auto& port: Ports) {
         if (port->HandleMessage(topic, payload))
             break;
@@ -82,13 +129,35 @@ bool TMQTTModbusObserver::WriteInitValues()
 }
 
 PModbusConnector TMQTTModbusObserver::GetConnector(PPortConfig port_config)
+{
+    if (!port_config->ReplayTrace.empty())
+        return PModbusConnector(new TModbusReplayConnector(port_config->ReplayTrace,
+                                                           port_config->ReplayTimeScale));
+
+    PModbusConnector connector = GetBusConnector(port_config);
+    if (!port_config->RecordTrace.empty())
+        connector = PModbusConnector(new TModbusRecordingConnector(connector, port_config->RecordTrace));
+    return connector;
+}
+
+PModbusConnector TMQTTModbusObserver::GetBusConnector(PPortConfig port_config)
 {
     if (port_config->Type == "uniel")
         return PModbusConnector(new TUnielModbusConnector());
 
+    if (port_config->Type == "smartbus")
+        return PModbusConnector(new TSmartBusModbusConnector(port_config->SmartBusReadStatus));
+
     if (!port_config->Type.empty() && port_config->Type != "modbus")
         std::cerr << "warning: bad port type '" << port_config->Type <<
             "', using 'modbus'" << std::endl;
 
+    if (port_config->Transport == "native")
+        return PModbusConnector(new TModbusRtuConnector());
+
+    if (!port_config->Transport.empty() && port_config->Transport != "libmodbus")
+        std::cerr << "warning: bad port transport '" << port_config->Transport <<
+            "', using 'libmodbus'" << std::endl;
+
     return PModbusConnector(new TDefaultModbusConnector());
 }
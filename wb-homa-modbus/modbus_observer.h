@@ -6,6 +6,8 @@
 #include <wbmqtt/mqtt_wrapper.h>
 #include "modbus_config.h"
 #include "modbus_port.h"
+#include "modbus_tcp_server.h"
+#include "modbus_rpc.h"
 
 class TMQTTModbusObserver : public IMQTTObserver,
                             public std::enable_shared_from_this<TMQTTModbusObserver>
@@ -26,10 +28,14 @@ public:
 
 private:
     PModbusConnector GetConnector(PPortConfig port_config);
+    PModbusConnector GetBusConnector(PPortConfig port_config);
+    void SetUpTCPServer();
 
     PMQTTClientBase MQTTClient;
     PHandlerConfig Config;
     std::vector<std::unique_ptr<TModbusPort>> Ports;
+    PModbusTCPServer TCPServer;
+    PModbusRPC RPC;
 };
 
 typedef std::shared_ptr<TMQTTModbusObserver> PMQTTModbusObserver;
@@ -21,16 +21,54 @@ TModbusPort::TModbusPort(PMQTTClientBase mqtt_client, PPortConfig port_config, P
     for (auto device_config: Config->DeviceConfigs) {
         for (auto channel: device_config->ModbusChannels) {
             for (auto reg: channel->Registers) {
-                RegisterToChannelMap[reg] = channel;
                 NameToChannelMap[device_config->Id + "/" + channel->Name] = channel;
                 ModbusClient->AddRegister(reg);
+                if (RegisterToChannel.size() <= size_t(reg->Index))
+                    RegisterToChannel.resize(reg->Index + 1);
+                RegisterToChannel[reg->Index] = channel;
             }
         }
     }
+    for (auto device_config: Config->DeviceConfigs) {
+        if (device_config->BroadcastMembers.empty())
+            continue;
+        for (auto channel: device_config->ModbusChannels) {
+            for (auto reg: channel->Registers)
+                ModbusClient->SetBroadcastMembers(reg, FindBroadcastMembers(*device_config, reg));
+        }
+    }
     ModbusClient->SetPollInterval(Config->PollInterval);
+    ModbusClient->SetBackgroundPollInterval(Config->BackgroundPollInterval);
+    ModbusClient->SetErrorLogInterval(Config->ErrorLogInterval);
     ModbusClient->SetModbusDebug(Config->Debug);
+    ModbusClient->SetRawRequestsPerPoll(Config->RawRequestsPerPoll);
+    if (!Config->MuxSocket.empty()) {
+        Mux = PModbusMux(new TModbusMux(Config->MuxSocket, ModbusClient, Config->Debug));
+        Mux->Start();
+    }
 };
 
+std::vector<std::shared_ptr<TModbusRegister>>
+TModbusPort::FindBroadcastMembers(const TDeviceConfig& group, std::shared_ptr<TModbusRegister> reg)
+{
+    // the group members are expected to share the register layout,
+    // so member registers are found by type and address
+    std::vector<std::shared_ptr<TModbusRegister>> members;
+    for (auto device_config: Config->DeviceConfigs) {
+        if (std::find(group.BroadcastMembers.begin(), group.BroadcastMembers.end(),
+                      device_config->Id) == group.BroadcastMembers.end())
+            continue;
+        for (auto channel: device_config->ModbusChannels) {
+            for (auto member: channel->Registers) {
+                if (member->Type == reg->Type && member->Address == reg->Address &&
+                    member->Width() == reg->Width())
+                    members.push_back(member);
+            }
+        }
+    }
+    return members;
+}
+
 void TModbusPort::PubSubSetup()
 {
     for (auto device_config : Config->DeviceConfigs) {
@@ -50,8 +88,15 @@ void TModbusPort::PubSubSetup()
                                  0, true);
             MQTTClient->Publish(NULL, control_prefix + "/meta/order",
                              std::to_string(channel->Order), 0, true);
-            MQTTClient->Subscribe(NULL, control_prefix + "/on");
         }
+        // a single subscription per device, HandleMessage()
+        // skips the channels it doesn't know
+        if (!device_config->ModbusChannels.empty())
+            MQTTClient->Subscribe(NULL, prefix + "controls/+/on");
+        // clients viewing the device announce their interest so that
+        // it's polled faster than the background rate
+        if (Config->BackgroundPollInterval > 0 && device_config->SlaveId)
+            MQTTClient->Subscribe(NULL, prefix + "interest");
     }
 
 //~ /devices/293723-demo/controls/Demo-Switch 0
@@ -59,9 +104,14 @@ void TModbusPort::PubSubSetup()
 //~ /devices/293723-demo/controls/Demo-Switch/meta/type switch
 }
 
+const int TModbusPort::DefaultInterestDurationSec;
+
 bool TModbusPort::HandleMessage(const std::string& topic, const std::string& payload)
 {
     const std::vector<std::string>& tokens = StringSplit(topic, '/');
+    if (tokens.size() == 4 && tokens[0] == "" && tokens[1] == "devices" && tokens[3] == "interest")
+        return HandleInterest(tokens[2], payload);
+
     if ((tokens.size() != 6) ||
         (tokens[0] != "") || (tokens[1] != "devices") ||
         (tokens[3] != "controls") || (tokens[5] != "on"))
@@ -114,7 +164,41 @@ bool TModbusPort::HandleMessage(const std::string& topic, const std::string& pay
 
     }
 
-    MQTTClient->Publish(NULL, GetChannelTopic(*it->second), payload, 0, true);
+    PublishValue(*it->second, payload, 0);
+    return true;
+}
+
+bool TModbusPort::HandleInterest(const std::string& device_id, const std::string& payload)
+{
+    const auto& dev_config_it =
+        std::find_if(Config->DeviceConfigs.begin(),
+                     Config->DeviceConfigs.end(),
+                     [device_id](PDeviceConfig c) {
+                         return c->Id == device_id;
+                     });
+    if (dev_config_it == Config->DeviceConfigs.end() || !(*dev_config_it)->SlaveId)
+        return false;
+
+    // payload is the duration in seconds
+    int duration = DefaultInterestDurationSec;
+    if (!payload.empty()) {
+        try {
+            duration = std::stoi(payload);
+        } catch (const std::exception&) {
+            std::cerr << "warning: invalid payload for interest in device '" << device_id <<
+                "': '" << payload << "'" << std::endl;
+            return true;
+        }
+    }
+    int max_duration = TModbusClient::MaxInterestDurationMs / 1000;
+    if (duration < 1 || duration > max_duration) {
+        std::cerr << "warning: interest duration for device '" << device_id <<
+            "' out of range [1, " << max_duration << "]: " << duration << std::endl;
+        duration = std::max(1, std::min(duration, max_duration));
+    }
+    if (Config->Debug)
+        std::cerr << "interest in device " << device_id << " for " << duration << "s" << std::endl;
+    ModbusClient->SetInterest((*dev_config_it)->SlaveId, duration * 1000);
     return true;
 }
 
@@ -130,22 +214,20 @@ void TModbusPort::OnModbusValueChange(std::shared_ptr<TModbusRegister> reg)
         std::cerr << "modbus value change: " << reg->ToString() << " <- " <<
             ModbusClient->GetTextValue(reg) << std::endl;
 
-    auto it = RegisterToChannelMap.find(reg);
-    if (it == RegisterToChannelMap.end()) {
-        std::cerr << "warning: unexpected register from modbus" << std::endl;
+    PModbusChannel channel = FindChannel(reg);
+    if (!channel)
         return;
-    }
 
     std::string payload;
-    if (!it->second->OnValue.empty()) {
-        payload = ModbusClient->GetTextValue(reg) == it->second->OnValue ? "1" : "0";
+    if (!channel->OnValue.empty()) {
+        payload = ModbusClient->GetTextValue(reg) == channel->OnValue ? "1" : "0";
         if (Config->Debug)
-            std::cerr << "OnValue: " << it->second->OnValue << "; payload: " <<
+            std::cerr << "OnValue: " << channel->OnValue << "; payload: " <<
                 payload << std::endl;
     } else {
         std::stringstream s;
-        for (size_t i = 0; i < it->second->Registers.size(); ++i) {
-            std::shared_ptr<TModbusRegister> reg = it->second->Registers[i];
+        for (size_t i = 0; i < channel->Registers.size(); ++i) {
+            std::shared_ptr<TModbusRegister> reg = channel->Registers[i];
             // avoid publishing incomplete value
             if (!ModbusClient->DidRead(reg))
                 return;
@@ -165,48 +247,107 @@ void TModbusPort::OnModbusValueChange(std::shared_ptr<TModbusRegister> reg)
     // }
     // Publish current value (make retained)
     if (Config->Debug)
-        std::cerr << "channel " << it->second->Name << " device id: " <<
-            it->second->DeviceId << " -- topic: " << GetChannelTopic(*it->second) <<
+        std::cerr << "channel " << channel->Name << " device id: " <<
+            channel->DeviceId << " -- topic: " << GetChannelTopic(*channel) <<
             " <-- " << payload << std::endl;
 
-    MQTTClient->Publish(NULL, GetChannelTopic(*it->second), payload, 0, true);
+    PublishValue(*channel, payload, Config->PublishTimestamps ? GetReadTimeMs(*channel) : 0);
+}
+
+void TModbusPort::PublishValue(const TModbusChannel& channel, const std::string& payload,
+                               long long read_time_ms)
+{
+    if (Config->PublishChannelValues) {
+        // the timestamp goes first so that it's already
+        // there when subscribers receive the value
+        if (read_time_ms)
+            MQTTClient->Publish(NULL, GetChannelTopic(channel) + "/meta/ts",
+                                std::to_string(read_time_ms), 0, true);
+        MQTTClient->Publish(NULL, GetChannelTopic(channel), payload, 0, true);
+    }
+
+    if (Config->PublishDeviceValues) {
+        std::lock_guard<std::mutex> lock(DeviceValuesMutex);
+        Json::Value& values = DeviceValues[channel.DeviceId];
+        values["values"][channel.Name] = payload;
+        if (read_time_ms)
+            values["ts"][channel.Name] = Json::Int64(read_time_ms);
+    }
+}
+
+long long TModbusPort::GetReadTimeMs(const TModbusChannel& channel) const
+{
+    // multi-register values are as old as their latest part
+    std::chrono::system_clock::time_point read_time;
+    for (const auto& reg: channel.Registers)
+        read_time = std::max(read_time, ModbusClient->GetReadTime(reg));
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        read_time.time_since_epoch()).count();
+}
+
+void TModbusPort::PublishDeviceValues()
+{
+    std::map<std::string, Json::Value> values;
+    {
+        std::lock_guard<std::mutex> lock(DeviceValuesMutex);
+        values.swap(DeviceValues);
+    }
+
+    // not retained, the messages only carry the changes
+    Json::FastWriter writer;
+    for (const auto& item: values) {
+        std::string payload = writer.write(item.second);
+        if (!payload.empty() && payload.back() == '\n')
+            payload.pop_back();
+        MQTTClient->Publish(NULL, "/devices/" + item.first + "/values", payload, 0, false);
+    }
+}
+
+PModbusChannel TModbusPort::FindChannel(std::shared_ptr<TModbusRegister> reg) const
+{
+    if (reg->Index < 0 || size_t(reg->Index) >= RegisterToChannel.size() ||
+        !RegisterToChannel[reg->Index]) {
+        std::cerr << "warning: unexpected register from modbus" << std::endl;
+        return PModbusChannel();
+    }
+    return RegisterToChannel[reg->Index];
 }
 
 void TModbusPort::PublishError(std::shared_ptr<TModbusRegister> reg)
 {
     int error = (reg->ErrorMessage == "Poll") ? 1: 2;
-    auto it = RegisterToChannelMap.find(reg);
-    if (it == RegisterToChannelMap.end()) {
-        std::cerr << "warning: unexpected register from modbus" << std::endl;
+    PModbusChannel channel = FindChannel(reg);
+    if (!channel)
         return;
-    }
-    if (!it->second->PrintedErrorMessage) {
-        MQTTClient->Publish(NULL, GetChannelTopic(*it->second) + "/meta/error", to_string(error), 0, true);
-        it->second->PrintedErrorMessage = true;
+    if (!channel->PrintedErrorMessage) {
+        MQTTClient->Publish(NULL, GetChannelTopic(*channel) + "/meta/error", to_string(error), 0, true);
+        channel->PrintedErrorMessage = true;
     }
 }
 
 void TModbusPort::DeleteErrorMessages(std::shared_ptr<TModbusRegister> reg)
 {
-    auto it = RegisterToChannelMap.find(reg);
-    if (it == RegisterToChannelMap.end()) {
-        std::cerr << "warning: unexpected register from modbus" << std::endl;
+    PModbusChannel channel = FindChannel(reg);
+    if (!channel)
         return;
-    }
-    if (it->second->PrintedErrorMessage == true) {
-        MQTTClient->Publish(NULL, GetChannelTopic(*it->second) + "/meta/error", "", 0, true);
-        it->second->PrintedErrorMessage = false;
+    if (channel->PrintedErrorMessage == true) {
+        MQTTClient->Publish(NULL, GetChannelTopic(*channel) + "/meta/error", "", 0, true);
+        channel->PrintedErrorMessage = false;
     }
 }
 
 void TModbusPort::Cycle()
 {
+    // port failures are handled by the client itself,
+    // only configuration errors end up here
     try {
         ModbusClient->Cycle();
     } catch (TModbusException& e) {
         std::cerr << "FATAL: " << e.what() << ". Stopping event loops." << std::endl;
         exit(1);
     }
+    if (Config->PublishDeviceValues)
+        PublishDeviceValues();
 }
 
 bool TModbusPort::WriteInitValues()
@@ -1,9 +1,13 @@
 #pragma once
+#include <map>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <wbmqtt/mqtt_wrapper.h>
 #include "modbus_config.h"
+#include "modbus_mux.h"
 
 class TMQTTWrapper;
 
@@ -17,13 +21,34 @@ public:
     std::string GetChannelTopic(const TModbusChannel& channel);
     bool WriteInitValues();
 
+    // default duration of the interest in the device announced
+    // via /devices/<id>/interest without payload
+    static const int DefaultInterestDurationSec = 30;
+    PPortConfig GetConfig() const { return Config; }
+    PModbusClient GetModbusClient() const { return ModbusClient; }
+
 private:
+    std::vector<std::shared_ptr<TModbusRegister>> FindBroadcastMembers(const TDeviceConfig& group,
+                                                                       std::shared_ptr<TModbusRegister> reg);
+    bool HandleInterest(const std::string& device_id, const std::string& payload);
+    PModbusChannel FindChannel(std::shared_ptr<TModbusRegister> reg) const;
     void OnModbusValueChange(std::shared_ptr<TModbusRegister> reg);
+    // read_time_ms is 0 when the value didn't come from the bus
+    void PublishValue(const TModbusChannel& channel, const std::string& payload,
+                      long long read_time_ms);
+    long long GetReadTimeMs(const TModbusChannel& channel) const;
+    void PublishDeviceValues();
     void PublishError(std::shared_ptr<TModbusRegister> reg);
     void DeleteErrorMessages(std::shared_ptr<TModbusRegister> reg);
     PMQTTClientBase MQTTClient;
     PPortConfig Config;
-    std::unique_ptr<TModbusClient> ModbusClient;
-    std::unordered_map<std::shared_ptr<TModbusRegister>, PModbusChannel> RegisterToChannelMap;
+    PModbusClient ModbusClient;
+    PModbusMux Mux;
+    // indexed by TModbusRegister::Index
+    std::vector<PModbusChannel> RegisterToChannel;
     std::unordered_map<std::string, PModbusChannel> NameToChannelMap;
+    // device id -> values changed during the current cycle,
+    // also filled by HandleMessage() from the MQTT thread
+    std::mutex DeviceValuesMutex;
+    std::map<std::string, Json::Value> DeviceValues;
 };
@@ -0,0 +1,269 @@
+#include <wbmqtt/utils.h>
+#include "modbus_rpc.h"
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_COILS = 0x0F,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    const int MaxReadBits = 2000;
+    const int MaxReadRegisters = 125;
+    const int MaxWriteBits = 1968;
+    const int MaxWriteRegisters = 123;
+
+    void PutWord(std::vector<uint8_t>& data, int value)
+    {
+        data.push_back((value >> 8) & 0xff);
+        data.push_back(value & 0xff);
+    }
+
+    int GetInt(const Json::Value& params, const std::string& key, int min, int max)
+    {
+        if (!params.isMember(key) || !params[key].isInt())
+            throw TBaseException("missing or invalid '" + key + "' parameter");
+        int value = params[key].asInt();
+        if (value < min || value > max)
+            throw TBaseException("'" + key + "' is out of range: " + std::to_string(value));
+        return value;
+    }
+
+    std::string GetType(const Json::Value& params)
+    {
+        if (!params.isMember("type") || !params["type"].isString())
+            throw TBaseException("missing or invalid 'type' parameter");
+        return params["type"].asString();
+    }
+}
+
+TModbusRPC::TModbusRPC(PMQTTClientBase mqtt_client)
+    : MQTTClient(mqtt_client) {}
+
+void TModbusRPC::AddPort(const std::string& path, PModbusClient client)
+{
+    Clients[path] = client;
+}
+
+void TModbusRPC::SetUp()
+{
+    RPCServer = std::make_shared<TMQTTRPCServer>(MQTTClient, "wb-modbus");
+    RPCServer->RegisterMethod("modbus", "interest", std::bind(&TModbusRPC::Interest, this, std::placeholders::_1));
+    RPCServer->RegisterMethod("modbus", "stats", std::bind(&TModbusRPC::Stats, this, std::placeholders::_1));
+    RPCServer->Init();
+}
+
+void TModbusRPC::PubSubSetup()
+{
+    MQTTClient->Subscribe(NULL, "/rpc/v1/wb-modbus/modbus/read/+");
+    MQTTClient->Subscribe(NULL, "/rpc/v1/wb-modbus/modbus/write/+");
+}
+
+bool TModbusRPC::HandleMessage(const std::string& topic, const std::string& payload)
+{
+    //~ /rpc/v1/wb-modbus/modbus/read/<client id>
+    const std::vector<std::string>& tokens = StringSplit(topic, '/');
+    if ((tokens.size() != 7) ||
+        (tokens[0] != "") || (tokens[1] != "rpc") || (tokens[2] != "v1") ||
+        (tokens[3] != "wb-modbus") || (tokens[4] != "modbus") ||
+        (tokens[5] != "read" && tokens[5] != "write"))
+        return false;
+
+    Json::Value request;
+    Json::Reader reader;
+    if (!reader.parse(payload, request, false) || !request.isObject() || !request.isMember("id"))
+        return true;
+
+    PMQTTClientBase mqtt_client = MQTTClient;
+    Json::Value id = request["id"];
+    std::string reply_topic = topic + "/reply";
+    TReplyCallback reply = [mqtt_client, id, reply_topic](const Json::Value& result,
+                                                          const std::string& error) {
+            Json::Value message;
+            message["id"] = id;
+            message["result"] = result;
+            if (error.empty())
+                message["error"] = Json::Value();
+            else
+                message["error"]["message"] = error;
+            Json::FastWriter writer;
+            std::string text = writer.write(message);
+            if (!text.empty() && text.back() == '\n')
+                text.pop_back();
+            mqtt_client->Publish(NULL, reply_topic, text, 2, false);
+        };
+
+    try {
+        if (tokens[5] == "read")
+            Read(request["params"], reply);
+        else
+            Write(request["params"], reply);
+    } catch (const TBaseException& e) {
+        reply(Json::Value(), e.what());
+    }
+    return true;
+}
+
+void TModbusRPC::Read(const Json::Value& params, const TReplyCallback& reply)
+{
+    PModbusClient client = GetClient(params);
+    int slave = GetInt(params, "slave", 1, 247);
+    std::string type = GetType(params);
+    int address = GetInt(params, "address", 0, 0xffff);
+
+    uint8_t function;
+    bool bits = type == "coil" || type == "discrete";
+    if (type == "coil")
+        function = READ_COILS;
+    else if (type == "discrete")
+        function = READ_DISCRETE_INPUTS;
+    else if (type == "holding")
+        function = READ_HOLDING_REGISTERS;
+    else if (type == "input")
+        function = READ_INPUT_REGISTERS;
+    else
+        throw TBaseException("invalid register type: " + type);
+
+    int count = params.isMember("count") ?
+        GetInt(params, "count", 1, bits ? MaxReadBits : MaxReadRegisters) : 1;
+    std::vector<uint8_t> pdu = { function };
+    PutWord(pdu, address);
+    PutWord(pdu, count);
+
+    Execute(client, slave, pdu, [bits, count](const std::vector<uint8_t>& response) {
+            size_t size = bits ? (count + 7) / 8 : count * 2;
+            if (response.size() != size + 2 || response[1] != size)
+                throw TBaseException("bad response size");
+
+            Json::Value values(Json::arrayValue);
+            for (int i = 0; i < count; ++i) {
+                if (bits)
+                    values.append((response[2 + i / 8] >> (i % 8)) & 1);
+                else
+                    values.append((response[2 + i * 2] << 8) | response[3 + i * 2]);
+            }
+
+            Json::Value result;
+            result["values"] = values;
+            return result;
+        }, reply);
+}
+
+void TModbusRPC::Write(const Json::Value& params, const TReplyCallback& reply)
+{
+    PModbusClient client = GetClient(params);
+    // slave 0 is a broadcast write
+    int slave = GetInt(params, "slave", 0, 247);
+    std::string type = GetType(params);
+    int address = GetInt(params, "address", 0, 0xffff);
+
+    if (type != "coil" && type != "holding")
+        throw TBaseException("can't write to registers of type " + type);
+    bool bits = type == "coil";
+
+    const Json::Value& values = params["values"];
+    if (!values.isArray() || values.empty() ||
+        values.size() > Json::ArrayIndex(bits ? MaxWriteBits : MaxWriteRegisters))
+        throw TBaseException("missing or invalid 'values' parameter");
+    for (const auto& value: values) {
+        if (!value.isInt() || value.asInt() < 0 || value.asInt() > (bits ? 1 : 0xffff))
+            throw TBaseException("invalid value in 'values' parameter");
+    }
+
+    int count = values.size();
+    std::vector<uint8_t> pdu;
+    if (count == 1) {
+        pdu.push_back(bits ? WRITE_SINGLE_COIL : WRITE_SINGLE_REGISTER);
+        PutWord(pdu, address);
+        PutWord(pdu, bits ? (values[0].asInt() ? 0xff00 : 0) : values[0].asInt());
+    } else if (bits) {
+        pdu.push_back(WRITE_MULTIPLE_COILS);
+        PutWord(pdu, address);
+        PutWord(pdu, count);
+        pdu.push_back((count + 7) / 8);
+        pdu.resize(pdu.size() + (count + 7) / 8);
+        for (int i = 0; i < count; ++i) {
+            if (values[i].asInt())
+                pdu[6 + i / 8] |= 1 << (i % 8);
+        }
+    } else {
+        pdu.push_back(WRITE_MULTIPLE_REGISTERS);
+        PutWord(pdu, address);
+        PutWord(pdu, count);
+        pdu.push_back(count * 2);
+        for (const auto& value: values)
+            PutWord(pdu, value.asInt());
+    }
+
+    Execute(client, slave, pdu, [count](const std::vector<uint8_t>&) {
+            Json::Value result;
+            result["count"] = count;
+            return result;
+        }, reply);
+}
+
+Json::Value TModbusRPC::Interest(const Json::Value& params)
+{
+    PModbusClient client = GetClient(params);
+    int slave = GetInt(params, "slave", 1, 247);
+    int duration = GetInt(params, "duration", 1, TModbusClient::MaxInterestDurationMs / 1000);
+    client->SetInterest(slave, duration * 1000);
+    return Json::Value(Json::objectValue);
+}
+
+Json::Value TModbusRPC::Stats(const Json::Value& params)
+{
+    TModbusTimingStats stats = GetClient(params)->GetTimingStats();
+    Json::Value result;
+    result["responses"] = Json::UInt64(stats.Responses);
+    if (stats.Responses) {
+        result["turnaround_avg_us"] = Json::UInt64(stats.TurnaroundUs / stats.Responses);
+        result["turnaround_min_us"] = stats.MinTurnaroundUs;
+        result["turnaround_max_us"] = stats.MaxTurnaroundUs;
+        result["transaction_avg_us"] = Json::UInt64(stats.TransactionUs / stats.Responses);
+        result["wire_avg_us"] = Json::UInt64(stats.WireUs / stats.Responses);
+    }
+    return result;
+}
+
+PModbusClient TModbusRPC::GetClient(const Json::Value& params) const
+{
+    if (!params.isMember("port") || !params["port"].isString())
+        throw TBaseException("missing or invalid 'port' parameter");
+    auto it = Clients.find(params["port"].asString());
+    if (it == Clients.end())
+        throw TBaseException("port not found: " + params["port"].asString());
+    return it->second;
+}
+
+void TModbusRPC::Execute(PModbusClient client, int slave, const std::vector<uint8_t>& pdu,
+                         const TResponseParser& parse, const TReplyCallback& reply)
+{
+    uint8_t function = pdu[0];
+    client->QueueRawRequest(slave, pdu, [slave, function, parse, reply](const std::vector<uint8_t>& response,
+                                                                        const std::string& error) {
+            if (!error.empty()) {
+                reply(Json::Value(), error);
+                return;
+            }
+
+            Json::Value result;
+            try {
+                // broadcast requests have no response
+                if (slave && response.size() >= 2 && response[0] == (function | 0x80))
+                    throw TBaseException("slave exception: " + std::to_string(response[1]));
+                if (slave && (response.empty() || response[0] != function))
+                    throw TBaseException("function code mismatch in response");
+                result = parse(response);
+            } catch (const TBaseException& e) {
+                reply(Json::Value(), e.what());
+                return;
+            }
+            reply(result, "");
+        });
+}
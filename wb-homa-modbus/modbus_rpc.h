@@ -0,0 +1,65 @@
+#pragma once
+
+#include <map>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <wbmqtt/mqtt_wrapper.h>
+#include <wbmqtt/mqttrpc.h>
+#include "modbus_client.h"
+
+// MQTT RPC for one-shot access to arbitrary registers of the devices
+// that aren't listed in the config (service "modbus", methods
+// "read" and "write"). The requests are executed by the polling loop
+// of the port at the next transaction boundary, so they don't add any
+// load to the bus once done. Method "interest" temporarily raises
+// the poll rate of the slave's registers, "stats" reports bus timing.
+class TModbusRPC
+{
+public:
+    // Receives the result, or an error message if the request failed
+    typedef std::function<void(const Json::Value& result,
+                               const std::string& error)> TReplyCallback;
+
+    TModbusRPC(PMQTTClientBase mqtt_client);
+    void AddPort(const std::string& path, PModbusClient client);
+    void SetUp();
+    // Subscribes to "read" and "write" requests, called on each connect
+    void PubSubSetup();
+    // Serves "read" and "write" requests. Unlike the methods of
+    // TMQTTRPCServer, they are answered later from the polling loop,
+    // so the MQTT thread doesn't wait for the bus.
+    bool HandleMessage(const std::string& topic, const std::string& payload);
+
+    // params: {"port": path, "slave": n, "type": "coil" | "discrete" |
+    // "holding" | "input", "address": n, "count": n}.
+    // Replies {"values": [...]}. Throws TBaseException on bad params,
+    // otherwise the reply is invoked from the thread polling the port.
+    void Read(const Json::Value& params, const TReplyCallback& reply);
+    // params: {"port": path, "slave": n, "type": "coil" | "holding",
+    // "address": n, "values": [...]}. Replies {"count": n}, like Read()
+    void Write(const Json::Value& params, const TReplyCallback& reply);
+    // params: {"port": path, "slave": n, "duration": seconds}. Polls the
+    // slave's registers at full rate for the duration. Returns {}
+    Json::Value Interest(const Json::Value& params);
+    // params: {"port": path}. Returns {"responses": n,
+    // "turnaround_avg_us": n, "turnaround_min_us": n, "turnaround_max_us": n,
+    // "transaction_avg_us": n, "wire_avg_us": n}, see TModbusTimingStats.
+    // Averages are omitted until there are responses.
+    Json::Value Stats(const Json::Value& params);
+
+private:
+    typedef std::function<Json::Value(const std::vector<uint8_t>& response)> TResponseParser;
+
+    PModbusClient GetClient(const Json::Value& params) const;
+    void Execute(PModbusClient client, int slave, const std::vector<uint8_t>& pdu,
+                 const TResponseParser& parse, const TReplyCallback& reply);
+
+    PMQTTClientBase MQTTClient;
+    std::map<std::string, PModbusClient> Clients;
+    PMQTTRPCServer RPCServer;
+};
+
+typedef std::shared_ptr<TModbusRPC> PModbusRPC;
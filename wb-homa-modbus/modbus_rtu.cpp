@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <array>
+
+#include "modbus_rtu.h"
+
+namespace {
+    speed_t GetSpeed(int baud_rate)
+    {
+        switch (baud_rate) {
+        case 110: return B110;
+        case 300: return B300;
+        case 600: return B600;
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default:
+            throw TModbusException("unsupported baud rate: " + std::to_string(baud_rate));
+        }
+    }
+
+    const int MaxEvents = 8;
+    // the shortest response (an exception) is 5 bytes long
+    const int MinResponseSize = 5;
+
+    uint32_t Microseconds(std::chrono::steady_clock::duration d)
+    {
+        int64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        return usec > 0 ? usec : 0;
+    }
+}
+
+const int TModbusRtuTransport::MaxFrameSize;
+
+TModbusRtuTransport::TModbusRtuTransport(const TModbusConnectionSettings& settings)
+    : Settings(settings)
+{
+    int char_bits = 1 + settings.DataBits + (settings.Parity == 'N' ? 0 : 1) + settings.StopBits;
+    CharTimeUs = char_bits * 1000000 / settings.BaudRate;
+    FrameGapUs = settings.BaudRate > 19200 ? 1750 : 3500000 * char_bits / settings.BaudRate;
+
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    WakeTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (EpollFd < 0 || TimerFd < 0 || WakeTimerFd < 0)
+        throw TModbusException("failed to create epoll / timer descriptors");
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = TimerFd;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, TimerFd, &ev);
+    ev.data.fd = WakeTimerFd;
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, WakeTimerFd, &ev);
+}
+
+TModbusRtuTransport::~TModbusRtuTransport()
+{
+    if (Fd >= 0)
+        close(Fd);
+    close(WakeTimerFd);
+    close(TimerFd);
+    close(EpollFd);
+}
+
+void TModbusRtuTransport::Open()
+{
+    if (Fd >= 0)
+        throw TModbusException("port already open");
+
+    Fd = open(Settings.Device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (Fd < 0)
+        throw TModbusException("cannot open serial port " + Settings.Device +
+                               ": " + strerror(errno));
+    try {
+        SetupPort();
+        SetupSerialOptions(Fd, Settings);
+    } catch (const TModbusException&) {
+        close(Fd);
+        Fd = -1;
+        throw;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = Fd;
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, Fd, &ev) < 0) {
+        close(Fd);
+        Fd = -1;
+        throw TModbusException("failed to add serial port to epoll set");
+    }
+}
+
+void TModbusRtuTransport::Close()
+{
+    if (Fd < 0)
+        return;
+
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, Fd, 0);
+    close(Fd);
+    Fd = -1;
+
+    while (!Requests.empty())
+        Complete(IO_ERROR);
+}
+
+bool TModbusRtuTransport::IsOpen() const
+{
+    return Fd >= 0;
+}
+
+void TModbusRtuTransport::SetDebug(bool debug)
+{
+    Debug = debug;
+}
+
+void TModbusRtuTransport::SetupPort()
+{
+    struct termios options;
+    memset(&options, 0, sizeof(options));
+
+    speed_t speed = GetSpeed(Settings.BaudRate);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+
+    options.c_cflag |= CREAD | CLOCAL;
+    switch (Settings.DataBits) {
+    case 5: options.c_cflag |= CS5; break;
+    case 6: options.c_cflag |= CS6; break;
+    case 7: options.c_cflag |= CS7; break;
+    default: options.c_cflag |= CS8; break;
+    }
+    if (Settings.StopBits == 2)
+        options.c_cflag |= CSTOPB;
+    if (Settings.Parity == 'E')
+        options.c_cflag |= PARENB;
+    else if (Settings.Parity == 'O')
+        options.c_cflag |= PARENB | PARODD;
+
+    // raw mode, reads never block as the descriptor is non-blocking anyway.
+    // VTIME stays 0 as the timeouts are handled with timerfd.
+    options.c_iflag = Settings.Parity == 'N' ? 0 : INPCK;
+    options.c_oflag = 0;
+    options.c_lflag = 0;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+    MinChars = 0;
+
+    if (tcsetattr(Fd, TCSANOW, &options) < 0)
+        throw TModbusException("failed to set serial port parameters");
+    tcflush(Fd, TCIOFLUSH);
+}
+
+void TModbusRtuTransport::SetMinChars(int n)
+{
+    // with VTIME = 0 poll() on the tty reports input only when
+    // at least VMIN bytes are available, so the response doesn't
+    // wake us up on each chunk delivered by the driver
+    n = std::max(1, std::min(n, 255));
+    if (!Settings.LowLatency || n == MinChars)
+        return;
+
+    struct termios options;
+    if (tcgetattr(Fd, &options) < 0)
+        return;
+    options.c_cc[VMIN] = n;
+    if (tcsetattr(Fd, TCSANOW, &options) == 0)
+        MinChars = n;
+}
+
+void TModbusRtuTransport::ArmTimer(int fd, int usec)
+{
+    // zero or negative value disarms the timer
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (usec < 0)
+        usec = 0;
+    spec.it_value.tv_sec = usec / 1000000;
+    spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(fd, 0, &spec, 0);
+}
+
+void TModbusRtuTransport::Submit(int slave, const std::vector<uint8_t>& pdu, int timeout_us,
+                                 const TCallback& callback)
+{
+    if (pdu.empty() || pdu.size() > MaxFrameSize - 3)
+        throw TModbusException("invalid request size");
+
+    TRequest request;
+    request.Slave = slave;
+    request.TimeoutUs = timeout_us;
+    request.Callback = callback;
+    request.Frame.reserve(pdu.size() + 3);
+    request.Frame.push_back(slave);
+    request.Frame.insert(request.Frame.end(), pdu.begin(), pdu.end());
+    uint16_t crc = CRC16(&request.Frame[0], request.Frame.size());
+    request.Frame.push_back(crc & 0xff);
+    request.Frame.push_back(crc >> 8);
+    Requests.push_back(request);
+
+    if (Phase == IDLE)
+        StartNext();
+}
+
+bool TModbusRtuTransport::IsIdle() const
+{
+    return Phase == IDLE && Requests.empty();
+}
+
+void TModbusRtuTransport::StartNext()
+{
+    if (Requests.empty()) {
+        Phase = IDLE;
+        return;
+    }
+
+    if (Fd < 0) {
+        Complete(IO_ERROR);
+        return;
+    }
+
+    // keep the silent interval between frames
+    // the value may not fit in int when no frames were sent yet
+    int64_t gap = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - LastFrameTime).count();
+    if (gap < FrameGapUs) {
+        Phase = WAIT_GAP;
+        ArmTimer(TimerFd, FrameGapUs - gap);
+        return;
+    }
+
+    // drop any garbage left from previous transactions
+    tcflush(Fd, TCIFLUSH);
+    Response.clear();
+    BytesSent = 0;
+    Phase = SENDING;
+    RequestStartTime = std::chrono::steady_clock::now();
+    Send();
+}
+
+void TModbusRtuTransport::Send()
+{
+    const TRequest& request = Requests.front();
+    if (Debug && !BytesSent)
+        DumpFrame("-> ", &request.Frame[0], request.Frame.size());
+
+    while (BytesSent < request.Frame.size()) {
+        ssize_t n = write(Fd, &request.Frame[BytesSent], request.Frame.size() - BytesSent);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            Complete(IO_ERROR);
+            return;
+        }
+        BytesSent += n;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = Fd;
+    if (BytesSent < request.Frame.size()) {
+        ev.events = EPOLLIN | EPOLLOUT;
+        epoll_ctl(EpollFd, EPOLL_CTL_MOD, Fd, &ev);
+        return;
+    }
+    ev.events = EPOLLIN;
+    epoll_ctl(EpollFd, EPOLL_CTL_MOD, Fd, &ev);
+
+    // write() returns as soon as the data is queued,
+    // the timeout starts when the request leaves the wire
+    int wire_time = GetWireTimeUs(request.Frame.size());
+    Phase = WAIT_RESPONSE;
+    if (!request.Slave) {
+        // nobody answers broadcast requests
+        ArmTimer(TimerFd, wire_time);
+        return;
+    }
+    RequestEndTime = RequestStartTime + std::chrono::microseconds(wire_time);
+    SetMinChars(MinResponseSize);
+    ArmTimer(TimerFd, wire_time + request.TimeoutUs);
+}
+
+int TModbusRtuTransport::ExpectedResponseSize() const
+{
+    if (Response.size() < 2)
+        return -1;
+
+    uint8_t function = Response[1];
+    if (function & 0x80)
+        return 5;
+
+    switch (function) {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x17:
+        return Response.size() < 3 ? -1 : 5 + Response[2];
+    case 0x05:
+    case 0x06:
+    case 0x0f:
+    case 0x10:
+        return 8;
+    default:
+        // unknown function, the frame ends when its CRC matches
+        // or on inter-frame silence
+        return -1;
+    }
+}
+
+void TModbusRtuTransport::HandleInput()
+{
+    uint8_t buf[MaxFrameSize];
+    for (;;) {
+        ssize_t n = read(Fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            if (Phase != IDLE && !Requests.empty())
+                Complete(IO_ERROR);
+            return;
+        }
+        if (!n)
+            break;
+        if (Phase != WAIT_RESPONSE && Phase != RECEIVING) {
+            if (Debug)
+                DumpFrame("unexpected data: ", buf, n);
+            continue;
+        }
+        if (Response.size() + n > MaxFrameSize) {
+            Complete(BAD_RESPONSE);
+            return;
+        }
+        if (Response.empty())
+            FirstByteTime = std::chrono::steady_clock::now() -
+                std::chrono::microseconds(GetWireTimeUs(n));
+        Response.insert(Response.end(), buf, buf + n);
+    }
+
+    if (Phase != WAIT_RESPONSE && Phase != RECEIVING)
+        return;
+    if (Response.empty())
+        return;
+
+    Phase = RECEIVING;
+    int expected = ExpectedResponseSize();
+    if (expected > 0 && static_cast<int>(Response.size()) >= expected) {
+        Response.resize(expected);
+        Complete(CRC16(&Response[0], Response.size()) ? CRC_ERROR : OK);
+        return;
+    }
+    if (expected < 0 && Response.size() >= 4 && !CRC16(&Response[0], Response.size())) {
+        Complete(OK);
+        return;
+    }
+
+    // wait for the rest of the frame at once if its size is known
+    SetMinChars(expected > 0 ? expected - Response.size() : 1);
+    // restart inter-character timeout. tty drivers tend to deliver data in
+    // chunks, so the silence interval alone is too short here.
+    ArmTimer(TimerFd, std::max(FrameGapUs, 20000));
+}
+
+void TModbusRtuTransport::HandleTimer()
+{
+    uint64_t expirations;
+    if (read(TimerFd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    switch (Phase) {
+    case WAIT_GAP:
+        StartNext();
+        break;
+    case WAIT_RESPONSE:
+        Complete(Requests.front().Slave ? TIMEOUT : OK);
+        break;
+    case RECEIVING:
+        // incomplete frame
+        Complete(TIMEOUT);
+        break;
+    default:
+        break;
+    }
+}
+
+void TModbusRtuTransport::Complete(TStatus status)
+{
+    TRequest request = Requests.front();
+    Requests.pop_front();
+    LastFrameTime = std::chrono::steady_clock::now();
+    ArmTimer(TimerFd, 0);
+
+    if (Debug) {
+        if (!Response.empty())
+            DumpFrame("<- ", &Response[0], Response.size());
+        if (status != OK)
+            std::cerr << "modbus rtu: request failed, status " << status << std::endl;
+    }
+
+    std::vector<uint8_t> pdu;
+    if (status == OK && !Response.empty()) {
+        if (Response[0] != request.Slave)
+            status = BAD_RESPONSE;
+        else {
+            pdu.assign(Response.begin() + 1, Response.end() - 2);
+            TimingStats.AddSample(Microseconds(FirstByteTime - RequestEndTime),
+                                  Microseconds(LastFrameTime - RequestStartTime),
+                                  GetWireTimeUs(request.Frame.size() + Response.size()));
+        }
+    }
+    Response.clear();
+
+    Phase = IDLE;
+    if (request.Callback)
+        request.Callback(status, pdu);
+    // the callback may have submitted another request already
+    if (Phase == IDLE)
+        StartNext();
+}
+
+void TModbusRtuTransport::RunOnce(int timeout_ms)
+{
+    struct epoll_event events[MaxEvents];
+    int n = epoll_wait(EpollFd, events, MaxEvents, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return;
+        throw TModbusException("epoll_wait() failed");
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == TimerFd)
+            HandleTimer();
+        else if (fd == WakeTimerFd) {
+            uint64_t expirations;
+            if (read(WakeTimerFd, &expirations, sizeof(expirations)) < 0)
+                continue;
+        } else if (fd == Fd) {
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                if (!Requests.empty() && Phase != WAIT_GAP)
+                    Complete(IO_ERROR);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && Phase == SENDING)
+                Send();
+            if (Fd >= 0 && (events[i].events & EPOLLIN))
+                HandleInput();
+        } else {
+            auto it = Watches.find(fd);
+            if (it != Watches.end())
+                it->second();
+        }
+    }
+}
+
+void TModbusRtuTransport::RunFor(int usec, const std::function<bool()>& stop)
+{
+    if (usec <= 0)
+        return;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(usec);
+    ArmTimer(WakeTimerFd, usec);
+    while (std::chrono::steady_clock::now() < deadline && !(stop && stop()))
+        RunOnce(-1);
+}
+
+void TModbusRtuTransport::Watch(int fd, const TWatchHandler& handler)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw TModbusException("failed to add descriptor to epoll set");
+    Watches[fd] = handler;
+}
+
+void TModbusRtuTransport::Unwatch(int fd)
+{
+    epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, 0);
+    Watches.erase(fd);
+}
+
+int TModbusRtuTransport::GetWireTimeUs(int bytes) const
+{
+    return bytes * CharTimeUs;
+}
+
+uint16_t TModbusRtuTransport::CRC16(const uint8_t* data, size_t len)
+{
+    // initialized once even when called from several threads
+    static const std::array<uint16_t, 256> table = []() {
+        std::array<uint16_t, 256> t;
+        for (int i = 0; i < 256; ++i) {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+            t[i] = crc;
+        }
+        return t;
+    }();
+
+    uint16_t crc = 0xffff;
+    while (len--)
+        crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+void TModbusRtuTransport::DumpFrame(const char* prefix, const uint8_t* data, size_t len) const
+{
+    std::cerr << "modbus rtu: " << prefix << std::hex << std::setfill('0');
+    for (size_t i = 0; i < len; ++i)
+        std::cerr << std::setw(2) << static_cast<int>(data[i]) << " ";
+    std::cerr << std::dec << std::endl;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+// Modbus RTU transport driving the tty with epoll and timerfd.
+// Requests are queued with Submit() and completed from RunOnce(),
+// so the owner can service other file descriptors (see Watch())
+// while a transaction is in progress.
+class TModbusRtuTransport
+{
+public:
+    enum TStatus { OK, TIMEOUT, CRC_ERROR, BAD_RESPONSE, IO_ERROR };
+
+    // pdu is the function code followed by data. Exception
+    // responses are passed as is, with 0x80 bit set in the function code.
+    typedef std::function<void(TStatus status, const std::vector<uint8_t>& pdu)> TCallback;
+    typedef std::function<void()> TWatchHandler;
+
+    static const int MaxFrameSize = 256;
+
+    TModbusRtuTransport(const TModbusConnectionSettings& settings);
+    TModbusRtuTransport(const TModbusRtuTransport&) = delete;
+    TModbusRtuTransport& operator=(const TModbusRtuTransport&) = delete;
+    ~TModbusRtuTransport();
+    void Open();
+    void Close();
+    bool IsOpen() const;
+    void SetDebug(bool debug);
+
+    // Queues the request. Requests to the broadcast address (0)
+    // complete with empty pdu as soon as they're sent.
+    void Submit(int slave, const std::vector<uint8_t>& pdu, int timeout_us,
+                const TCallback& callback);
+    bool IsIdle() const;
+    // Processes I/O and timer events, waiting at most timeout_ms
+    // (-1 means wait until something happens).
+    void RunOnce(int timeout_ms = -1);
+    // Keeps processing events for the specified time or
+    // until stop (if specified) returns true.
+    void RunFor(int usec, const std::function<bool()>& stop = std::function<bool()>());
+    void Watch(int fd, const TWatchHandler& handler);
+    void Unwatch(int fd);
+    int GetFrameGapUs() const { return FrameGapUs; }
+    // Transmission time of the specified number of bytes
+    int GetWireTimeUs(int bytes) const;
+    const TModbusTimingStats& GetTimingStats() const { return TimingStats; }
+
+    static uint16_t CRC16(const uint8_t* data, size_t len);
+
+private:
+    enum TPhase { IDLE, WAIT_GAP, SENDING, WAIT_RESPONSE, RECEIVING };
+
+    struct TRequest
+    {
+        int Slave;
+        std::vector<uint8_t> Frame;
+        int TimeoutUs;
+        TCallback Callback;
+    };
+
+    void SetupPort();
+    // Number of bytes the tty waits for before reporting input
+    // (VMIN), only changed in low latency mode
+    void SetMinChars(int n);
+    void ArmTimer(int fd, int usec);
+    void StartNext();
+    void Send();
+    void HandleInput();
+    void HandleTimer();
+    int ExpectedResponseSize() const;
+    void Complete(TStatus status);
+    void DumpFrame(const char* prefix, const uint8_t* data, size_t len) const;
+
+    TModbusConnectionSettings Settings;
+    int Fd = -1;
+    int EpollFd = -1;
+    int TimerFd = -1;
+    int WakeTimerFd = -1;
+    bool Debug = false;
+    int FrameGapUs;
+    int CharTimeUs;
+    TPhase Phase = IDLE;
+    std::deque<TRequest> Requests;
+    size_t BytesSent = 0;
+    std::vector<uint8_t> Response;
+    std::chrono::steady_clock::time_point LastFrameTime;
+    int MinChars = 0;
+    // timing of the current transaction, the end of the request and
+    // the first response byte are estimated from the wire time
+    std::chrono::steady_clock::time_point RequestStartTime, RequestEndTime, FirstByteTime;
+    TModbusTimingStats TimingStats;
+    std::map<int, TWatchHandler> Watches;
+};
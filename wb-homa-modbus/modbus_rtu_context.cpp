@@ -0,0 +1,220 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <chrono>
+
+#include "modbus_rtu_context.h"
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    void PutWord(std::vector<uint8_t>& pdu, int value)
+    {
+        pdu.push_back((value >> 8) & 0xff);
+        pdu.push_back(value & 0xff);
+    }
+
+    const char* TransportStatusText(TModbusRtuTransport::TStatus status)
+    {
+        switch (status) {
+        case TModbusRtuTransport::TIMEOUT:
+            return "timeout";
+        case TModbusRtuTransport::CRC_ERROR:
+            return "CRC error";
+        case TModbusRtuTransport::BAD_RESPONSE:
+            return "bad response";
+        case TModbusRtuTransport::IO_ERROR:
+            return "I/O error";
+        default:
+            return "ok";
+        }
+    }
+}
+
+TModbusRtuContext::TModbusRtuContext(const TModbusConnectionSettings& settings)
+    : RtuTransport(settings),
+      ResponseTime((settings.ResponseTimeoutMs > 0 ?
+                    settings.ResponseTimeoutMs :
+                    TModbusConnectionSettings::DefaultResponseTimeoutMs) * 1000)
+{
+    InterruptFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (InterruptFd < 0)
+        throw TModbusException("failed to create eventfd");
+    RtuTransport.Watch(InterruptFd, [this]() {
+            uint64_t count;
+            if (read(InterruptFd, &count, sizeof(count)) == sizeof(count))
+                Interrupted = true;
+        });
+}
+
+TModbusRtuContext::~TModbusRtuContext()
+{
+    RtuTransport.Unwatch(InterruptFd);
+    close(InterruptFd);
+}
+
+void TModbusRtuContext::Connect()
+{
+    if (!RtuTransport.IsOpen())
+        RtuTransport.Open();
+}
+
+void TModbusRtuContext::Disconnect()
+{
+    RtuTransport.Close();
+}
+
+void TModbusRtuContext::SetDebug(bool debug)
+{
+    RtuTransport.SetDebug(debug);
+}
+
+void TModbusRtuContext::SetSlave(int slave)
+{
+    Slave = slave;
+}
+
+TModbusRtuTransport::TStatus TModbusRtuContext::Exchange(const std::vector<uint8_t>& pdu,
+                                                        bool adaptive_timeout,
+                                                        std::vector<uint8_t>& response)
+{
+    Connect();
+
+    bool done = false;
+    TModbusRtuTransport::TStatus status;
+    // writes may take noticeably longer on some devices (e.g. EEPROM
+    // updates) so only reads use the learned timeout
+    int timeout_us = adaptive_timeout ? ResponseTime.GetTimeoutUs(Slave) : ResponseTime.GetMaxTimeoutUs();
+    auto start = std::chrono::steady_clock::now();
+    RtuTransport.Submit(Slave, pdu, timeout_us,
+                        [&](TModbusRtuTransport::TStatus s, const std::vector<uint8_t>& r) {
+                            done = true;
+                            status = s;
+                            response = r;
+                        });
+    // TModbusClient::Cycle() expects a synchronous context, so this
+    // is a blocking adapter over the transport. RunOnce() waits in
+    // epoll for the port, the timer or a watched descriptor, so the
+    // loop doesn't spin and watched descriptors are served meanwhile.
+    while (!done)
+        RtuTransport.RunOnce();
+
+    if (status == TModbusRtuTransport::OK && Slave)
+        ResponseTime.AddSample(Slave, std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - start).count());
+    else if (status == TModbusRtuTransport::TIMEOUT)
+        ResponseTime.AddTimeout(Slave);
+    return status;
+}
+
+TModbusContext::TStatus TModbusRtuContext::Execute(uint8_t function, int addr, int nb,
+                                                   uint16_t* data, int& exception_code)
+{
+    bool write = false;
+    std::vector<uint8_t> pdu = { function };
+    PutWord(pdu, addr);
+    switch (function) {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+    case READ_HOLDING_REGISTERS:
+    case READ_INPUT_REGISTERS:
+        PutWord(pdu, nb);
+        break;
+    case WRITE_SINGLE_COIL:
+        PutWord(pdu, data[0] ? 0xff00 : 0);
+        write = true;
+        break;
+    case WRITE_SINGLE_REGISTER:
+        PutWord(pdu, data[0]);
+        write = true;
+        break;
+    case WRITE_MULTIPLE_REGISTERS:
+        PutWord(pdu, nb);
+        pdu.push_back(nb * 2);
+        for (int i = 0; i < nb; ++i)
+            PutWord(pdu, data[i]);
+        write = true;
+        break;
+    default:
+        exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+        return SLAVE_EXCEPTION;
+    }
+
+    std::vector<uint8_t> response;
+    switch (Exchange(pdu, !write, response)) {
+    case TModbusRtuTransport::OK:
+        break;
+    case TModbusRtuTransport::TIMEOUT:
+        return TIMEOUT;
+    case TModbusRtuTransport::CRC_ERROR:
+    case TModbusRtuTransport::BAD_RESPONSE:
+        return BAD_RESPONSE;
+    default:
+        return IO_ERROR;
+    }
+
+    // broadcast requests have no response
+    if (!Slave)
+        return OK;
+
+    if (response.size() >= 2 && response[0] == (function | 0x80)) {
+        exception_code = response[1];
+        return SLAVE_EXCEPTION;
+    }
+
+    if (response.empty() || response[0] != function)
+        return BAD_RESPONSE;
+    if (write)
+        return OK;
+
+    bool bits = function == READ_COILS || function == READ_DISCRETE_INPUTS;
+    size_t byte_count = bits ? (nb + 7) / 8 : nb * 2;
+    if (response.size() != byte_count + 2 || response[1] != byte_count)
+        return BAD_RESPONSE;
+
+    for (int i = 0; i < nb; ++i)
+        data[i] = bits ? (response[2 + i / 8] >> (i % 8)) & 1 :
+            (response[2 + i * 2] << 8) | response[3 + i * 2];
+    return OK;
+}
+
+void TModbusRtuContext::USleep(int usec)
+{
+    // keep serving watched descriptors instead of blocking in usleep().
+    // An interrupt that came during a transaction ends the next sleep.
+    RtuTransport.RunFor(usec, [this]() { return Interrupted; });
+    Interrupted = false;
+}
+
+void TModbusRtuContext::Interrupt()
+{
+    uint64_t one = 1;
+    if (write(InterruptFd, &one, sizeof(one)) < 0)
+        return; // counter overflow, the wakeup is pending anyway
+}
+
+TModbusTimingStats TModbusRtuContext::GetTimingStats() const
+{
+    return RtuTransport.GetTimingStats();
+}
+
+std::vector<uint8_t> TModbusRtuContext::RawRequest(const std::vector<uint8_t>& pdu)
+{
+    std::vector<uint8_t> response;
+    TModbusRtuTransport::TStatus status = Exchange(pdu, false, response);
+    if (status != TModbusRtuTransport::OK)
+        throw TModbusException(std::string("raw request failed: ") + TransportStatusText(status));
+    return response;
+}
+
+PModbusContext TModbusRtuConnector::CreateContext(const TModbusConnectionSettings& settings)
+{
+    return PModbusContext(new TModbusRtuContext(settings));
+}
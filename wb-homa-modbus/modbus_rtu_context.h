@@ -0,0 +1,41 @@
+#pragma once
+
+#include "modbus_rtu.h"
+#include "modbus_client.h"
+
+// Synchronous context on top of TModbusRtuTransport: each transaction
+// runs the transport until the request completes.
+class TModbusRtuContext: public TModbusStatusContext
+{
+public:
+    TModbusRtuContext(const TModbusConnectionSettings& settings);
+    ~TModbusRtuContext();
+    void Connect();
+    void Disconnect();
+    void SetDebug(bool debug);
+    void SetSlave(int slave);
+    void USleep(int usec);
+    void Interrupt();
+    std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
+    TModbusTimingStats GetTimingStats() const;
+
+    TModbusRtuTransport& Transport() { return RtuTransport; }
+
+private:
+    TModbusRtuTransport::TStatus Exchange(const std::vector<uint8_t>& pdu, bool adaptive_timeout,
+                                          std::vector<uint8_t>& response);
+
+    TModbusRtuTransport RtuTransport;
+    TResponseTimeEstimator ResponseTime;
+    int Slave = 0;
+    // eventfd watched by the transport, signalled by Interrupt()
+    int InterruptFd = -1;
+    bool Interrupted = false;
+};
+
+class TModbusRtuConnector: public TModbusConnector
+{
+public:
+    PModbusContext CreateContext(const TModbusConnectionSettings& settings);
+};
@@ -0,0 +1,371 @@
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "modbus_tcp_server.h"
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_COILS = 0x0F,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    // MBAP header: transaction id, protocol id, length, unit id
+    const size_t HeaderSize = 7;
+    const size_t MaxPDUSize = 253;
+    // the requests of a client that doesn't read the responses
+    // are left unread once that much output is pending
+    const size_t MaxOutputSize = 65536;
+    const int MaxReadBits = 2000;
+    const int MaxReadRegisters = 125;
+    const int MaxWriteBits = 1968;
+    const int MaxWriteRegisters = 123;
+
+    int GetWord(const std::vector<uint8_t>& data, size_t offset)
+    {
+        return (data[offset] << 8) | data[offset + 1];
+    }
+
+    void PutWord(std::vector<uint8_t>& data, int value)
+    {
+        data.push_back((value >> 8) & 0xff);
+        data.push_back(value & 0xff);
+    }
+
+    void CheckSize(const std::vector<uint8_t>& pdu, size_t size)
+    {
+        if (pdu.size() != size)
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_VALUE,
+                                        "bad request size");
+    }
+
+    void CheckMinSize(const std::vector<uint8_t>& pdu, size_t size)
+    {
+        if (pdu.size() < size)
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_VALUE,
+                                        "request too short");
+    }
+
+    void CheckCount(int nb, int max)
+    {
+        if (nb < 1 || nb > max)
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_VALUE,
+                                        "bad quantity: " + std::to_string(nb));
+    }
+}
+
+TModbusTCPServer::TModbusTCPServer(const std::string& address, int port, bool debug)
+    : Address(address), Port(port), Debug(debug) {}
+
+TModbusTCPServer::~TModbusTCPServer()
+{
+    Stop();
+}
+
+void TModbusTCPServer::AddUnit(int unit_id, PModbusClient client, int slave)
+{
+    if (Thread.joinable())
+        throw TModbusException("can't add units to the running Modbus TCP server");
+    Units[unit_id] = TUnit{ client, slave };
+}
+
+bool TModbusTCPServer::HasUnit(int unit_id) const
+{
+    return Units.find(unit_id) != Units.end();
+}
+
+void TModbusTCPServer::Start()
+{
+    if (Thread.joinable())
+        return;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Port);
+    if (inet_pton(AF_INET, Address.c_str(), &addr.sin_addr) != 1)
+        throw TModbusException("bad Modbus TCP server address: " + Address);
+
+    ListenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenFd < 0)
+        throw TModbusException("socket() failed: " + std::string(strerror(errno)));
+    int on = 1;
+    setsockopt(ListenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(ListenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(ListenFd, 16) < 0) {
+        std::string error = strerror(errno);
+        close(ListenFd);
+        ListenFd = -1;
+        throw TModbusException("can't listen on " + Address + ":" + std::to_string(Port) +
+                               ": " + error);
+    }
+
+    socklen_t len = sizeof(addr);
+    if (getsockname(ListenFd, (struct sockaddr*)&addr, &len) == 0)
+        Port = ntohs(addr.sin_port);
+
+    StopFd = eventfd(0, EFD_CLOEXEC);
+    if (StopFd < 0)
+        throw TModbusException("eventfd() failed: " + std::string(strerror(errno)));
+    Thread = std::thread([this]() { Run(); });
+}
+
+void TModbusTCPServer::Stop()
+{
+    if (Thread.joinable()) {
+        uint64_t v = 1;
+        if (write(StopFd, &v, sizeof(v)) != sizeof(v))
+            std::cerr << "TModbusTCPServer::Stop(): failed to stop the server thread" << std::endl;
+        Thread.join();
+    }
+    for (const auto& conn: Connections)
+        close(conn.Fd);
+    Connections.clear();
+    if (ListenFd >= 0) {
+        close(ListenFd);
+        ListenFd = -1;
+    }
+    if (StopFd >= 0) {
+        close(StopFd);
+        StopFd = -1;
+    }
+}
+
+void TModbusTCPServer::Run()
+{
+    for (;;) {
+        std::vector<struct pollfd> fds(Connections.size() + 2);
+        fds[0].fd = StopFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = ListenFd;
+        fds[1].events = POLLIN;
+        for (size_t i = 0; i < Connections.size(); ++i) {
+            const TConnection& conn = Connections[i];
+            fds[i + 2].fd = conn.Fd;
+            fds[i + 2].events = conn.Output.size() < MaxOutputSize ? POLLIN : 0;
+            if (!conn.Output.empty())
+                fds[i + 2].events |= POLLOUT;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "TModbusTCPServer: poll() failed: " << strerror(errno) << std::endl;
+            return;
+        }
+
+        if (fds[0].revents)
+            return;
+
+        // handle the connections before accepting the new ones
+        // so that fds stay in sync with Connections
+        for (size_t i = fds.size() - 1; i >= 2; --i) {
+            TConnection& conn = Connections[i - 2];
+            bool ok = true;
+            if (fds[i].revents & POLLOUT)
+                ok = HandleOutput(conn);
+            if (ok && (fds[i].revents & ~POLLOUT))
+                ok = HandleInput(conn);
+            if (!ok) {
+                close(conn.Fd);
+                Connections.erase(Connections.begin() + (i - 2));
+            }
+        }
+
+        if (fds[1].revents)
+            Accept();
+    }
+}
+
+void TModbusTCPServer::Accept()
+{
+    // the server thread must not block on a client that doesn't read
+    int fd = accept4(ListenFd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        std::cerr << "TModbusTCPServer: accept() failed: " << strerror(errno) << std::endl;
+        return;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Connections.push_back(TConnection{ fd, std::vector<uint8_t>(), std::vector<uint8_t>() });
+}
+
+// Returns false if the connection must be closed
+bool TModbusTCPServer::HandleInput(TConnection& conn)
+{
+    uint8_t buf[HeaderSize + MaxPDUSize];
+    int n = read(conn.Fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (n <= 0)
+        return false;
+    conn.Buffer.insert(conn.Buffer.end(), buf, buf + n);
+
+    while (conn.Buffer.size() >= HeaderSize) {
+        size_t length = GetWord(conn.Buffer, 4);
+        if (GetWord(conn.Buffer, 2) != 0 || length < 2 || length > MaxPDUSize + 1) {
+            std::cerr << "TModbusTCPServer: bad MBAP header, dropping connection" << std::endl;
+            return false;
+        }
+        if (conn.Buffer.size() < HeaderSize - 1 + length)
+            break;
+
+        int unit_id = conn.Buffer[6];
+        std::vector<uint8_t> pdu(conn.Buffer.begin() + HeaderSize,
+                                 conn.Buffer.begin() + HeaderSize - 1 + length);
+        std::vector<uint8_t> response(conn.Buffer.begin(), conn.Buffer.begin() + HeaderSize);
+        conn.Buffer.erase(conn.Buffer.begin(), conn.Buffer.begin() + HeaderSize - 1 + length);
+
+        std::vector<uint8_t> response_pdu = HandleRequest(unit_id, pdu);
+        response[4] = (response_pdu.size() + 1) >> 8;
+        response[5] = (response_pdu.size() + 1) & 0xff;
+        conn.Output.insert(conn.Output.end(), response.begin(), response.end());
+        conn.Output.insert(conn.Output.end(), response_pdu.begin(), response_pdu.end());
+    }
+    return HandleOutput(conn);
+}
+
+// Sends as much of the pending output as the socket accepts.
+// Returns false if the connection must be closed
+bool TModbusTCPServer::HandleOutput(TConnection& conn)
+{
+    if (conn.Output.empty())
+        return true;
+    ssize_t n = send(conn.Fd, conn.Output.data(), conn.Output.size(), MSG_NOSIGNAL);
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR;
+    conn.Output.erase(conn.Output.begin(), conn.Output.begin() + n);
+    return true;
+}
+
+std::vector<uint8_t> TModbusTCPServer::HandleRequest(int unit_id, const std::vector<uint8_t>& pdu)
+{
+    std::vector<uint8_t> response;
+    if (pdu.empty())
+        return response;
+    uint8_t function = pdu[0];
+    try {
+        auto it = Units.find(unit_id);
+        if (it == Units.end())
+            throw TModbusSlaveException(TModbusSlaveException::GATEWAY_PATH_UNAVAILABLE,
+                                        "unknown unit id " + std::to_string(unit_id));
+        const TUnit& unit = it->second;
+
+        response.push_back(function);
+        switch (function) {
+        case READ_COILS:
+            ReadBits(unit, TModbusRegister::COIL, pdu, response);
+            break;
+        case READ_DISCRETE_INPUTS:
+            ReadBits(unit, TModbusRegister::DISCRETE_INPUT, pdu, response);
+            break;
+        case READ_HOLDING_REGISTERS:
+            ReadRegisters(unit, TModbusRegister::HOLDING_REGISTER, pdu, response);
+            break;
+        case READ_INPUT_REGISTERS:
+            ReadRegisters(unit, TModbusRegister::INPUT_REGISTER, pdu, response);
+            break;
+        case WRITE_SINGLE_COIL:
+            {
+                CheckSize(pdu, 5);
+                int value = GetWord(pdu, 3);
+                if (value != 0 && value != 0xff00)
+                    throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_VALUE,
+                                                "bad coil value");
+                uint16_t bit = value ? 1 : 0;
+                unit.Client->WriteCachedValues(unit.Slave, TModbusRegister::COIL,
+                                               GetWord(pdu, 1), 1, &bit);
+                response = pdu;
+            }
+            break;
+        case WRITE_SINGLE_REGISTER:
+            {
+                CheckSize(pdu, 5);
+                uint16_t value = GetWord(pdu, 3);
+                unit.Client->WriteCachedValues(unit.Slave, TModbusRegister::HOLDING_REGISTER,
+                                               GetWord(pdu, 1), 1, &value);
+                response = pdu;
+            }
+            break;
+        case WRITE_MULTIPLE_COILS:
+            {
+                CheckMinSize(pdu, 6);
+                int nb = GetWord(pdu, 3);
+                CheckCount(nb, MaxWriteBits);
+                CheckSize(pdu, 6 + (nb + 7) / 8);
+                std::vector<uint16_t> bits(nb);
+                for (int i = 0; i < nb; ++i)
+                    bits[i] = (pdu[6 + i / 8] >> (i % 8)) & 1;
+                unit.Client->WriteCachedValues(unit.Slave, TModbusRegister::COIL,
+                                               GetWord(pdu, 1), nb, bits.data());
+                response.assign(pdu.begin(), pdu.begin() + 5);
+            }
+            break;
+        case WRITE_MULTIPLE_REGISTERS:
+            {
+                CheckMinSize(pdu, 6);
+                int nb = GetWord(pdu, 3);
+                CheckCount(nb, MaxWriteRegisters);
+                CheckSize(pdu, 6 + nb * 2);
+                std::vector<uint16_t> values(nb);
+                for (int i = 0; i < nb; ++i)
+                    values[i] = GetWord(pdu, 6 + i * 2);
+                unit.Client->WriteCachedValues(unit.Slave, TModbusRegister::HOLDING_REGISTER,
+                                               GetWord(pdu, 1), nb, values.data());
+                response.assign(pdu.begin(), pdu.begin() + 5);
+            }
+            break;
+        default:
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_FUNCTION,
+                                        "unsupported function " + std::to_string(function));
+        }
+    } catch (const TModbusSlaveException& e) {
+        if (Debug)
+            std::cerr << "TModbusTCPServer: unit " << unit_id << ": " << e.what() << std::endl;
+        response = { uint8_t(function | 0x80), uint8_t(e.GetCode()) };
+    }
+    return response;
+}
+
+void TModbusTCPServer::ReadBits(const TUnit& unit, TModbusRegister::RegisterType type,
+                                const std::vector<uint8_t>& pdu, std::vector<uint8_t>& response)
+{
+    CheckSize(pdu, 5);
+    int nb = GetWord(pdu, 3);
+    CheckCount(nb, MaxReadBits);
+    std::vector<uint16_t> bits(nb);
+    unit.Client->ReadCachedValues(unit.Slave, type, GetWord(pdu, 1), nb, bits.data());
+    response.push_back((nb + 7) / 8);
+    response.resize(response.size() + (nb + 7) / 8);
+    for (int i = 0; i < nb; ++i) {
+        if (bits[i])
+            response[2 + i / 8] |= 1 << (i % 8);
+    }
+}
+
+void TModbusTCPServer::ReadRegisters(const TUnit& unit, TModbusRegister::RegisterType type,
+                                     const std::vector<uint8_t>& pdu, std::vector<uint8_t>& response)
+{
+    CheckSize(pdu, 5);
+    int nb = GetWord(pdu, 3);
+    CheckCount(nb, MaxReadRegisters);
+    std::vector<uint16_t> values(nb);
+    unit.Client->ReadCachedValues(unit.Slave, type, GetWord(pdu, 1), nb, values.data());
+    response.push_back(nb * 2);
+    for (auto value: values)
+        PutWord(response, value);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+// Modbus TCP server answering requests from the register cache
+// of the polled devices, so that other Modbus masters don't add
+// any load to the serial bus. Each unit id corresponds to a slave
+// on one of the ports. Writes are queued like writes coming from MQTT.
+class TModbusTCPServer
+{
+public:
+    TModbusTCPServer(const std::string& address, int port, bool debug = false);
+    TModbusTCPServer(const TModbusTCPServer&) = delete;
+    TModbusTCPServer& operator=(const TModbusTCPServer&) = delete;
+    ~TModbusTCPServer();
+    void AddUnit(int unit_id, PModbusClient client, int slave);
+    bool HasUnit(int unit_id) const;
+    void Start();
+    void Stop();
+    // Actual port the server listens on (useful when port 0 is specified)
+    int GetPort() const { return Port; }
+    // Processes a single request PDU for the unit and returns
+    // the response PDU (possibly an exception response)
+    std::vector<uint8_t> HandleRequest(int unit_id, const std::vector<uint8_t>& pdu);
+
+private:
+    struct TUnit
+    {
+        PModbusClient Client;
+        int Slave;
+    };
+
+    struct TConnection
+    {
+        int Fd;
+        std::vector<uint8_t> Buffer;
+        // responses not yet accepted by the socket
+        std::vector<uint8_t> Output;
+    };
+
+    void Run();
+    void Accept();
+    bool HandleInput(TConnection& conn);
+    bool HandleOutput(TConnection& conn);
+    void ReadBits(const TUnit& unit, TModbusRegister::RegisterType type,
+                  const std::vector<uint8_t>& pdu, std::vector<uint8_t>& response);
+    void ReadRegisters(const TUnit& unit, TModbusRegister::RegisterType type,
+                       const std::vector<uint8_t>& pdu, std::vector<uint8_t>& response);
+
+    std::string Address;
+    int Port;
+    bool Debug;
+    int ListenFd = -1;
+    int StopFd = -1;
+    std::map<int, TUnit> Units;
+    std::vector<TConnection> Connections;
+    std::thread Thread;
+};
+
+typedef std::shared_ptr<TModbusTCPServer> PModbusTCPServer;
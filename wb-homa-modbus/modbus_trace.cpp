@@ -0,0 +1,382 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string.h>
+#include <unistd.h>
+
+#include "modbus_trace.h"
+
+namespace {
+    const char Signature[] = { 'W', 'B', 'M', 'T' };
+    const uint8_t Version = 1;
+    // TModbusException prepends it to all messages
+    const std::string ErrorPrefix = "Modbus error: ";
+
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    void Put(std::ostream& out, uint32_t value, int size)
+    {
+        for (int i = 0; i < size; ++i)
+            out.put((value >> (i * 8)) & 0xff);
+    }
+
+    void PutBytes(std::ostream& out, const std::vector<uint8_t>& data)
+    {
+        Put(out, data.size(), 2);
+        out.write((const char*)data.data(), data.size());
+    }
+
+    uint32_t Get(std::istream& in, int size)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < size; ++i)
+            value |= uint32_t(uint8_t(in.get())) << (i * 8);
+        return value;
+    }
+
+    std::vector<uint8_t> GetBytes(std::istream& in)
+    {
+        std::vector<uint8_t> data(Get(in, 2));
+        in.read((char*)data.data(), data.size());
+        return data;
+    }
+
+    bool IsWrite(uint8_t function)
+    {
+        return function == WRITE_SINGLE_COIL || function == WRITE_SINGLE_REGISTER ||
+            function == WRITE_MULTIPLE_REGISTERS;
+    }
+
+    bool IsBits(uint8_t function)
+    {
+        return function == READ_COILS || function == READ_DISCRETE_INPUTS ||
+            function == WRITE_SINGLE_COIL;
+    }
+
+    // one byte per coil, big-endian words for registers
+    std::vector<uint8_t> ValuesToBytes(uint8_t function, int nb, const uint16_t* values)
+    {
+        std::vector<uint8_t> data;
+        for (int i = 0; i < nb; ++i) {
+            if (IsBits(function))
+                data.push_back(values[i] ? 1 : 0);
+            else {
+                data.push_back(values[i] >> 8);
+                data.push_back(values[i] & 0xff);
+            }
+        }
+        return data;
+    }
+
+    bool BytesToValues(uint8_t function, int nb, const std::vector<uint8_t>& data, uint16_t* values)
+    {
+        bool bits = IsBits(function);
+        if (data.size() != size_t(bits ? nb : nb * 2))
+            return false;
+        for (int i = 0; i < nb; ++i)
+            values[i] = bits ? data[i] : (data[i * 2] << 8) | data[i * 2 + 1];
+        return true;
+    }
+
+    TModbusTraceRecord MakeRecord(int function, int slave, int addr, int nb)
+    {
+        TModbusTraceRecord record;
+        record.Function = function;
+        record.Slave = slave;
+        record.Address = addr;
+        record.Count = nb;
+        return record;
+    }
+
+    uint32_t Microseconds(std::chrono::steady_clock::duration d)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+}
+
+bool TModbusTraceRecord::Matches(const TModbusTraceRecord& other) const
+{
+    return Function == other.Function && Slave == other.Slave &&
+        Address == other.Address && Count == other.Count &&
+        Request == other.Request;
+}
+
+std::string TModbusTraceRecord::ToString() const
+{
+    std::stringstream s;
+    s << "<slave " << (int)Slave << ", ";
+    if (Function == RAW_REQUEST)
+        s << "raw request";
+    else
+        s << "function " << (int)Function << " @ " << Address << " x " << Count;
+    if (!Request.empty()) {
+        s << ":" << std::hex << std::setfill('0');
+        for (auto b: Request)
+            s << " " << std::setw(2) << (int)b;
+    }
+    s << ">";
+    return s.str();
+}
+
+void WriteTraceHeader(std::ostream& out)
+{
+    out.write(Signature, sizeof(Signature));
+    out.put(Version);
+}
+
+void WriteTraceRecord(std::ostream& out, const TModbusTraceRecord& record)
+{
+    Put(out, record.Function, 1);
+    Put(out, record.Slave, 1);
+    Put(out, record.Address, 2);
+    Put(out, record.Count, 2);
+    Put(out, record.Delay, 4);
+    Put(out, record.Duration, 4);
+    Put(out, record.Status, 1);
+    Put(out, record.ExceptionCode, 1);
+    PutBytes(out, record.Request);
+    PutBytes(out, record.Response);
+}
+
+std::vector<TModbusTraceRecord> ReadTrace(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw TModbusException("can't open trace file " + path);
+
+    char signature[sizeof(Signature)];
+    in.read(signature, sizeof(signature));
+    if (!in || memcmp(signature, Signature, sizeof(Signature)))
+        throw TModbusException("not a trace file: " + path);
+    if (in.get() != Version)
+        throw TModbusException("unsupported trace version: " + path);
+
+    std::vector<TModbusTraceRecord> records;
+    while (in.peek() != EOF) {
+        TModbusTraceRecord record;
+        record.Function = Get(in, 1);
+        record.Slave = Get(in, 1);
+        record.Address = Get(in, 2);
+        record.Count = Get(in, 2);
+        record.Delay = Get(in, 4);
+        record.Duration = Get(in, 4);
+        record.Status = Get(in, 1);
+        record.ExceptionCode = Get(in, 1);
+        record.Request = GetBytes(in);
+        record.Response = GetBytes(in);
+        // the recorder may have been killed in the middle of a record
+        if (!in) {
+            std::cerr << "warning: truncated trace file " << path << std::endl;
+            break;
+        }
+        records.push_back(record);
+    }
+    return records;
+}
+
+TModbusRecordingContext::TModbusRecordingContext(PModbusContext context, const std::string& path)
+    : Context(context), Out(path, std::ios::binary | std::ios::trunc),
+      LastStart(std::chrono::steady_clock::now())
+{
+    if (!Out)
+        throw TModbusException("can't create trace file " + path);
+    WriteTraceHeader(Out);
+    Out.flush();
+}
+
+void TModbusRecordingContext::Write(TModbusTraceRecord& record,
+                                    std::chrono::steady_clock::time_point start)
+{
+    record.Delay = Microseconds(start - LastStart);
+    record.Duration = Microseconds(std::chrono::steady_clock::now() - start);
+    LastStart = start;
+    // flush every record so that the trace survives a crash
+    WriteTraceRecord(Out, record);
+    Out.flush();
+}
+
+void TModbusRecordingContext::Connect()
+{
+    Context->Connect();
+}
+
+void TModbusRecordingContext::Disconnect()
+{
+    Context->Disconnect();
+}
+
+void TModbusRecordingContext::SetDebug(bool debug)
+{
+    Context->SetDebug(debug);
+}
+
+void TModbusRecordingContext::SetSlave(int slave)
+{
+    Slave = slave;
+    Context->SetSlave(slave);
+}
+
+void TModbusRecordingContext::USleep(int usec)
+{
+    Context->USleep(usec);
+}
+
+void TModbusRecordingContext::Interrupt()
+{
+    Context->Interrupt();
+}
+
+TModbusContext::TStatus TModbusRecordingContext::Execute(uint8_t function, int addr, int nb,
+                                                         uint16_t* data, int& exception_code)
+{
+    TModbusTraceRecord record = MakeRecord(function, Slave, addr, nb);
+    if (IsWrite(function))
+        record.Request = ValuesToBytes(function, nb, data);
+    auto start = std::chrono::steady_clock::now();
+    TStatus status = Context->Execute(function, addr, nb, data, exception_code);
+    record.Status = status;
+    if (status == SLAVE_EXCEPTION)
+        record.ExceptionCode = exception_code;
+    else if (status == OK && !IsWrite(function))
+        record.Response = ValuesToBytes(function, nb, data);
+    Write(record, start);
+    return status;
+}
+
+TModbusTimingStats TModbusRecordingContext::GetTimingStats() const
+{
+    return Context->GetTimingStats();
+}
+
+std::vector<uint8_t> TModbusRecordingContext::RawRequest(const std::vector<uint8_t>& pdu)
+{
+    TModbusTraceRecord record = MakeRecord(TModbusTraceRecord::RAW_REQUEST, Slave, 0, 0);
+    record.Request = pdu;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        record.Response = Context->RawRequest(pdu);
+    } catch (const TModbusException& e) {
+        const TModbusSlaveException* slave_exception = dynamic_cast<const TModbusSlaveException*>(&e);
+        record.Status = slave_exception ? SLAVE_EXCEPTION : IO_ERROR;
+        record.ExceptionCode = slave_exception ? slave_exception->GetCode() : 0;
+        std::string message = e.what();
+        if (!message.compare(0, ErrorPrefix.size(), ErrorPrefix))
+            message.erase(0, ErrorPrefix.size());
+        record.Response.assign(message.begin(), message.end());
+        Write(record, start);
+        throw;
+    }
+    Write(record, start);
+    return record.Response;
+}
+
+TModbusReplayContext::TModbusReplayContext(const std::string& path, double time_scale)
+    : Records(ReadTrace(path)), TimeScale(time_scale) {}
+
+const TModbusTraceRecord* TModbusReplayContext::Replay(const TModbusTraceRecord& request,
+                                                       std::string& error)
+{
+    if (Position >= Records.size()) {
+        error = "end of trace reached at " + request.ToString();
+        return nullptr;
+    }
+
+    const TModbusTraceRecord& record = Records[Position];
+    if (!record.Matches(request)) {
+        ++MismatchCount;
+        error = "trace mismatch: expected " + record.ToString() + ", got " + request.ToString();
+        return nullptr;
+    }
+    ++Position;
+    if (Debug)
+        std::cerr << "replay: " << record.ToString() << std::endl;
+    if (TimeScale > 0 && record.Duration)
+        usleep(record.Duration * TimeScale);
+    return &record;
+}
+
+void TModbusReplayContext::Connect() {}
+
+void TModbusReplayContext::Disconnect() {}
+
+void TModbusReplayContext::SetDebug(bool debug)
+{
+    Debug = debug;
+}
+
+void TModbusReplayContext::SetSlave(int slave)
+{
+    Slave = slave;
+}
+
+void TModbusReplayContext::USleep(int usec)
+{
+    if (TimeScale > 0)
+        usleep(usec * TimeScale);
+}
+
+TModbusContext::TStatus TModbusReplayContext::Execute(uint8_t function, int addr, int nb,
+                                                      uint16_t* data, int& exception_code)
+{
+    TModbusTraceRecord request = MakeRecord(function, Slave, addr, nb);
+    if (IsWrite(function))
+        request.Request = ValuesToBytes(function, nb, data);
+    std::string error;
+    const TModbusTraceRecord* record = Replay(request, error);
+    if (!record) {
+        std::cerr << "TModbusReplayContext: warning: " << error << std::endl;
+        return IO_ERROR;
+    }
+
+    if (record->Status == SLAVE_EXCEPTION)
+        exception_code = record->ExceptionCode;
+    if (record->Status != OK || IsWrite(function))
+        return TStatus(record->Status);
+    if (!BytesToValues(function, nb, record->Response, data)) {
+        std::cerr << "TModbusReplayContext: warning: bad response size in trace record "
+                  << record->ToString() << std::endl;
+        return BAD_RESPONSE;
+    }
+    return OK;
+}
+
+std::vector<uint8_t> TModbusReplayContext::RawRequest(const std::vector<uint8_t>& pdu)
+{
+    TModbusTraceRecord request = MakeRecord(TModbusTraceRecord::RAW_REQUEST, Slave, 0, 0);
+    request.Request = pdu;
+    std::string error;
+    const TModbusTraceRecord* record = Replay(request, error);
+    if (!record)
+        throw TModbusException(error);
+
+    std::string message(record->Response.begin(), record->Response.end());
+    if (record->Status == SLAVE_EXCEPTION)
+        throw TModbusSlaveException(record->ExceptionCode, message);
+    if (record->Status != OK)
+        throw TModbusException(message);
+    return record->Response;
+}
+
+TModbusRecordingConnector::TModbusRecordingConnector(PModbusConnector connector, const std::string& path)
+    : Connector(connector), Path(path) {}
+
+PModbusContext TModbusRecordingConnector::CreateContext(const TModbusConnectionSettings& settings)
+{
+    return PModbusContext(new TModbusRecordingContext(Connector->CreateContext(settings), Path));
+}
+
+TModbusReplayConnector::TModbusReplayConnector(const std::string& path, double time_scale)
+    : Path(path), TimeScale(time_scale) {}
+
+PModbusContext TModbusReplayConnector::CreateContext(const TModbusConnectionSettings&)
+{
+    return PModbusContext(new TModbusReplayContext(Path, TimeScale));
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+// Bus traffic traces. A trace is a binary file that starts with
+// the "WBMT" signature and a version byte followed by one record
+// per transaction. All multibyte fields are little-endian.
+struct TModbusTraceRecord
+{
+    // Modbus function code of the transaction or RAW_REQUEST
+    static const uint8_t RAW_REQUEST = 0;
+
+    uint8_t Function = RAW_REQUEST;
+    uint8_t Slave = 0;
+    uint16_t Address = 0;
+    uint16_t Count = 0;
+    // microseconds since the start of the previous transaction
+    // (the start of the trace for the first one)
+    uint32_t Delay = 0;
+    // microseconds the transaction took
+    uint32_t Duration = 0;
+    // TModbusContext::TStatus
+    uint8_t Status = TModbusContext::OK;
+    uint8_t ExceptionCode = 0;
+    // written data (one byte per coil, big-endian words for
+    // registers) or the request PDU for raw requests
+    std::vector<uint8_t> Request;
+    // data read, the response PDU for raw requests
+    // or the error message of a failed raw request
+    std::vector<uint8_t> Response;
+
+    bool Matches(const TModbusTraceRecord& other) const;
+    std::string ToString() const;
+};
+
+void WriteTraceHeader(std::ostream& out);
+void WriteTraceRecord(std::ostream& out, const TModbusTraceRecord& record);
+// Throws TModbusException if the trace is bad
+std::vector<TModbusTraceRecord> ReadTrace(const std::string& path);
+
+// Passes all requests to another context and records them to a trace.
+class TModbusRecordingContext: public TModbusStatusContext
+{
+public:
+    TModbusRecordingContext(PModbusContext context, const std::string& path);
+    void Connect();
+    void Disconnect();
+    void SetDebug(bool debug);
+    void SetSlave(int slave);
+    void USleep(int usec);
+    void Interrupt();
+    std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
+    TModbusTimingStats GetTimingStats() const;
+
+private:
+    void Write(TModbusTraceRecord& record, std::chrono::steady_clock::time_point start);
+
+    PModbusContext Context;
+    std::ofstream Out;
+    int Slave = 0;
+    std::chrono::steady_clock::time_point LastStart;
+};
+
+// Serves the requests from a trace. The requests must come
+// in the recorded order, a request that doesn't match the next
+// record fails with IO_ERROR (TModbusException for raw requests)
+// and doesn't consume it.
+// Transactions take their recorded time multiplied by time_scale,
+// 0 means no delays at all (including USleep()).
+class TModbusReplayContext: public TModbusStatusContext
+{
+public:
+    TModbusReplayContext(const std::string& path, double time_scale = 1);
+    void Connect();
+    void Disconnect();
+    void SetDebug(bool debug);
+    void SetSlave(int slave);
+    void USleep(int usec);
+    std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
+
+    // number of records not replayed yet
+    int Remaining() const { return Records.size() - Position; }
+    int Mismatches() const { return MismatchCount; }
+
+private:
+    // returns nullptr and explains why on error
+    const TModbusTraceRecord* Replay(const TModbusTraceRecord& request, std::string& error);
+
+    std::vector<TModbusTraceRecord> Records;
+    size_t Position = 0;
+    double TimeScale;
+    bool Debug = false;
+    int Slave = 0;
+    int MismatchCount = 0;
+};
+
+class TModbusRecordingConnector: public TModbusConnector
+{
+public:
+    TModbusRecordingConnector(PModbusConnector connector, const std::string& path);
+    PModbusContext CreateContext(const TModbusConnectionSettings& settings);
+
+private:
+    PModbusConnector Connector;
+    std::string Path;
+};
+
+class TModbusReplayConnector: public TModbusConnector
+{
+public:
+    TModbusReplayConnector(const std::string& path, double time_scale = 1);
+    PModbusContext CreateContext(const TModbusConnectionSettings& settings);
+
+private:
+    std::string Path;
+    double TimeScale;
+};
@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+#include "smartbus.h"
+
+namespace {
+    enum {
+        SINGLE_CHANNEL_CONTROL = 0x0031,
+        SINGLE_CHANNEL_CONTROL_RESPONSE = 0x0032,
+        READ_STATUS = 0x0033,
+        READ_STATUS_RESPONSE = 0x0034
+    };
+
+    enum {
+        CONTROL_SUCCESS = 0xf8
+    };
+
+    // length, addresses, device type and opcode
+    const int HeaderSize = 9;
+    const int MaxFrameSize = 2 + 255;
+
+    speed_t GetSpeed(int baud_rate)
+    {
+        switch (baud_rate) {
+        case 110: return B110;
+        case 300: return B300;
+        case 600: return B600;
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default:
+            throw TSmartBusException("unsupported baud rate: " + std::to_string(baud_rate));
+        }
+    }
+}
+
+const int TSmartBus::DefaultTimeoutMs;
+const uint8_t TSmartBus::SourceSubnet;
+const uint8_t TSmartBus::SourceDevice;
+const uint16_t TSmartBus::SourceDeviceType;
+
+TSmartBus::TSmartBus(const TModbusConnectionSettings& settings, int timeout_ms)
+    : Settings(settings), TimeoutMs(timeout_ms) {}
+
+TSmartBus::~TSmartBus()
+{
+    if (Fd >= 0)
+        close(Fd);
+}
+
+void TSmartBus::Open()
+{
+    if (Fd >= 0)
+        throw TSmartBusException("port already open");
+
+    Fd = open(Settings.Device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (Fd < 0)
+        throw TSmartBusException("cannot open serial port " + Settings.Device + ": " + strerror(errno));
+    try {
+        SerialPortSetup();
+        SetupSerialOptions(Fd, Settings);
+    } catch (const std::exception& e) {
+        close(Fd);
+        Fd = -1;
+        throw TSmartBusException(e.what());
+    }
+}
+
+void TSmartBus::Close()
+{
+    EnsurePortOpen();
+    close(Fd);
+    Fd = -1;
+}
+
+bool TSmartBus::IsOpen() const
+{
+    return Fd >= 0;
+}
+
+void TSmartBus::SetDebug(bool debug)
+{
+    Debug = debug;
+}
+
+void TSmartBus::SerialPortSetup()
+{
+    struct termios options;
+    memset(&options, 0, sizeof(options));
+
+    speed_t speed = GetSpeed(Settings.BaudRate);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+
+    options.c_cflag |= CREAD | CLOCAL;
+    switch (Settings.DataBits) {
+    case 7: options.c_cflag |= CS7; break;
+    default: options.c_cflag |= CS8; break;
+    }
+    if (Settings.StopBits == 2)
+        options.c_cflag |= CSTOPB;
+    if (Settings.Parity == 'E')
+        options.c_cflag |= PARENB;
+    else if (Settings.Parity == 'O')
+        options.c_cflag |= PARENB | PARODD;
+
+    options.c_iflag = Settings.Parity == 'N' ? 0 : INPCK;
+    options.c_oflag = 0;
+    options.c_lflag = 0;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+    if (tcsetattr(Fd, TCSANOW, &options) < 0)
+        throw TSmartBusException("failed to set serial port parameters");
+    tcflush(Fd, TCIOFLUSH);
+}
+
+void TSmartBus::EnsurePortOpen()
+{
+    if (Fd < 0)
+        throw TSmartBusException("port not open");
+}
+
+void TSmartBus::WriteFrame(uint16_t opcode, uint8_t subnet, uint8_t device,
+                           const std::vector<uint8_t>& content)
+{
+    EnsurePortOpen();
+    std::vector<uint8_t> frame = {
+        0xaa, 0xaa, uint8_t(HeaderSize + content.size() + 2),
+        SourceSubnet, SourceDevice,
+        uint8_t(SourceDeviceType >> 8), uint8_t(SourceDeviceType & 0xff),
+        uint8_t(opcode >> 8), uint8_t(opcode & 0xff),
+        subnet, device
+    };
+    frame.insert(frame.end(), content.begin(), content.end());
+    uint16_t crc = CRC16(&frame[2], frame.size() - 2);
+    frame.push_back(crc >> 8);
+    frame.push_back(crc & 0xff);
+
+    if (Debug)
+        DumpFrame("-> ", frame);
+    // drop the traffic of other masters that came before the request
+    tcflush(Fd, TCIFLUSH);
+    if (write(Fd, frame.data(), frame.size()) < ssize_t(frame.size()))
+        throw TSmartBusException("failed to write frame");
+}
+
+bool TSmartBus::ReadBytes(uint8_t* buf, size_t n, int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (n) {
+        int left_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left_us <= 0)
+            return false;
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(Fd, &rfds);
+        struct timeval tv;
+        tv.tv_sec = left_us / 1000000;
+        tv.tv_usec = left_us % 1000000;
+        int r = select(Fd + 1, &rfds, NULL, NULL, &tv);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            throw TSmartBusException("select() failed");
+        }
+        if (!r)
+            return false;
+
+        ssize_t count = read(Fd, buf, n);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            throw TSmartBusException("read() failed");
+        }
+        buf += count;
+        n -= count;
+    }
+    return true;
+}
+
+std::vector<uint8_t> TSmartBus::ReadResponse(uint16_t opcode, uint8_t subnet, uint8_t device)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TimeoutMs);
+    auto left_ms = [deadline]() {
+        return int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now()).count());
+    };
+
+    for (;;) {
+        // look for the start of the frame
+        uint8_t b = 0, prev;
+        do {
+            prev = b;
+            if (!ReadBytes(&b, 1, left_ms()))
+                throw TSmartBusTimeoutException("timeout");
+        } while (prev != 0xaa || b != 0xaa);
+
+        std::vector<uint8_t> frame(MaxFrameSize);
+        frame[0] = frame[1] = 0xaa;
+        if (!ReadBytes(&frame[2], 1, left_ms()))
+            throw TSmartBusTimeoutException("timeout");
+        size_t len = frame[2];
+        if (len < HeaderSize + 2) {
+            std::cerr << "smartbus: warning: bad frame length " << len << std::endl;
+            continue;
+        }
+        if (!ReadBytes(&frame[3], len - 1, left_ms()))
+            throw TSmartBusTimeoutException("timeout");
+        frame.resize(2 + len);
+        if (Debug)
+            DumpFrame("<- ", frame);
+
+        uint16_t crc = (frame[len] << 8) | frame[len + 1];
+        if (CRC16(&frame[2], len - 2) != crc) {
+            std::cerr << "smartbus: warning: CRC error" << std::endl;
+            continue;
+        }
+
+        // the frames of other devices and masters
+        uint16_t frame_opcode = (frame[7] << 8) | frame[8];
+        if (frame[3] != subnet || frame[4] != device || frame_opcode != opcode)
+            continue;
+        return std::vector<uint8_t>(frame.begin() + 2 + HeaderSize, frame.begin() + len);
+    }
+}
+
+std::vector<uint8_t> TSmartBus::ReadStatus(uint8_t subnet, uint8_t device)
+{
+    WriteFrame(READ_STATUS, subnet, device, {});
+    std::vector<uint8_t> content = ReadResponse(READ_STATUS_RESPONSE, subnet, device);
+    // channel count followed by the levels
+    if (content.empty() || content.size() < size_t(content[0]) + 1)
+        throw TSmartBusTransientErrorException("bad status response");
+    return std::vector<uint8_t>(content.begin() + 1, content.begin() + 1 + content[0]);
+}
+
+std::vector<uint8_t> TSmartBus::SetChannel(uint8_t subnet, uint8_t device, uint8_t channel, uint8_t level)
+{
+    // zero running time
+    WriteFrame(SINGLE_CHANNEL_CONTROL, subnet, device, { channel, level, 0, 0 });
+    std::vector<uint8_t> content = ReadResponse(SINGLE_CHANNEL_CONTROL_RESPONSE, subnet, device);
+    // channel, result, channel count, levels
+    if (content.size() < 3 || content[0] != channel)
+        throw TSmartBusTransientErrorException("bad channel control response");
+    if (content[1] != CONTROL_SUCCESS)
+        throw TSmartBusTransientErrorException("channel control failed");
+    if (content.size() < size_t(content[2]) + 3)
+        throw TSmartBusTransientErrorException("bad channel control response");
+    return std::vector<uint8_t>(content.begin() + 3, content.begin() + 3 + content[2]);
+}
+
+uint16_t TSmartBus::CRC16(const uint8_t* data, size_t len)
+{
+    // CRC-CCITT (XModem), polynomial 0x1021, zero initial value
+    static const std::array<uint16_t, 256> table = []() {
+        std::array<uint16_t, 256> t;
+        for (int i = 0; i < 256; ++i) {
+            uint16_t crc = i << 8;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            t[i] = crc;
+        }
+        return t;
+    }();
+
+    uint16_t crc = 0;
+    while (len--)
+        crc = (crc << 8) ^ table[(crc >> 8) ^ *data++];
+    return crc;
+}
+
+void TSmartBus::DumpFrame(const char* prefix, const std::vector<uint8_t>& frame) const
+{
+    std::cerr << "smartbus: " << prefix << std::hex << std::setfill('0');
+    for (auto b: frame)
+        std::cerr << std::setw(2) << static_cast<int>(b) << " ";
+    std::cerr << std::dec << std::endl;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <exception>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+class TSmartBusException: public std::exception {
+public:
+    TSmartBusException(std::string message): Message("SmartBus error: " + message) {}
+    const char* what () const throw ()
+    {
+        return Message.c_str();
+    }
+
+private:
+    std::string Message;
+};
+
+class TSmartBusTransientErrorException: public TSmartBusException {
+public:
+    TSmartBusTransientErrorException(std::string message): TSmartBusException(message) {}
+};
+
+class TSmartBusTimeoutException: public TSmartBusTransientErrorException {
+public:
+    TSmartBusTimeoutException(std::string message): TSmartBusTransientErrorException(message) {}
+};
+
+// SmartBus (HDL Buspro) frames: 0xAA 0xAA, length, source subnet,
+// source device, source device type (2 bytes), opcode (2 bytes),
+// target subnet, target device, content, CRC16 (CCITT, big-endian).
+// The length counts the bytes from itself to the CRC inclusive.
+// Devices are addressed by subnet and device id. The bus is shared
+// by several masters, so frames not meant for us are skipped.
+class TSmartBus {
+public:
+    static const int DefaultTimeoutMs = 1000;
+    // our own address on the bus
+    static const uint8_t SourceSubnet = 0x01;
+    static const uint8_t SourceDevice = 0x14;
+    static const uint16_t SourceDeviceType = 0x0095;
+
+    TSmartBus(const TModbusConnectionSettings& settings, int timeout_ms = DefaultTimeoutMs);
+    ~TSmartBus();
+    void Open();
+    void Close();
+    bool IsOpen() const;
+    void SetDebug(bool debug);
+    // Channel levels (0-100) of the device, channel 1 goes first
+    std::vector<uint8_t> ReadStatus(uint8_t subnet, uint8_t device);
+    // Returns the channel levels reported by the device
+    std::vector<uint8_t> SetChannel(uint8_t subnet, uint8_t device, uint8_t channel, uint8_t level);
+
+    static uint16_t CRC16(const uint8_t* data, size_t len);
+
+private:
+    void EnsurePortOpen();
+    void SerialPortSetup();
+    void WriteFrame(uint16_t opcode, uint8_t subnet, uint8_t device,
+                    const std::vector<uint8_t>& content);
+    // returns the content of the response
+    std::vector<uint8_t> ReadResponse(uint16_t opcode, uint8_t subnet, uint8_t device);
+    // false on timeout
+    bool ReadBytes(uint8_t* buf, size_t n, int timeout_ms);
+    void DumpFrame(const char* prefix, const std::vector<uint8_t>& frame) const;
+
+    TModbusConnectionSettings Settings;
+    int TimeoutMs;
+    int Fd = -1;
+    bool Debug = false;
+};
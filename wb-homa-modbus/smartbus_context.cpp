@@ -0,0 +1,168 @@
+#include <unistd.h>
+#include <iostream>
+
+#include "smartbus_context.h"
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    const int MaxChannel = 0xff;
+    const uint8_t MaxLevel = 100;
+}
+
+TSmartBusModbusContext::TSmartBusModbusContext(const TModbusConnectionSettings& settings,
+                                               int timeout_ms, bool read_status):
+    Bus(settings, timeout_ms), ReadStatus(read_status) {}
+
+void TSmartBusModbusContext::Connect()
+{
+    try {
+        if (!Bus.IsOpen())
+            Bus.Open();
+    } catch (const TSmartBusException& e) {
+        throw TModbusException(e.what());
+    }
+}
+
+void TSmartBusModbusContext::Disconnect()
+{
+    if (Bus.IsOpen())
+        Bus.Close();
+    // the devices may change their state while we're away
+    Status.clear();
+}
+
+void TSmartBusModbusContext::SetDebug(bool debug)
+{
+    Bus.SetDebug(debug);
+}
+
+void TSmartBusModbusContext::SetSlave(int slave_addr)
+{
+    SlaveAddr = slave_addr;
+}
+
+bool TSmartBusModbusContext::CheckChannels(int addr, int nb) const
+{
+    return addr >= 1 && addr + nb - 1 <= MaxChannel;
+}
+
+bool TSmartBusModbusContext::ReadLevels(int addr, int nb, std::vector<uint8_t>& levels)
+{
+    if (!CheckChannels(addr, nb))
+        return false;
+    TDeviceStatus& status = Status[SlaveAddr];
+    if (ReadStatus) {
+        bool refresh = !status.Valid;
+        for (int i = addr; i < addr + nb && !refresh; ++i)
+            refresh = status.Served.count(i);
+        if (refresh) {
+            if (!Bus.IsOpen())
+                Bus.Open();
+            status.Levels = Bus.ReadStatus(SlaveAddr >> 8, SlaveAddr & 0xff);
+            status.Served.clear();
+            status.Valid = true;
+        }
+        if (addr + nb - 1 > int(status.Levels.size()))
+            return false;
+        for (int i = addr; i < addr + nb; ++i)
+            status.Served.insert(i);
+    } else if (addr + nb - 1 > int(status.Levels.size()))
+        status.Levels.resize(addr + nb - 1);
+
+    levels.assign(status.Levels.begin() + addr - 1, status.Levels.begin() + addr + nb - 1);
+    return true;
+}
+
+void TSmartBusModbusContext::SetLevel(int addr, uint8_t level)
+{
+    if (!Bus.IsOpen())
+        Bus.Open();
+    std::vector<uint8_t> levels = Bus.SetChannel(SlaveAddr >> 8, SlaveAddr & 0xff, addr, level);
+
+    // the response carries the levels of all the channels
+    TDeviceStatus& status = Status[SlaveAddr];
+    if (int(levels.size()) >= addr)
+        status.Levels = levels;
+    else {
+        if (int(status.Levels.size()) < addr)
+            status.Levels.resize(addr);
+        status.Levels[addr - 1] = level;
+    }
+}
+
+TModbusContext::TStatus TSmartBusModbusContext::Execute(uint8_t function, int addr, int nb,
+                                                        uint16_t* data, int& exception_code)
+{
+    try {
+        switch (function) {
+        case READ_COILS:
+        case READ_HOLDING_REGISTERS:
+            {
+                std::vector<uint8_t> levels;
+                if (!ReadLevels(addr, nb, levels)) {
+                    exception_code = TModbusSlaveException::ILLEGAL_DATA_ADDRESS;
+                    return SLAVE_EXCEPTION;
+                }
+                for (int i = 0; i < nb; ++i)
+                    data[i] = function == READ_COILS ? (levels[i] ? 1 : 0) : levels[i];
+            }
+            break;
+        case WRITE_SINGLE_COIL:
+        case WRITE_SINGLE_REGISTER:
+        case WRITE_MULTIPLE_REGISTERS:
+            if (!CheckChannels(addr, nb)) {
+                exception_code = TModbusSlaveException::ILLEGAL_DATA_ADDRESS;
+                return SLAVE_EXCEPTION;
+            }
+            for (int i = 0; i < nb; ++i) {
+                uint16_t level = function == WRITE_SINGLE_COIL ? (data[i] ? MaxLevel : 0) : data[i];
+                if (level > MaxLevel) {
+                    exception_code = TModbusSlaveException::ILLEGAL_DATA_VALUE;
+                    return SLAVE_EXCEPTION;
+                }
+                SetLevel(addr + i, level);
+            }
+            break;
+        case READ_DISCRETE_INPUTS:
+        case READ_INPUT_REGISTERS:
+            // SmartBus devices have neither
+            exception_code = TModbusSlaveException::ILLEGAL_DATA_ADDRESS;
+            return SLAVE_EXCEPTION;
+        default:
+            exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+            return SLAVE_EXCEPTION;
+        }
+    } catch (const TSmartBusTimeoutException&) {
+        return TIMEOUT;
+    } catch (const TSmartBusTransientErrorException&) {
+        return BAD_RESPONSE;
+    } catch (const TSmartBusException& e) {
+        std::cerr << "TSmartBusModbusContext: " << e.what() << std::endl;
+        Disconnect();
+        return IO_ERROR;
+    }
+    return OK;
+}
+
+void TSmartBusModbusContext::USleep(int usec)
+{
+    usleep(usec);
+}
+
+TSmartBusModbusConnector::TSmartBusModbusConnector(bool read_status):
+    ReadStatus(read_status) {}
+
+PModbusContext TSmartBusModbusConnector::CreateContext(const TModbusConnectionSettings& settings)
+{
+    int timeout = settings.ResponseTimeoutMs ? settings.ResponseTimeoutMs : TSmartBus::DefaultTimeoutMs;
+    return PModbusContext(new TSmartBusModbusContext(settings, timeout, ReadStatus));
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <map>
+#include <set>
+
+#include "smartbus.h"
+#include "modbus_client.h"
+
+// Slave ids are (subnet << 8) | device id. Coils are relay channels
+// (on/off), holding registers are channel levels (0-100), both starting
+// at channel 1. The levels of all the channels of a device are fetched
+// by a single status request, which is repeated only when a channel is
+// read again, i.e. once per polling cycle. Devices that don't answer
+// status requests can be used with read_status = false, then the reads
+// return the last written values. Channels the device doesn't have
+// are reported as ILLEGAL DATA ADDRESS, timeouts and bad responses
+// as TIMEOUT and BAD_RESPONSE, so they don't count as port failures.
+class TSmartBusModbusContext: public TModbusStatusContext
+{
+public:
+    TSmartBusModbusContext(const TModbusConnectionSettings& settings, int timeout_ms,
+                           bool read_status);
+    void Connect();
+    void Disconnect();
+    void SetDebug(bool debug);
+    void SetSlave(int slave_addr);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
+    void USleep(int usec);
+
+private:
+    struct TDeviceStatus {
+        std::vector<uint8_t> Levels;
+        // channels read since the last status request
+        std::set<int> Served;
+        bool Valid = false;
+    };
+
+    // return false if the device has no such channels
+    bool ReadLevels(int addr, int nb, std::vector<uint8_t>& levels);
+    void SetLevel(int addr, uint8_t level);
+    bool CheckChannels(int addr, int nb) const;
+
+    TSmartBus Bus;
+    bool ReadStatus;
+    int SlaveAddr = 0;
+    std::map<int, TDeviceStatus> Status;
+};
+
+class TSmartBusModbusConnector: public TModbusConnector
+{
+public:
+    TSmartBusModbusConnector(bool read_status = true);
+    PModbusContext CreateContext(const TModbusConnectionSettings& settings);
+
+private:
+    bool ReadStatus;
+};
@@ -1,4 +1,5 @@
 #include "fake_modbus.h"
+#include <iomanip>
 
 void TFakeModbusContext::USleep(int usec)
 {
@@ -32,9 +33,19 @@ void TFakeModbusContext::Connect()
 {
     Fixture.Emit() << "Connect()";
     ASSERT_FALSE(Connected);
+    if (Unplugged)
+        throw TModbusException("cannot open serial port");
     Connected = true;
 }
 
+void TFakeModbusContext::CheckPlugged()
+{
+    if (Unplugged) {
+        Fixture.Emit() << "I/O error";
+        throw TModbusException("I/O error");
+    }
+}
+
 void TFakeModbusContext::Disconnect()
 {
     Fixture.Emit() << "Disconnect()";
@@ -56,6 +67,7 @@ void TFakeModbusContext::SetSlave(int slave)
 
 void TFakeModbusContext::ReadCoils(int addr, int nb, uint8_t *dest)
 {
+    CheckPlugged();
     ASSERT_LE(nb, MODBUS_MAX_READ_BITS);
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Coils.ReadRegs(Fixture, addr, nb, dest);
@@ -63,6 +75,7 @@ void TFakeModbusContext::ReadCoils(int addr, int nb, uint8_t *dest)
 
 void TFakeModbusContext::WriteCoil(int addr, int value)
 {
+    CheckPlugged();
     ASSERT_TRUE(!!CurrentSlave);
     ASSERT_TRUE(value == 0 || value == 1);
     CurrentSlave->Coils[addr] = value;
@@ -70,6 +83,7 @@ void TFakeModbusContext::WriteCoil(int addr, int value)
 
 void TFakeModbusContext::ReadDisceteInputs(int addr, int nb, uint8_t *dest)
 {
+    CheckPlugged();
     ASSERT_LE(nb, MODBUS_MAX_READ_BITS);
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Discrete.ReadRegs(Fixture, addr, nb, dest);
@@ -77,6 +91,7 @@ void TFakeModbusContext::ReadDisceteInputs(int addr, int nb, uint8_t *dest)
 
 void TFakeModbusContext::ReadHoldingRegisters(int addr, int nb, uint16_t *dest)
 {
+    CheckPlugged();
     ASSERT_LE(nb, MODBUS_MAX_READ_REGISTERS);
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Holding.ReadRegs(Fixture, addr, nb, dest);
@@ -84,6 +99,7 @@ void TFakeModbusContext::ReadHoldingRegisters(int addr, int nb, uint16_t *dest)
 
 void TFakeModbusContext::WriteHoldingRegisters(int addr, int nb, const uint16_t *data)
 {
+    CheckPlugged();
     ASSERT_LE(nb, MODBUS_MAX_READ_REGISTERS);
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Holding.WriteRegs(Fixture, addr, nb, data);
@@ -91,17 +107,70 @@ void TFakeModbusContext::WriteHoldingRegisters(int addr, int nb, const uint16_t
 
 void TFakeModbusContext::WriteHoldingRegister(int addr, uint16_t value)
 {
+    CheckPlugged();
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Holding.WriteRegs(Fixture, addr, 1, &value);
 }
 
 void TFakeModbusContext::ReadInputRegisters(int addr, int nb, uint16_t *dest)
 {
+    CheckPlugged();
     ASSERT_LE(nb, MODBUS_MAX_READ_REGISTERS);
     ASSERT_TRUE(!!CurrentSlave);
     CurrentSlave->Input.ReadRegs(Fixture, addr, nb, dest);
 }
 
+std::vector<uint8_t> TFakeModbusContext::RawRequest(const std::vector<uint8_t>& pdu)
+{
+    std::stringstream s;
+    s << "raw request:" << std::hex << std::setfill('0');
+    for (auto b: pdu)
+        s << " " << std::setw(2) << (int)b;
+    Fixture.Emit() << s.str();
+
+    EXPECT_TRUE(!!CurrentSlave);
+    if (!CurrentSlave || pdu.empty())
+        throw TModbusException("raw request failed");
+
+    // only register reads and writes are emulated here, other
+    // functions are rejected with ILLEGAL FUNCTION exception
+    int addr = pdu.size() >= 5 ? (pdu[1] << 8) | pdu[2] : 0;
+    int nb = pdu.size() >= 5 ? (pdu[3] << 8) | pdu[4] : 0;
+    std::vector<uint8_t> response = { pdu[0] };
+    try {
+        switch (pdu.size() >= 5 ? pdu[0] : 0) {
+        case 0x03:
+        case 0x04:
+            response.push_back(nb * 2);
+            for (int i = 0; i < nb; ++i) {
+                uint16_t v = pdu[0] == 0x03 ? CurrentSlave->Holding[addr + i] :
+                    CurrentSlave->Input[addr + i];
+                response.push_back(v >> 8);
+                response.push_back(v & 0xff);
+            }
+            break;
+        case 0x06: {
+            uint16_t v = nb;
+            CurrentSlave->Holding.WriteRegs(Fixture, addr, 1, &v);
+            response.insert(response.end(), pdu.begin() + 1, pdu.end());
+            break;
+        }
+        case 0x10:
+            for (int i = 0; i < nb; ++i) {
+                uint16_t v = (pdu[6 + i * 2] << 8) | pdu[7 + i * 2];
+                CurrentSlave->Holding.WriteRegs(Fixture, addr + i, 1, &v);
+            }
+            response.insert(response.end(), pdu.begin() + 1, pdu.begin() + 5);
+            break;
+        default:
+            return { (uint8_t)(pdu[0] | 0x80), TModbusSlaveException::ILLEGAL_FUNCTION };
+        }
+    } catch (const TModbusSlaveException& e) {
+        return { (uint8_t)(pdu[0] | 0x80), (uint8_t)e.GetCode() };
+    }
+    return response;
+}
+
 const char* TFakeModbusConnector::PORT0 = "/dev/ttyNSC0";
 const char* TFakeModbusConnector::PORT1 = "/dev/ttyNSC1";
 
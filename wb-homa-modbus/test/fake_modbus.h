@@ -17,10 +17,11 @@ struct TRegisterRange {
     int ValidateIndex(const std::string& name, int index) const
     {
         if (index < Start || index > End) {
-            throw TModbusException(name + " index is out of range: " +
-                                   std::to_string(index) +
-                                   " (must be " + std::to_string(Start) +
-                                   " <= addr < " + std::to_string(End) + ")");
+            throw TModbusSlaveException(TModbusSlaveException::ILLEGAL_DATA_ADDRESS,
+                                        name + " index is out of range: " +
+                                        std::to_string(index) +
+                                        " (must be " + std::to_string(Start) +
+                                        " <= addr < " + std::to_string(End) + ")");
             return Start;
         }
         return index;
@@ -128,12 +129,17 @@ public:
     void WriteHoldingRegister(int addr, uint16_t value);
     void ReadInputRegisters(int addr, int nb, uint16_t *dest);
     void USleep(int usec);
+    std::vector<uint8_t> RawRequest(const std::vector<uint8_t>& pdu);
 
     void ExpectDebug(bool debug)
     {
         ASSERT_EQ(Debug, debug);
     }
 
+    // emulates a removed serial adapter: the port can't be
+    // opened and all transactions fail with I/O errors
+    void SetUnplugged(bool unplugged) { Unplugged = unplugged; }
+
     PFakeSlave GetSlave(int slave_addr);
     PFakeSlave AddSlave(int slave_addr, PFakeSlave slave);
 
@@ -141,9 +147,12 @@ private:
     friend class TFakeModbusConnector;
     TFakeModbusContext(TLoggedFixture& fixture): Fixture(fixture) {}
 
+    void CheckPlugged();
+
     TLoggedFixture& Fixture;
     bool Connected = false;
     bool Debug = false;
+    bool Unplugged = false;
     std::map<int, PFakeSlave> Slaves;
     PFakeSlave CurrentSlave;
 };
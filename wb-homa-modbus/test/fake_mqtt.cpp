@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 
+#include <wbmqtt/utils.h>
 #include "fake_mqtt.h"
 
 TFakeMQTTClient::TFakeMQTTClient(const std::string& id, TLoggedFixture& fixture)
@@ -16,6 +17,13 @@ void TFakeMQTTClient::Connect()
         observer->OnConnect(0);
 }
 
+void TFakeMQTTClient::Disconnect()
+{
+    Fixture.Emit() << "Disconnect()";
+    Connected = false;
+    Subscriptions.clear();
+}
+
 int TFakeMQTTClient::Publish(int *mid,
                              const string& topic,
                              const string& payload,
@@ -46,8 +54,14 @@ int TFakeMQTTClient::DoPublish(bool external,
         return MOSQ_ERR_NO_CONN;
     }
 
-    // TBD: handle topic wildcards
-    if (Subscriptions.count(topic)) {
+    bool subscribed = false;
+    for (const auto& sub: Subscriptions) {
+        if (TopicMatchesSub(sub, topic)) {
+            subscribed = true;
+            break;
+        }
+    }
+    if (subscribed) {
         mosquitto_message msg;
         msg.mid = 0;
         msg.topic = strdup(topic.c_str());
@@ -9,6 +9,8 @@ class TFakeMQTTClient: public TMQTTClientBase
 public:
     TFakeMQTTClient(const std::string& id, TLoggedFixture& fixture);
     void Connect();
+    // drops the subscriptions like a clean session does
+    void Disconnect();
     int Publish(int *mid,
                 const string& topic,
                 const string& payload = "",
@@ -0,0 +1,124 @@
+// Polling loop benchmark. Builds a synthetic configuration of
+// 100 devices with 20 registers each and runs the polling cycle
+// against a context that answers instantly, so only the CPU time
+// spent by the client itself is measured.
+//
+// Usage: modbus-bench [cycles]
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../modbus_client.h"
+
+namespace {
+    const int DeviceCount = 100;
+    const int RegistersPerDevice = 20;
+
+    // every read returns a new value so that each poll
+    // goes all the way to the value change callback
+    class TNullModbusContext: public TModbusStatusContext
+    {
+    public:
+        void Connect() {}
+        void Disconnect() {}
+        void SetDebug(bool) {}
+        void SetSlave(int) {}
+        void USleep(int) {}
+        TStatus Execute(uint8_t function, int, int nb, uint16_t* data, int&)
+        {
+            // reads of coils and discrete inputs
+            if (function <= 2) {
+                for (int i = 0; i < nb; ++i)
+                    data[i] = ++Counter & 1;
+            } else if (function <= 4) {
+                for (int i = 0; i < nb; ++i)
+                    data[i] = ++Counter & 0xffff;
+            }
+            return OK;
+        }
+
+    private:
+        unsigned Counter = 0;
+    };
+
+    class TNullModbusConnector: public TModbusConnector
+    {
+    public:
+        PModbusContext CreateContext(const TModbusConnectionSettings&)
+        {
+            return PModbusContext(new TNullModbusContext);
+        }
+    };
+
+    // resident set size in KiB
+    long RSS()
+    {
+        long size = 0, resident = 0;
+        std::ifstream statm("/proc/self/statm");
+        statm >> size >> resident;
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    double CPUTime()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int cycles = argc > 1 ? atoi(argv[1]) : 10;
+    long rss_before = RSS();
+
+    TModbusConnectionSettings settings("/dev/null", 115200, 'N', 8, 1);
+    PModbusClient client(new TModbusClient(settings, PModbusConnector(new TNullModbusConnector)));
+    client->SetPollInterval(0);
+
+    static const TModbusRegister::RegisterType types[] = {
+        TModbusRegister::COIL, TModbusRegister::DISCRETE_INPUT,
+        TModbusRegister::HOLDING_REGISTER, TModbusRegister::INPUT_REGISTER
+    };
+    static const TModbusRegister::RegisterFormat formats[] = {
+        TModbusRegister::U16, TModbusRegister::S16, TModbusRegister::U32,
+        TModbusRegister::Float, TModbusRegister::U64
+    };
+    for (int slave = 1; slave <= DeviceCount; ++slave) {
+        for (int i = 0; i < RegistersPerDevice; ++i) {
+            TModbusRegister::RegisterType type = types[i % 4];
+            bool bit = type == TModbusRegister::COIL || type == TModbusRegister::DISCRETE_INPUT;
+            client->AddRegister(std::make_shared<TModbusRegister>(
+                slave, type, i * 4, bit ? TModbusRegister::U8 : formats[i % 5]));
+        }
+    }
+
+    long changes = 0;
+    client->SetCallback([&](std::shared_ptr<TModbusRegister> reg) {
+            // the port formats every changed value for publishing
+            changes += client->GetTextValue(reg).size() > 0;
+        });
+
+    long rss_config = RSS();
+    double cpu_start = CPUTime();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < cycles; ++i)
+        client->Cycle();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = CPUTime() - cpu_start;
+
+    int registers = DeviceCount * RegistersPerDevice;
+    std::cout << "registers: " << registers << std::endl
+              << "cycles: " << cycles << std::endl
+              << "value changes: " << changes << std::endl
+              << "cpu time per cycle: " << cpu / cycles * 1e3 << " ms" << std::endl
+              << "cpu time per poll: " << cpu / cycles / registers * 1e6 << " us" << std::endl
+              << "wall time per cycle: " << wall / cycles * 1e3 << " ms" << std::endl
+              << "rss: " << RSS() << " KiB (" << rss_config - rss_before
+              << " KiB for the configuration)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,644 @@
+// Modbus RTU slave emulator for end to end soak testing of the daemon.
+// Takes the same config as wb-homa-modbus (device_type templates
+// included) and opens a pty pair for each port, replacing the port
+// path with a symlink to the slave side of the pty. The devices
+// listed on the port answer requests to the registers of their
+// channels, any other address gets ILLEGAL_DATA_ADDRESS exception.
+// Coils and holding registers keep the written values, read-only
+// registers are updated by the value generator on each read.
+// Responses are delayed by the wire time of the request and the
+// response at the port's baud rate, as pty itself has no baud rate.
+//
+// Usage: modbus-emulator -c config [-t templates] [-d delay_ms]
+//                        [-j jitter_ms] [-l drop_percent]
+//                        [-g constant|counter|random|sine] [-v]
+//
+//   -d  response delay of the slaves (default 0)
+//   -j  random extra delay of up to the specified value
+//   -l  percentage of requests left without response
+//   -g  generator for read-only registers (default counter)
+//   -v  dump frames to stderr
+//
+// Run the daemon with the same config once the emulator is up.
+// SIGINT / SIGTERM remove the symlinks and print the statistics.
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../modbus_config.h"
+#include "../modbus_rtu.h"
+
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_COILS = 0x0F,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+
+    // incomplete frames are dropped after this much silence
+    const int FrameTimeoutMs = 50;
+
+    enum TGenerator { CONSTANT, COUNTER, RANDOM, SINE };
+
+    struct TEmulatorOptions
+    {
+        int DelayMs = 0;
+        int JitterMs = 0;
+        double DropPercent = 0;
+        TGenerator Generator = COUNTER;
+        bool Verbose = false;
+    };
+
+    volatile sig_atomic_t Stop = 0;
+
+    void HandleSignal(int)
+    {
+        Stop = 1;
+    }
+
+    std::mt19937 Random(std::random_device{}());
+
+    void DumpFrame(const std::string& prefix, const std::vector<uint8_t>& frame)
+    {
+        std::cerr << prefix << std::hex << std::setfill('0');
+        for (auto b: frame)
+            std::cerr << " " << std::setw(2) << (int)b;
+        std::cerr << std::dec << std::endl;
+    }
+
+    int GetWord(const uint8_t* data)
+    {
+        return (data[0] << 8) | data[1];
+    }
+
+    void PutWord(std::vector<uint8_t>& data, int value)
+    {
+        data.push_back((value >> 8) & 0xff);
+        data.push_back(value & 0xff);
+    }
+
+    // Read-only register with the values coming from the generator
+    struct TGeneratedRegister
+    {
+        std::shared_ptr<TModbusRegister> Register;
+        int64_t Max;
+        uint64_t Counter = 0;
+    };
+
+    class TEmulatedSlave
+    {
+    public:
+        TEmulatedSlave(const TEmulatorOptions& options): Options(options) {}
+        void AddRegister(std::shared_ptr<TModbusRegister> reg, int max);
+        void AddHoldingRegister(int address);
+        // returns the response PDU
+        std::vector<uint8_t> Handle(const std::vector<uint8_t>& pdu);
+
+    private:
+        typedef std::map<int, uint16_t> TBank;
+        std::vector<uint8_t> Exception(uint8_t function, uint8_t code) const;
+        bool HasRange(const TBank& bank, int addr, int nb) const;
+        void Generate(TModbusRegister::RegisterType type, int addr, int nb);
+        void Encode(TGeneratedRegister& reg, int64_t value);
+
+        const TEmulatorOptions& Options;
+        // indexed by TModbusRegister::RegisterType
+        TBank Banks[4];
+        std::vector<TGeneratedRegister> Generated;
+    };
+
+    void TEmulatedSlave::AddRegister(std::shared_ptr<TModbusRegister> reg, int max)
+    {
+        TBank& bank = Banks[reg->Type];
+        for (int i = 0; i < reg->Width(); ++i)
+            bank.insert(std::make_pair(reg->Address + i, 0));
+        if (!reg->IsReadOnly())
+            return;
+
+        TGeneratedRegister generated;
+        generated.Register = reg;
+        if (max > 0)
+            generated.Max = max;
+        else if (reg->Type == TModbusRegister::COIL || reg->Type == TModbusRegister::DISCRETE_INPUT)
+            generated.Max = 1;
+        else if (reg->Format == TModbusRegister::U8 || reg->Format == TModbusRegister::S8)
+            generated.Max = 0xff;
+        else if (reg->Width() == 1)
+            generated.Max = reg->Format == TModbusRegister::S16 ? 0x7fff : 0xffff;
+        else
+            generated.Max = 1000000;
+        Generated.push_back(generated);
+    }
+
+    void TEmulatedSlave::AddHoldingRegister(int address)
+    {
+        Banks[TModbusRegister::HOLDING_REGISTER].insert(std::make_pair(address, 0));
+    }
+
+    std::vector<uint8_t> TEmulatedSlave::Exception(uint8_t function, uint8_t code) const
+    {
+        return { uint8_t(function | 0x80), code };
+    }
+
+    bool TEmulatedSlave::HasRange(const TBank& bank, int addr, int nb) const
+    {
+        for (int i = 0; i < nb; ++i) {
+            if (!bank.count(addr + i))
+                return false;
+        }
+        return true;
+    }
+
+    void TEmulatedSlave::Encode(TGeneratedRegister& reg, int64_t value)
+    {
+        int width = reg.Register->Width();
+        uint64_t bits;
+        if (reg.Register->Format == TModbusRegister::Float) {
+            float f = value;
+            uint32_t tmp;
+            memcpy(&tmp, &f, sizeof(tmp));
+            bits = tmp;
+        } else if (reg.Register->Format == TModbusRegister::Double) {
+            double d = value;
+            memcpy(&bits, &d, sizeof(bits));
+        } else
+            bits = value;
+
+        // big-endian word order, as the client expects
+        TBank& bank = Banks[reg.Register->Type];
+        for (int i = 0; i < width; ++i)
+            bank[reg.Register->Address + i] = (bits >> (16 * (width - 1 - i))) & 0xffff;
+    }
+
+    void TEmulatedSlave::Generate(TModbusRegister::RegisterType type, int addr, int nb)
+    {
+        for (auto& reg: Generated) {
+            if (reg.Register->Type != type || reg.Register->Address >= addr + nb ||
+                reg.Register->Address + reg.Register->Width() <= addr)
+                continue;
+
+            switch (Options.Generator) {
+            case CONSTANT:
+                break;
+            case COUNTER:
+                Encode(reg, reg.Counter++ % (reg.Max + 1));
+                break;
+            case RANDOM:
+                Encode(reg, std::uniform_int_distribution<int64_t>(0, reg.Max)(Random));
+                break;
+            case SINE:
+                {
+                    // one minute period
+                    double t = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+                    Encode(reg, std::llround(reg.Max * (1 + sin(2 * M_PI * t / 60)) / 2));
+                }
+                break;
+            }
+        }
+    }
+
+    std::vector<uint8_t> TEmulatedSlave::Handle(const std::vector<uint8_t>& pdu)
+    {
+        uint8_t function = pdu[0];
+        int addr = GetWord(&pdu[1]);
+        int nb = GetWord(&pdu[3]);
+        std::vector<uint8_t> response = { function };
+
+        switch (function) {
+        case READ_COILS:
+        case READ_DISCRETE_INPUTS:
+            {
+                auto type = function == READ_COILS ?
+                    TModbusRegister::COIL : TModbusRegister::DISCRETE_INPUT;
+                if (nb < 1 || nb > 2000)
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_VALUE);
+                if (!HasRange(Banks[type], addr, nb))
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_ADDRESS);
+                Generate(type, addr, nb);
+                response.push_back((nb + 7) / 8);
+                response.resize(response.size() + (nb + 7) / 8);
+                for (int i = 0; i < nb; ++i) {
+                    if (Banks[type][addr + i])
+                        response[2 + i / 8] |= 1 << (i % 8);
+                }
+            }
+            break;
+        case READ_HOLDING_REGISTERS:
+        case READ_INPUT_REGISTERS:
+            {
+                auto type = function == READ_HOLDING_REGISTERS ?
+                    TModbusRegister::HOLDING_REGISTER : TModbusRegister::INPUT_REGISTER;
+                if (nb < 1 || nb > 125)
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_VALUE);
+                if (!HasRange(Banks[type], addr, nb))
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_ADDRESS);
+                Generate(type, addr, nb);
+                response.push_back(nb * 2);
+                for (int i = 0; i < nb; ++i)
+                    PutWord(response, Banks[type][addr + i]);
+            }
+            break;
+        case WRITE_SINGLE_COIL:
+            if (nb != 0xff00 && nb != 0)
+                return Exception(function, TModbusSlaveException::ILLEGAL_DATA_VALUE);
+            if (!HasRange(Banks[TModbusRegister::COIL], addr, 1))
+                return Exception(function, TModbusSlaveException::ILLEGAL_DATA_ADDRESS);
+            Banks[TModbusRegister::COIL][addr] = nb ? 1 : 0;
+            response = pdu;
+            break;
+        case WRITE_SINGLE_REGISTER:
+            if (!HasRange(Banks[TModbusRegister::HOLDING_REGISTER], addr, 1))
+                return Exception(function, TModbusSlaveException::ILLEGAL_DATA_ADDRESS);
+            Banks[TModbusRegister::HOLDING_REGISTER][addr] = nb;
+            response = pdu;
+            break;
+        case WRITE_MULTIPLE_COILS:
+        case WRITE_MULTIPLE_REGISTERS:
+            {
+                bool bits = function == WRITE_MULTIPLE_COILS;
+                auto type = bits ? TModbusRegister::COIL : TModbusRegister::HOLDING_REGISTER;
+                size_t size = bits ? (nb + 7) / 8 : nb * 2;
+                if (nb < 1 || pdu.size() != 6 + size || pdu[5] != size)
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_VALUE);
+                if (!HasRange(Banks[type], addr, nb))
+                    return Exception(function, TModbusSlaveException::ILLEGAL_DATA_ADDRESS);
+                for (int i = 0; i < nb; ++i)
+                    Banks[type][addr + i] = bits ? (pdu[6 + i / 8] >> (i % 8)) & 1 :
+                        GetWord(&pdu[6 + i * 2]);
+                response.assign(pdu.begin(), pdu.begin() + 5);
+            }
+            break;
+        default:
+            return Exception(function, TModbusSlaveException::ILLEGAL_FUNCTION);
+        }
+        return response;
+    }
+
+    struct TEmulatorStats
+    {
+        uint64_t Requests = 0;
+        uint64_t Responses = 0;
+        uint64_t Exceptions = 0;
+        uint64_t Dropped = 0;
+        uint64_t BadFrames = 0;
+    };
+
+    class TEmulatedPort
+    {
+    public:
+        TEmulatedPort(PPortConfig config, const TEmulatorOptions& options);
+        ~TEmulatedPort();
+        int GetFd() const { return MasterFd; }
+        void HandleInput();
+        // Sends the responses that are due and the frames
+        // that are timed out, returns the time left until
+        // the next event in ms or -1
+        int HandleTimers();
+        void PrintStats() const;
+
+    private:
+        struct TPendingResponse
+        {
+            std::chrono::steady_clock::time_point Time;
+            std::vector<uint8_t> Frame;
+        };
+
+        int RequestSize() const;
+        void HandleFrame(const std::vector<uint8_t>& frame);
+
+        std::string Path;
+        const TEmulatorOptions& Options;
+        int MasterFd = -1;
+        // kept open so that the master doesn't get a hangup
+        // each time the daemon closes the port
+        int SlaveFd = -1;
+        int CharTimeUs;
+        std::vector<uint8_t> Input;
+        std::chrono::steady_clock::time_point LastInputTime;
+        std::deque<TPendingResponse> Pending;
+        std::map<int, TEmulatedSlave> Slaves;
+        TEmulatorStats Stats;
+    };
+
+    TEmulatedPort::TEmulatedPort(PPortConfig config, const TEmulatorOptions& options)
+        : Path(config->ConnSettings.Device), Options(options)
+    {
+        const TModbusConnectionSettings& settings = config->ConnSettings;
+        int char_bits = 1 + settings.DataBits + (settings.Parity == 'N' ? 0 : 1) + settings.StopBits;
+        CharTimeUs = char_bits * 1000000 / settings.BaudRate;
+
+        for (const auto& device_config: config->DeviceConfigs) {
+            // broadcast groups have no registers of their own
+            if (!device_config->SlaveId)
+                continue;
+            auto it = Slaves.insert(std::make_pair(device_config->SlaveId,
+                                                   TEmulatedSlave(Options))).first;
+            for (const auto& channel: device_config->ModbusChannels) {
+                for (const auto& reg: channel->Registers)
+                    it->second.AddRegister(reg, channel->Max);
+            }
+            for (const auto& item: device_config->SetupItems)
+                it->second.AddHoldingRegister(item->Address);
+        }
+
+        MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (MasterFd < 0 || grantpt(MasterFd) < 0 || unlockpt(MasterFd) < 0)
+            throw TModbusException("failed to create pty");
+        std::string pty_path = ptsname(MasterFd);
+        fcntl(MasterFd, F_SETFL, fcntl(MasterFd, F_GETFL) | O_NONBLOCK);
+
+        SlaveFd = open(pty_path.c_str(), O_RDWR | O_NOCTTY);
+        if (SlaveFd < 0)
+            throw TModbusException("failed to open " + pty_path);
+        // the daemon sets its own mode, but the requests must not
+        // be echoed back until it does
+        struct termios mode;
+        tcgetattr(SlaveFd, &mode);
+        cfmakeraw(&mode);
+        tcsetattr(SlaveFd, TCSANOW, &mode);
+
+        struct stat st;
+        if (lstat(Path.c_str(), &st) == 0) {
+            if (!S_ISLNK(st.st_mode))
+                throw TModbusException("refusing to replace " + Path + ", it's not a symlink");
+            unlink(Path.c_str());
+        }
+        if (symlink(pty_path.c_str(), Path.c_str()) < 0)
+            throw TModbusException("failed to create symlink " + Path + ": " + strerror(errno));
+        std::cerr << Path << " -> " << pty_path << ", " << Slaves.size() << " slave(s)" << std::endl;
+    }
+
+    TEmulatedPort::~TEmulatedPort()
+    {
+        unlink(Path.c_str());
+        if (SlaveFd >= 0)
+            close(SlaveFd);
+        if (MasterFd >= 0)
+            close(MasterFd);
+    }
+
+    // -1 if more data is needed, 0 if the function is unknown
+    int TEmulatedPort::RequestSize() const
+    {
+        if (Input.size() < 2)
+            return -1;
+        switch (Input[1]) {
+        case READ_COILS:
+        case READ_DISCRETE_INPUTS:
+        case READ_HOLDING_REGISTERS:
+        case READ_INPUT_REGISTERS:
+        case WRITE_SINGLE_COIL:
+        case WRITE_SINGLE_REGISTER:
+            return 8;
+        case WRITE_MULTIPLE_COILS:
+        case WRITE_MULTIPLE_REGISTERS:
+            return Input.size() < 7 ? -1 : 9 + Input[6];
+        default:
+            return 0;
+        }
+    }
+
+    void TEmulatedPort::HandleInput()
+    {
+        uint8_t buf[TModbusRtuTransport::MaxFrameSize];
+        ssize_t n;
+        while ((n = read(MasterFd, buf, sizeof(buf))) > 0) {
+            Input.insert(Input.end(), buf, buf + n);
+            LastInputTime = std::chrono::steady_clock::now();
+        }
+
+        for (;;) {
+            int size = RequestSize();
+            // frames of unknown functions end on silence
+            if (size <= 0 || int(Input.size()) < size)
+                break;
+            std::vector<uint8_t> frame(Input.begin(), Input.begin() + size);
+            Input.erase(Input.begin(), Input.begin() + size);
+            HandleFrame(frame);
+        }
+    }
+
+    void TEmulatedPort::HandleFrame(const std::vector<uint8_t>& frame)
+    {
+        if (Options.Verbose)
+            DumpFrame(Path + " ->", frame);
+        if (frame.size() < 4 || TModbusRtuTransport::CRC16(frame.data(), frame.size())) {
+            ++Stats.BadFrames;
+            return;
+        }
+
+        ++Stats.Requests;
+        int slave_id = frame[0];
+        std::vector<uint8_t> pdu(frame.begin() + 1, frame.end() - 2);
+        // pad short frames of unknown functions for Handle()
+        if (pdu.size() < 5)
+            pdu.resize(5);
+        if (!slave_id) {
+            // broadcast writes are applied by all slaves, nobody responds
+            for (auto& slave: Slaves)
+                slave.second.Handle(pdu);
+            return;
+        }
+
+        auto it = Slaves.find(slave_id);
+        if (it == Slaves.end())
+            return;
+        if (Options.DropPercent > 0 &&
+            std::uniform_real_distribution<double>(0, 100)(Random) < Options.DropPercent) {
+            ++Stats.Dropped;
+            return;
+        }
+
+        std::vector<uint8_t> response = it->second.Handle(pdu);
+        if (response[0] & 0x80)
+            ++Stats.Exceptions;
+        response.insert(response.begin(), slave_id);
+        uint16_t crc = TModbusRtuTransport::CRC16(response.data(), response.size());
+        response.push_back(crc & 0xff);
+        response.push_back(crc >> 8);
+
+        int delay_us = Options.DelayMs * 1000 + CharTimeUs * (frame.size() + response.size());
+        if (Options.JitterMs > 0)
+            delay_us += std::uniform_int_distribution<int>(0, Options.JitterMs * 1000)(Random);
+        TPendingResponse pending;
+        pending.Time = std::chrono::steady_clock::now() + std::chrono::microseconds(delay_us);
+        pending.Frame = response;
+        Pending.push_back(pending);
+    }
+
+    int TEmulatedPort::HandleTimers()
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!Pending.empty() && Pending.front().Time <= now) {
+            const auto& frame = Pending.front().Frame;
+            if (Options.Verbose)
+                DumpFrame(Path + " <-", frame);
+            if (write(MasterFd, frame.data(), frame.size()) == ssize_t(frame.size()))
+                ++Stats.Responses;
+            Pending.pop_front();
+        }
+
+        if (!Input.empty() && now - LastInputTime >= std::chrono::milliseconds(FrameTimeoutMs)) {
+            std::vector<uint8_t> frame;
+            frame.swap(Input);
+            HandleFrame(frame);
+        }
+
+        int timeout = -1;
+        if (!Pending.empty())
+            timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                Pending.front().Time - now).count() + 1;
+        if (!Input.empty()) {
+            int frame_timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                LastInputTime + std::chrono::milliseconds(FrameTimeoutMs) - now).count() + 1;
+            if (timeout < 0 || frame_timeout < timeout)
+                timeout = frame_timeout;
+        }
+        return timeout;
+    }
+
+    void TEmulatedPort::PrintStats() const
+    {
+        std::cout << Path << ": requests: " << Stats.Requests
+                  << ", responses: " << Stats.Responses
+                  << ", exceptions: " << Stats.Exceptions
+                  << ", dropped: " << Stats.Dropped
+                  << ", bad frames: " << Stats.BadFrames << std::endl;
+    }
+
+    void Usage()
+    {
+        std::cerr << "Usage: modbus-emulator -c config [-t templates] [-d delay_ms] [-j jitter_ms]" << std::endl
+                  << "                       [-l drop_percent] [-g constant|counter|random|sine] [-v]"
+                  << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string config_fname, templates_folder = "/usr/share/wb-homa-modbus/templates";
+    TEmulatorOptions options;
+    int c;
+    while ((c = getopt(argc, argv, "c:t:d:j:l:g:v")) != -1) {
+        switch (c) {
+        case 'c':
+            config_fname = optarg;
+            break;
+        case 't':
+            templates_folder = optarg;
+            break;
+        case 'd':
+            options.DelayMs = atoi(optarg);
+            break;
+        case 'j':
+            options.JitterMs = atoi(optarg);
+            break;
+        case 'l':
+            options.DropPercent = atof(optarg);
+            break;
+        case 'g':
+            if (!strcmp(optarg, "constant"))
+                options.Generator = CONSTANT;
+            else if (!strcmp(optarg, "counter"))
+                options.Generator = COUNTER;
+            else if (!strcmp(optarg, "random"))
+                options.Generator = RANDOM;
+            else if (!strcmp(optarg, "sine"))
+                options.Generator = SINE;
+            else {
+                Usage();
+                return 1;
+            }
+            break;
+        case 'v':
+            options.Verbose = true;
+            break;
+        default:
+            Usage();
+            return 1;
+        }
+    }
+    if (config_fname.empty()) {
+        Usage();
+        return 1;
+    }
+
+    PHandlerConfig handler_config;
+    try {
+        TConfigTemplateParser device_parser(templates_folder, false);
+        TConfigParser parser(config_fname, false, device_parser.Parse());
+        handler_config = parser.Parse();
+    } catch (const TConfigParserException& e) {
+        std::cerr << "FATAL: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<TEmulatedPort>> ports;
+    try {
+        for (const auto& port_config: handler_config->PortConfigs) {
+            if (port_config->Type == "uniel" || port_config->Type == "smartbus") {
+                std::cerr << "warning: skipping " << port_config->Type << " port "
+                          << port_config->ConnSettings.Device
+                          << std::endl;
+                continue;
+            }
+            ports.emplace_back(new TEmulatedPort(port_config, options));
+        }
+    } catch (const TModbusException& e) {
+        std::cerr << "FATAL: " << e.what() << std::endl;
+        return 1;
+    }
+
+    signal(SIGINT, HandleSignal);
+    signal(SIGTERM, HandleSignal);
+
+    std::vector<struct pollfd> fds(ports.size());
+    for (size_t i = 0; i < ports.size(); ++i) {
+        fds[i].fd = ports[i]->GetFd();
+        fds[i].events = POLLIN;
+    }
+
+    while (!Stop) {
+        int timeout = -1;
+        for (const auto& port: ports) {
+            int port_timeout = port->HandleTimers();
+            if (port_timeout >= 0 && (timeout < 0 || port_timeout < timeout))
+                timeout = port_timeout;
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "FATAL: poll() failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        for (size_t i = 0; i < ports.size(); ++i) {
+            if (fds[i].revents & POLLIN)
+                ports[i]->HandleInput();
+        }
+    }
+
+    for (const auto& port: ports)
+        port->PrintStats();
+    return 0;
+}
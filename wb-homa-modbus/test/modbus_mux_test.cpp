@@ -0,0 +1,123 @@
+#include <iomanip>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gtest/gtest.h>
+
+#include "testlog.h"
+#include "fake_modbus.h"
+#include "../modbus_mux.h"
+#include "../modbus_rtu.h"
+
+class TModbusMuxTest: public TLoggedFixture
+{
+protected:
+    void SetUp();
+    void TearDown();
+    void QueueRequest(int slave, const std::vector<uint8_t>& pdu);
+    std::string Dump(const std::vector<uint8_t>& data);
+
+    PFakeModbusConnector Connector;
+    PModbusClient ModbusClient;
+    PFakeSlave Slave;
+};
+
+void TModbusMuxTest::SetUp()
+{
+    TModbusConnectionSettings settings(TFakeModbusConnector::PORT0, 115200, 'N', 8, 1);
+    Connector = PFakeModbusConnector(new TFakeModbusConnector(*this));
+    ModbusClient = PModbusClient(new TModbusClient(settings, Connector));
+    ModbusClient->SetCallback([this](std::shared_ptr<TModbusRegister> reg) {
+            Emit() << "Modbus Callback: " << reg->ToString() << " becomes " <<
+                ModbusClient->GetTextValue(reg);
+        });
+    Slave = Connector->AddSlave(TFakeModbusConnector::PORT0, 1,
+                                TRegisterRange(0, 10),
+                                TRegisterRange(10, 20),
+                                TRegisterRange(20, 30),
+                                TRegisterRange(30, 40));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 20));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::INPUT_REGISTER, 30));
+}
+
+void TModbusMuxTest::TearDown()
+{
+    ModbusClient.reset();
+    Connector.reset();
+    TLoggedFixture::TearDown();
+}
+
+std::string TModbusMuxTest::Dump(const std::vector<uint8_t>& data)
+{
+    std::stringstream s;
+    s << std::hex << std::setfill('0');
+    for (auto b: data)
+        s << " " << std::setw(2) << (int)b;
+    return s.str();
+}
+
+void TModbusMuxTest::QueueRequest(int slave, const std::vector<uint8_t>& pdu)
+{
+    ModbusClient->QueueRawRequest(slave, pdu, [this](const std::vector<uint8_t>& response,
+                                                     const std::string& error) {
+            if (error.empty())
+                Emit() << "raw response:" << Dump(response);
+            else
+                Emit() << "raw request error: " << error;
+        });
+}
+
+TEST_F(TModbusMuxTest, Priority)
+{
+    Slave->Holding[21] = 0x1234;
+    Slave->Holding[22] = 0x5678;
+
+    Note() << "one raw request per poll (default)";
+    QueueRequest(1, { 0x03, 0x00, 21, 0x00, 0x01 });
+    QueueRequest(1, { 0x03, 0x00, 22, 0x00, 0x01 });
+    QueueRequest(1, { 0x04, 0x00, 30, 0x00, 0x01 });
+    ModbusClient->Cycle();
+
+    Note() << "all raw requests before the next poll";
+    ModbusClient->SetRawRequestsPerPoll(0);
+    QueueRequest(1, { 0x03, 0x00, 21, 0x00, 0x02 });
+    QueueRequest(1, { 0x03, 0x00, 40, 0x00, 0x01 });
+    QueueRequest(1, { 0x03, 0x00, 20, 0x00, 0x01 });
+    ModbusClient->Cycle();
+}
+
+TEST_F(TModbusMuxTest, Socket)
+{
+    std::string path = "/tmp/wb-homa-modbus-mux-test-" + std::to_string(getpid());
+    TModbusMux mux(path, ModbusClient);
+    mux.Start();
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    ASSERT_GE(fd, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(0, connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+
+    Slave->Holding[25] = 0xbeef;
+    std::vector<uint8_t> request = { 0x01, 0x03, 0x00, 25, 0x00, 0x01 };
+    uint16_t crc = TModbusRtuTransport::CRC16(request.data(), request.size());
+    request.push_back(crc & 0xff);
+    request.push_back(crc >> 8);
+    ASSERT_EQ((ssize_t)request.size(), send(fd, request.data(), request.size(), 0));
+
+    // the malformed request is rejected right away. As the packets
+    // are handled in order, this also means that the first one is queued.
+    std::vector<uint8_t> bad = { 0x01, 0x03, 0x00, 25, 0x00, 0x01, 0x00, 0x00 };
+    ASSERT_EQ((ssize_t)bad.size(), send(fd, bad.data(), bad.size(), 0));
+    uint8_t buf[256];
+    EXPECT_EQ(0, recv(fd, buf, sizeof(buf), 0));
+
+    ModbusClient->Cycle();
+    int n = recv(fd, buf, sizeof(buf), 0);
+    ASSERT_GT(n, 0);
+    Emit() << "reply:" << Dump(std::vector<uint8_t>(buf, buf + n));
+    EXPECT_EQ(0, TModbusRtuTransport::CRC16(buf, n));
+    close(fd);
+}
@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <wbmqtt/utils.h>
+
+#include "testlog.h"
+#include "fake_modbus.h"
+#include "fake_mqtt.h"
+#include "../modbus_rpc.h"
+
+class TModbusRPCTest: public TLoggedFixture
+{
+protected:
+    void SetUp();
+    void TearDown();
+    void Call(const std::string& method, const std::string& params);
+
+    PFakeModbusConnector Connector;
+    PModbusClient ModbusClient;
+    PFakeSlave Slave;
+    PModbusRPC RPC;
+};
+
+void TModbusRPCTest::SetUp()
+{
+    TModbusConnectionSettings settings(TFakeModbusConnector::PORT0, 115200, 'N', 8, 1);
+    Connector = PFakeModbusConnector(new TFakeModbusConnector(*this));
+    ModbusClient = PModbusClient(new TModbusClient(settings, Connector));
+    ModbusClient->SetCallback([this](std::shared_ptr<TModbusRegister> reg) {
+            Emit() << "Modbus Callback: " << reg->ToString() << " becomes " <<
+                ModbusClient->GetTextValue(reg);
+        });
+    Slave = Connector->AddSlave(TFakeModbusConnector::PORT0, 1,
+                                TRegisterRange(0, 10),
+                                TRegisterRange(10, 20),
+                                TRegisterRange(20, 30),
+                                TRegisterRange(30, 40));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 20));
+
+    RPC = PModbusRPC(new TModbusRPC(PMQTTClientBase()));
+    RPC->AddPort(TFakeModbusConnector::PORT0, ModbusClient);
+}
+
+void TModbusRPCTest::TearDown()
+{
+    RPC.reset();
+    ModbusClient.reset();
+    Connector.reset();
+    TLoggedFixture::TearDown();
+}
+
+// Queues the request and lets the polling loop pick it up
+// and deliver the reply.
+void TModbusRPCTest::Call(const std::string& method, const std::string& params_text)
+{
+    Json::Value params;
+    Json::Reader reader;
+    ASSERT_TRUE(reader.parse(params_text, params));
+
+    bool done = false;
+    std::string text;
+    auto reply = [&](const Json::Value& result, const std::string& error) {
+        Json::FastWriter writer;
+        text = error.empty() ? writer.write(result) : "error: " + error;
+        done = true;
+    };
+    try {
+        if (method == "read")
+            RPC->Read(params, reply);
+        else
+            RPC->Write(params, reply);
+    } catch (const TBaseException& e) {
+        reply(Json::Value(), e.what());
+    }
+
+    // the MQTT thread isn't blocked until the request is done
+    EXPECT_EQ(done, !ModbusClient->HasPendingRawRequests());
+    if (ModbusClient->HasPendingRawRequests())
+        ModbusClient->Cycle();
+    ASSERT_TRUE(done);
+
+    if (!text.empty() && text.back() == '\n')
+        text.pop_back();
+    Emit() << method << " " << params_text << " -> " << text;
+}
+
+TEST_F(TModbusRPCTest, ReadWrite)
+{
+    Slave->Holding[25] = 0x1234;
+    Slave->Holding[26] = 0x5678;
+    Slave->Input[35] = 42;
+    Call("read", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 25, \"count\": 2}");
+    Call("read", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"input\", \"address\": 35}");
+    Call("write", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 27, \"values\": [7]}");
+    Call("write", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 28, \"values\": [1, 2]}");
+    EXPECT_EQ(7, Slave->Holding[27]);
+    EXPECT_EQ(1, Slave->Holding[28]);
+    EXPECT_EQ(2, Slave->Holding[29]);
+}
+
+TEST_F(TModbusRPCTest, Errors)
+{
+    Call("read", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 40}");
+    Call("read", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"coil\", \"address\": 0}");
+    Call("read", "{\"port\": \"/dev/ttyNSC1\", \"slave\": 1, \"type\": \"holding\", \"address\": 20}");
+    Call("read", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 20, \"count\": 200}");
+    Call("write", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"input\", \"address\": 30, \"values\": [1]}");
+    Call("write", "{\"port\": \"/dev/ttyNSC0\", \"slave\": 1, \"type\": \"holding\", \"address\": 20, \"values\": [70000]}");
+}
+
+TEST_F(TModbusRPCTest, MQTT)
+{
+    PFakeMQTTClient mqtt_client(new TFakeMQTTClient("em-test", *this));
+    mqtt_client->Connect();
+    RPC = PModbusRPC(new TModbusRPC(mqtt_client));
+    RPC->AddPort(TFakeModbusConnector::PORT0, ModbusClient);
+    RPC->PubSubSetup();
+
+    Slave->Holding[25] = 0x1234;
+    EXPECT_FALSE(RPC->HandleMessage("/devices/em-test/controls/foo/on", "1"));
+    // the reply is published by the polling loop
+    EXPECT_TRUE(RPC->HandleMessage("/rpc/v1/wb-modbus/modbus/read/client1",
+                                   "{\"id\": 1, \"params\": {\"port\": \"/dev/ttyNSC0\", "
+                                   "\"slave\": 1, \"type\": \"holding\", \"address\": 25}}"));
+    EXPECT_TRUE(ModbusClient->HasPendingRawRequests());
+    ModbusClient->Cycle();
+
+    // bad params are rejected right away
+    EXPECT_TRUE(RPC->HandleMessage("/rpc/v1/wb-modbus/modbus/write/client1",
+                                   "{\"id\": 2, \"params\": {\"port\": \"/dev/ttyNSC0\", "
+                                   "\"slave\": 1, \"type\": \"input\", \"address\": 25, "
+                                   "\"values\": [1]}}"));
+    EXPECT_FALSE(ModbusClient->HasPendingRawRequests());
+}
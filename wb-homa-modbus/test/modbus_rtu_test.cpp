@@ -0,0 +1,262 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "../modbus_rtu_context.h"
+
+namespace {
+    std::vector<uint8_t> MakeFrame(std::vector<uint8_t> data)
+    {
+        uint16_t crc = TModbusRtuTransport::CRC16(data.data(), data.size());
+        data.push_back(crc & 0xff);
+        data.push_back(crc >> 8);
+        return data;
+    }
+}
+
+// Emulates a slave on the master side of a pty pair. The master fd
+// is serviced by the transport itself via Watch(), so the whole
+// exchange happens in a single thread.
+class TModbusRtuTest: public ::testing::Test
+{
+protected:
+    enum TReply { REPLY_OK, REPLY_NONE, REPLY_BAD_CRC, REPLY_EXCEPTION };
+
+    void SetUp();
+    void TearDown();
+    TModbusConnectionSettings Settings() const;
+    void CreateContext(const TModbusConnectionSettings& settings);
+    void HandleRequest();
+
+    int MasterFd = -1;
+    std::unique_ptr<TModbusRtuContext> Context;
+    TReply Reply = REPLY_OK;
+    std::vector<uint8_t> Request;
+    std::vector<uint16_t> Registers;
+    int RequestCount = 0;
+};
+
+void TModbusRtuTest::SetUp()
+{
+    MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(MasterFd, 0);
+    ASSERT_EQ(0, grantpt(MasterFd));
+    ASSERT_EQ(0, unlockpt(MasterFd));
+    fcntl(MasterFd, F_SETFL, fcntl(MasterFd, F_GETFL) | O_NONBLOCK);
+    CreateContext(Settings());
+
+    for (int i = 0; i < 16; ++i)
+        Registers.push_back(0x1000 + i);
+}
+
+TModbusConnectionSettings TModbusRtuTest::Settings() const
+{
+    TModbusConnectionSettings settings(ptsname(MasterFd), 115200, 'N', 8, 1);
+    settings.ResponseTimeoutMs = 50;
+    return settings;
+}
+
+void TModbusRtuTest::CreateContext(const TModbusConnectionSettings& settings)
+{
+    Context.reset(new TModbusRtuContext(settings));
+    Context->Connect();
+    Context->Transport().Watch(MasterFd, [this]() { HandleRequest(); });
+}
+
+void TModbusRtuTest::TearDown()
+{
+    Context.reset();
+    if (MasterFd >= 0)
+        close(MasterFd);
+}
+
+void TModbusRtuTest::HandleRequest()
+{
+    uint8_t buf[TModbusRtuTransport::MaxFrameSize];
+    int n = read(MasterFd, buf, sizeof(buf));
+    if (n <= 0)
+        return;
+    Request.insert(Request.end(), buf, buf + n);
+    // all the requests used here are 8 bytes long
+    if (Request.size() < 8)
+        return;
+
+    ++RequestCount;
+    ASSERT_EQ(0, TModbusRtuTransport::CRC16(Request.data(), Request.size()));
+    uint8_t slave = Request[0], function = Request[1];
+    int addr = (Request[2] << 8) | Request[3];
+    int nb = (Request[4] << 8) | Request[5];
+    Request.clear();
+
+    std::vector<uint8_t> response;
+    switch (Reply) {
+    case REPLY_NONE:
+        return;
+    case REPLY_EXCEPTION:
+        response = MakeFrame({ slave, uint8_t(function | 0x80), 0x02 });
+        break;
+    default:
+        if (function == 0x03) {
+            response = { slave, function, uint8_t(nb * 2) };
+            for (int i = 0; i < nb; ++i) {
+                response.push_back(Registers[addr + i] >> 8);
+                response.push_back(Registers[addr + i] & 0xff);
+            }
+        } else if (function == 0x06) {
+            Registers[addr] = nb;
+            response = { slave, function, uint8_t(addr >> 8), uint8_t(addr),
+                         uint8_t(nb >> 8), uint8_t(nb) };
+        }
+        response = MakeFrame(response);
+        if (Reply == REPLY_BAD_CRC)
+            response.back() ^= 0xff;
+    }
+    ASSERT_EQ(int(response.size()), write(MasterFd, response.data(), response.size()));
+}
+
+TEST(TModbusRtuCRCTest, CRC16)
+{
+    // read 2 holding registers @ 0 from slave 1
+    uint8_t frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x02, 0xc4, 0x0b };
+    EXPECT_EQ(0x0bc4, TModbusRtuTransport::CRC16(frame, 6));
+    EXPECT_EQ(0, TModbusRtuTransport::CRC16(frame, sizeof(frame)));
+}
+
+TEST_F(TModbusRtuTest, ReadWrite)
+{
+    Context->SetSlave(1);
+    uint16_t values[3];
+    Context->ReadHoldingRegisters(2, 3, values);
+    EXPECT_EQ(0x1002, values[0]);
+    EXPECT_EQ(0x1003, values[1]);
+    EXPECT_EQ(0x1004, values[2]);
+
+    Context->WriteHoldingRegister(5, 0xbeef);
+    EXPECT_EQ(0xbeef, Registers[5]);
+    Context->ReadHoldingRegisters(5, 1, values);
+    EXPECT_EQ(0xbeef, values[0]);
+    EXPECT_EQ(3, RequestCount);
+}
+
+TEST_F(TModbusRtuTest, Errors)
+{
+    Context->SetSlave(1);
+    uint16_t value;
+
+    Reply = REPLY_NONE;
+    EXPECT_THROW(Context->ReadHoldingRegisters(0, 1, &value), TModbusException);
+
+    Reply = REPLY_BAD_CRC;
+    EXPECT_THROW(Context->ReadHoldingRegisters(0, 1, &value), TModbusException);
+
+    Reply = REPLY_EXCEPTION;
+    try {
+        Context->ReadHoldingRegisters(0, 1, &value);
+        ADD_FAILURE() << "no exception thrown";
+    } catch (const TModbusSlaveException& e) {
+        EXPECT_EQ(TModbusSlaveException::ILLEGAL_DATA_ADDRESS, e.GetCode());
+    }
+
+    // the transport must recover after errors
+    Reply = REPLY_OK;
+    Context->ReadHoldingRegisters(1, 1, &value);
+    EXPECT_EQ(0x1001, value);
+    EXPECT_EQ(4, RequestCount);
+}
+
+TEST_F(TModbusRtuTest, AsyncSubmit)
+{
+    TModbusRtuTransport& transport = Context->Transport();
+    std::vector<std::vector<uint8_t>> responses;
+    for (int addr = 0; addr < 3; ++addr)
+        transport.Submit(1, { 0x03, 0x00, uint8_t(addr), 0x00, 0x01 }, 50000,
+                         [&](TModbusRtuTransport::TStatus status, const std::vector<uint8_t>& pdu) {
+                             EXPECT_EQ(TModbusRtuTransport::OK, status);
+                             responses.push_back(pdu);
+                         });
+    EXPECT_FALSE(transport.IsIdle());
+    while (!transport.IsIdle())
+        transport.RunOnce();
+
+    ASSERT_EQ(3u, responses.size());
+    for (int addr = 0; addr < 3; ++addr) {
+        std::vector<uint8_t> expected = { 0x03, 0x02, 0x10, uint8_t(addr) };
+        EXPECT_EQ(expected, responses[addr]);
+    }
+}
+
+TEST_F(TModbusRtuTest, Interrupt)
+{
+    std::thread thread([this]() {
+            usleep(20000);
+            Context->Interrupt();
+        });
+    auto start = std::chrono::steady_clock::now();
+    Context->USleep(5000000);
+    thread.join();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+    // an interrupt during a transaction ends the next sleep
+    Context->Interrupt();
+    uint16_t value;
+    Context->ReadHoldingRegisters(1, 1, &value);
+    start = std::chrono::steady_clock::now();
+    Context->USleep(5000000);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+}
+
+TEST_F(TModbusRtuTest, TimingStats)
+{
+    Context->SetSlave(1);
+    uint16_t value;
+    EXPECT_EQ(0u, Context->GetTimingStats().Responses);
+    Context->ReadHoldingRegisters(0, 1, &value);
+    Context->WriteHoldingRegister(1, 42);
+
+    // failed transactions don't count
+    Reply = REPLY_NONE;
+    EXPECT_THROW(Context->ReadHoldingRegisters(0, 1, &value), TModbusException);
+
+    TModbusTimingStats stats = Context->GetTimingStats();
+    EXPECT_EQ(2u, stats.Responses);
+    EXPECT_LE(stats.MinTurnaroundUs, stats.MaxTurnaroundUs);
+    EXPECT_LE(stats.TurnaroundUs, 2 * uint64_t(stats.MaxTurnaroundUs));
+    // 8 byte requests, 7 and 8 byte responses
+    // (pty has no baud rate, so the wire time is only nominal here)
+    EXPECT_EQ(uint64_t(Context->Transport().GetWireTimeUs(31)), stats.WireUs);
+    EXPECT_GT(stats.TransactionUs, 0u);
+}
+
+TEST_F(TModbusRtuTest, LowLatency)
+{
+    // pty doesn't support ASYNC_LOW_LATENCY, so only VMIN tuning is
+    // in effect. The response must still be read as a whole.
+    TModbusConnectionSettings settings = Settings();
+    settings.LowLatency = true;
+    CreateContext(settings);
+
+    Context->SetSlave(1);
+    uint16_t values[4];
+    Context->ReadHoldingRegisters(4, 4, values);
+    EXPECT_EQ(0x1004, values[0]);
+    EXPECT_EQ(0x1007, values[3]);
+
+    Reply = REPLY_EXCEPTION;
+    EXPECT_THROW(Context->ReadHoldingRegisters(0, 1, values), TModbusSlaveException);
+    Reply = REPLY_OK;
+    Context->WriteHoldingRegister(2, 0x4242);
+    EXPECT_EQ(0x4242, Registers[2]);
+    EXPECT_EQ(3u, Context->GetTimingStats().Responses);
+}
+
+TEST_F(TModbusRtuTest, RS485NotSupported)
+{
+    TModbusConnectionSettings settings = Settings();
+    settings.RS485 = true;
+    TModbusRtuContext context(settings);
+    EXPECT_THROW(context.Connect(), TModbusException);
+    EXPECT_FALSE(context.Transport().IsOpen());
+}
@@ -0,0 +1,200 @@
+#include <map>
+#include <chrono>
+#include <iomanip>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <gtest/gtest.h>
+
+#include "testlog.h"
+#include "fake_modbus.h"
+#include "../modbus_tcp_server.h"
+
+class TModbusTCPServerTest: public TLoggedFixture
+{
+protected:
+    void SetUp();
+    void TearDown();
+    void Request(int unit_id, const std::vector<uint8_t>& pdu);
+    int Connect();
+
+    PFakeModbusConnector Connector;
+    PModbusClient ModbusClient;
+    PFakeSlave Slave;
+    PModbusTCPServer Server;
+};
+
+void TModbusTCPServerTest::SetUp()
+{
+    TModbusConnectionSettings settings(TFakeModbusConnector::PORT0, 115200, 'N', 8, 1);
+    Connector = PFakeModbusConnector(new TFakeModbusConnector(*this));
+    ModbusClient = PModbusClient(new TModbusClient(settings, Connector));
+    ModbusClient->SetCallback([this](std::shared_ptr<TModbusRegister> reg) {
+            Emit() << "Modbus Callback: " << reg->ToString() << " becomes " <<
+                ModbusClient->GetTextValue(reg);
+        });
+    Slave = Connector->AddSlave(TFakeModbusConnector::PORT0, 1,
+                                TRegisterRange(0, 10),
+                                TRegisterRange(10, 20),
+                                TRegisterRange(20, 30),
+                                TRegisterRange(30, 40));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::COIL, 0));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::COIL, 1));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 20));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 21,
+                                                                TModbusRegister::U32));
+    ModbusClient->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::INPUT_REGISTER, 30));
+
+    // unit 5 maps to slave 1
+    Server = PModbusTCPServer(new TModbusTCPServer("127.0.0.1", 0));
+    Server->AddUnit(5, ModbusClient, 1);
+}
+
+void TModbusTCPServerTest::TearDown()
+{
+    Server.reset();
+    ModbusClient.reset();
+    Connector.reset();
+    TLoggedFixture::TearDown();
+}
+
+void TModbusTCPServerTest::Request(int unit_id, const std::vector<uint8_t>& pdu)
+{
+    std::stringstream s;
+    s << "unit " << unit_id << ":" << std::hex << std::setfill('0');
+    for (auto b: pdu)
+        s << " " << std::setw(2) << (int)b;
+    s << " ->";
+    for (auto b: Server->HandleRequest(unit_id, pdu))
+        s << " " << std::setw(2) << (int)b;
+    Emit() << s.str();
+}
+
+int TModbusTCPServerTest::Connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    EXPECT_GE(fd, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Server->GetPort());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXPECT_EQ(0, connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+    return fd;
+}
+
+TEST_F(TModbusTCPServerTest, Requests)
+{
+    Note() << "before the first poll";
+    Request(5, { 0x03, 0x00, 20, 0x00, 0x01 });
+
+    Slave->Coils[1] = 1;
+    Slave->Holding[20] = 0x1234;
+    Slave->Holding[21] = 0xdead;
+    Slave->Holding[22] = 0xbeef;
+    Slave->Input[30] = 42;
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+
+    Note() << "reads";
+    Request(5, { 0x01, 0x00, 0x00, 0x00, 0x02 });
+    Request(5, { 0x03, 0x00, 20, 0x00, 0x03 });
+    Request(5, { 0x03, 0x00, 22, 0x00, 0x01 });
+    Request(5, { 0x04, 0x00, 30, 0x00, 0x01 });
+
+    Note() << "errors";
+    Request(5, { 0x03, 0x00, 20, 0x00, 0x04 });
+    Request(5, { 0x02, 0x00, 10, 0x00, 0x01 });
+    Request(5, { 0x06, 0x00, 30, 0x00, 0x01 });
+    Request(5, { 0x2b, 0x0e, 0x01, 0x00 });
+    Request(6, { 0x03, 0x00, 20, 0x00, 0x01 });
+
+    Note() << "writes";
+    Request(5, { 0x05, 0x00, 0x00, 0xff, 0x00 });
+    Request(5, { 0x10, 0x00, 20, 0x00, 0x02, 0x04, 0x00, 0x07, 0x00, 0x01 });
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+    EXPECT_EQ(1, Slave->Coils[0]);
+    EXPECT_EQ(7, Slave->Holding[20]);
+    EXPECT_EQ(1, Slave->Holding[21]);
+    EXPECT_EQ(0xbeef, Slave->Holding[22]);
+}
+
+TEST_F(TModbusTCPServerTest, Socket)
+{
+    Slave->Holding[20] = 0x1234;
+    ModbusClient->Cycle();
+    Server->Start();
+    int fd = Connect();
+
+    // two requests in one segment
+    uint8_t request[] = {
+        0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x05, 0x03, 0x00, 20, 0x00, 0x01,
+        0x00, 0x02, 0x00, 0x00, 0x00, 0x06, 0x07, 0x03, 0x00, 20, 0x00, 0x01
+    };
+    ASSERT_EQ((ssize_t)sizeof(request), write(fd, request, sizeof(request)));
+
+    std::vector<uint8_t> expected = {
+        0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x05, 0x03, 0x02, 0x12, 0x34,
+        0x00, 0x02, 0x00, 0x00, 0x00, 0x03, 0x07, 0x83, 0x0a
+    };
+    std::vector<uint8_t> response;
+    while (response.size() < expected.size()) {
+        uint8_t buf[256];
+        int n = read(fd, buf, sizeof(buf));
+        ASSERT_GT(n, 0);
+        response.insert(response.end(), buf, buf + n);
+    }
+    EXPECT_EQ(expected, response);
+    close(fd);
+}
+
+TEST_F(TModbusTCPServerTest, SlowClient)
+{
+    Slave->Holding[20] = 0x1234;
+    ModbusClient->Cycle();
+    Server->Start();
+
+    // a client that sends requests and doesn't read the responses
+    // must not hold up the other ones
+    int slow_fd = Connect();
+    fcntl(slow_fd, F_SETFL, O_NONBLOCK);
+    uint8_t request[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x05, 0x03, 0x00, 20, 0x00, 0x01 };
+    // until the server stops reading them
+    struct pollfd slow_pfd = { slow_fd, POLLOUT, 0 };
+    while (poll(&slow_pfd, 1, 500) == 1)
+        ASSERT_LT(0, write(slow_fd, request, sizeof(request)));
+
+    int fd = Connect();
+    ASSERT_EQ((ssize_t)sizeof(request), write(fd, request, sizeof(request)));
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ASSERT_EQ(1, poll(&pfd, 1, 5000));
+    uint8_t buf[256];
+    EXPECT_EQ(11, read(fd, buf, sizeof(buf)));
+    close(fd);
+    close(slow_fd);
+}
+
+TEST_F(TModbusTCPServerTest, WriteTime)
+{
+    std::map<std::string, long long> read_times;
+    ModbusClient->SetCallback([&](std::shared_ptr<TModbusRegister> reg) {
+            // the first report, later polls replace the time
+            read_times.insert(std::make_pair(reg->ToString(),
+                                             ModbusClient->GetReadTime(reg).time_since_epoch().count()));
+        });
+
+    // the value comes from the write, not from the bus, so it's
+    // published with the time of the write instead of no time at all
+    auto start = std::chrono::system_clock::now().time_since_epoch().count();
+    Request(5, { 0x05, 0x00, 0x00, 0xff, 0x00 });
+    auto end = std::chrono::system_clock::now().time_since_epoch().count();
+    EXPECT_TRUE(read_times.empty());
+    ModbusClient->Cycle();
+    ASSERT_EQ(1u, read_times.count("<1:coil: 0>"));
+    EXPECT_LE(start, read_times["<1:coil: 0>"]);
+    EXPECT_GE(end, read_times["<1:coil: 0>"]);
+}
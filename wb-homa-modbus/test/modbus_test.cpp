@@ -2,6 +2,8 @@
 #include <memory>
 #include <algorithm>
 #include <cassert>
+#include <limits>
+#include <unistd.h>
 #include <gtest/gtest.h>
 
 #include "testlog.h"
@@ -466,6 +468,241 @@ TEST_F(TModbusClientTest, ReadErrors)
     ModbusClient->Cycle();
 }
 
+TEST_F(TModbusClientTest, UnavailableRegister)
+{
+    std::shared_ptr<TModbusRegister> holding20(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 20));
+    std::shared_ptr<TModbusRegister> holding200(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 200));
+    ModbusClient->AddRegister(holding20);
+    ModbusClient->AddRegister(holding200);
+
+    // the register is no longer polled after
+    // TRegisterHandler::UnavailableThreshold illegal data address responses
+    for (int i = 0; i < 5; ++i) {
+        Note() << "Cycle()";
+        ModbusClient->Cycle();
+    }
+}
+
+TEST_F(TModbusClientTest, ErrorLog)
+{
+    std::stringstream out;
+    TModbusErrorLog log(TModbusErrorLog::DefaultIntervalMs, out);
+    TModbusRegister holding20(1, TModbusRegister::HOLDING_REGISTER, 20);
+    TModbusRegister coil0(2, TModbusRegister::COIL, 0);
+    holding20.Index = 0;
+    coil0.Index = 1;
+
+    // nothing to report before the first error
+    log.Recovered(holding20, false);
+    // only the first one of the same errors is reported
+    for (int i = 0; i < 3; ++i)
+        log.Error(holding20, false, TModbusContext::TIMEOUT);
+    // writes and other registers are tracked separately
+    log.Error(holding20, true, TModbusContext::SLAVE_EXCEPTION,
+              TModbusSlaveException::ILLEGAL_DATA_VALUE);
+    log.Error(coil0, false, TModbusContext::BAD_RESPONSE);
+    // a different error is reported along with the suppressed count
+    log.Error(holding20, false, TModbusContext::IO_ERROR);
+    log.Recovered(holding20, false);
+    log.Recovered(holding20, false);
+
+    // repeated errors are summarized once per interval
+    log.SetInterval(0);
+    log.Error(coil0, false, TModbusContext::BAD_RESPONSE);
+    log.Recovered(coil0, false);
+
+    log.Unavailable(holding20, 300000);
+    log.Available(holding20);
+
+    std::string line;
+    while (std::getline(out, line))
+        Emit() << line;
+}
+
+TEST_F(TModbusClientTest, BackgroundPoll)
+{
+    Connector->AddSlave(TFakeModbusConnector::PORT0, 2,
+                        TRegisterRange(), TRegisterRange(),
+                        TRegisterRange(20, 30), TRegisterRange());
+    std::shared_ptr<TModbusRegister> holding20(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 20));
+    std::shared_ptr<TModbusRegister> holding20_2(new TModbusRegister(2, TModbusRegister::HOLDING_REGISTER, 20));
+    ModbusClient->AddRegister(holding20);
+    ModbusClient->AddRegister(holding20_2);
+    ModbusClient->SetBackgroundPollInterval(2 * TModbusClient::MaxInterestDurationMs);
+    auto now = std::chrono::steady_clock::now();
+    ModbusClient->SetClock([&now]() { return now; });
+
+    Note() << "Cycle() (first poll)";
+    ModbusClient->Cycle();
+    Note() << "Cycle() (nothing to poll)";
+    ModbusClient->Cycle();
+
+    ModbusClient->SetInterest(2, 200);
+    Note() << "Cycle() (interest in slave 2)";
+    ModbusClient->Cycle();
+
+    ModbusClient->SetTextValue(holding20, "42");
+    Note() << "Cycle() (write to slave 1)";
+    ModbusClient->Cycle();
+    EXPECT_EQ(42, Slave->Holding[20]);
+
+    now += std::chrono::milliseconds(300);
+    Note() << "Cycle() (interest expired)";
+    ModbusClient->Cycle();
+
+    // out of range durations are clamped
+    ModbusClient->SetInterest(2, -1000);
+    Note() << "Cycle() (negative interest)";
+    ModbusClient->Cycle();
+
+    ModbusClient->SetInterest(2, std::numeric_limits<int>::max());
+    now += std::chrono::milliseconds(TModbusClient::MaxInterestDurationMs - 1);
+    Note() << "Cycle() (interest in slave 2 until the maximum duration)";
+    ModbusClient->Cycle();
+    now += std::chrono::milliseconds(1);
+    Note() << "Cycle() (maximum interest expired)";
+    ModbusClient->Cycle();
+}
+
+TEST_F(TModbusClientTest, Broadcast)
+{
+    PFakeSlave slave2 = Connector->AddSlave(TFakeModbusConnector::PORT0, 2, TRegisterRange(0, 10));
+    PFakeSlave broadcast = Connector->AddSlave(TFakeModbusConnector::PORT0, 0, TRegisterRange(0, 10));
+    std::shared_ptr<TModbusRegister> coil1(new TModbusRegister(1, TModbusRegister::COIL, 1));
+    std::shared_ptr<TModbusRegister> coil1_2(new TModbusRegister(2, TModbusRegister::COIL, 1));
+    std::shared_ptr<TModbusRegister> coil1_all(new TModbusRegister(0, TModbusRegister::COIL, 1,
+                                                                   TModbusRegister::U16, 1, false));
+    ModbusClient->AddRegister(coil1);
+    ModbusClient->AddRegister(coil1_2);
+    ModbusClient->AddRegister(coil1_all);
+    ModbusClient->SetBroadcastMembers(coil1_all, { coil1, coil1_2 });
+
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+
+    // the fake bus doesn't deliver broadcasts, so only slave 2
+    // "receives" it and slave 1 gets corrected by the verification poll
+    slave2->Coils[1] = 1;
+    ModbusClient->SetTextValue(coil1_all, "1");
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+
+    EXPECT_EQ(1, broadcast->Coils[1]);
+    EXPECT_EQ(to_string(0), ModbusClient->GetTextValue(coil1));
+    EXPECT_EQ(to_string(1), ModbusClient->GetTextValue(coil1_2));
+}
+
+TEST_F(TModbusClientTest, PortRecovery)
+{
+    std::shared_ptr<TModbusRegister> holding20(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 20));
+    std::shared_ptr<TModbusRegister> holding21(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 21));
+    std::shared_ptr<TModbusRegister> holding22(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 22));
+    ModbusClient->AddRegister(holding20);
+    ModbusClient->AddRegister(holding21);
+    ModbusClient->AddRegister(holding22);
+    PFakeModbusContext context = Connector->GetContext(TFakeModbusConnector::PORT0);
+    auto wait_reopen = []() {
+        usleep((TModbusClient::MinReopenDelayMs + 100) * 1000);
+    };
+
+    // the port may be missing at startup
+    context->SetUnplugged(true);
+    Note() << "Cycle() (unplugged)";
+    ModbusClient->Cycle();
+    context->SetUnplugged(false);
+    Note() << "Cycle() (reopen delay)";
+    ModbusClient->Cycle();
+    wait_reopen();
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+
+    Slave->Holding[20] = 42;
+    context->SetUnplugged(true);
+    Note() << "Cycle() (unplugged)";
+    ModbusClient->Cycle();
+    Note() << "Cycle() (closed)";
+    ModbusClient->Cycle();
+
+    // the values are kept, so only the changed one is published
+    context->SetUnplugged(false);
+    Slave->Holding[21] = 4242;
+    wait_reopen();
+    Note() << "Cycle() (reopened)";
+    ModbusClient->Cycle();
+    EXPECT_EQ(to_string(42), ModbusClient->GetTextValue(holding20));
+}
+
+TEST_F(TModbusClientTest, ReadTime)
+{
+    std::shared_ptr<TModbusRegister> holding20(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 20));
+    std::shared_ptr<TModbusRegister> holding200(new TModbusRegister(1, TModbusRegister::HOLDING_REGISTER, 200));
+    ModbusClient->AddRegister(holding20);
+    ModbusClient->AddRegister(holding200);
+    EXPECT_EQ(0, ModbusClient->GetReadTime(holding20).time_since_epoch().count());
+
+    auto start = std::chrono::system_clock::now();
+    Note() << "Cycle()";
+    ModbusClient->Cycle();
+    auto read_time = ModbusClient->GetReadTime(holding20);
+    EXPECT_LE(start, read_time);
+    EXPECT_GE(std::chrono::system_clock::now(), read_time);
+    // failed reads don't touch it
+    EXPECT_EQ(0, ModbusClient->GetReadTime(holding200).time_since_epoch().count());
+}
+
+TEST(TResponseTimeEstimatorTest, AdaptiveTimeout)
+{
+    TResponseTimeEstimator estimator(500000);
+    // unknown slaves use the configured timeout
+    EXPECT_EQ(500000, estimator.GetTimeoutUs(1));
+
+    for (int i = 0; i < 50; ++i)
+        estimator.AddSample(1, 20000);
+    EXPECT_NEAR(20000, estimator.GetTimeoutUs(1), 1000);
+    EXPECT_EQ(500000, estimator.GetTimeoutUs(2));
+
+    // jitter widens the timeout
+    for (int i = 0; i < 50; ++i)
+        estimator.AddSample(1, i % 2 ? 10000 : 30000);
+    EXPECT_GT(estimator.GetTimeoutUs(1), 50000);
+
+    // timeouts double the value up to the cap
+    int timeout = estimator.GetTimeoutUs(1);
+    estimator.AddTimeout(1);
+    EXPECT_EQ(std::min(500000, timeout * 2), estimator.GetTimeoutUs(1));
+    for (int i = 0; i < 10; ++i)
+        estimator.AddTimeout(1);
+    EXPECT_EQ(500000, estimator.GetTimeoutUs(1));
+
+    // the first successful response drops the backoff
+    estimator.AddSample(1, 20000);
+    EXPECT_LT(estimator.GetTimeoutUs(1), 500000);
+
+    // fast devices are not given unreasonably small timeouts
+    for (int i = 0; i < 50; ++i)
+        estimator.AddSample(3, 100);
+    EXPECT_EQ(TResponseTimeEstimator::DefaultMinTimeoutUs, estimator.GetTimeoutUs(3));
+}
+
+TEST(TResponseTimeEstimatorTest, RepeatedTimeouts)
+{
+    TResponseTimeEstimator estimator(std::numeric_limits<int>::max());
+    estimator.AddSample(1, 1000000);
+    // a dead slave keeps timing out, the value must saturate, not wrap
+    int prev = estimator.GetTimeoutUs(1);
+    for (int i = 0; i < 100; ++i) {
+        estimator.AddTimeout(1);
+        int timeout = estimator.GetTimeoutUs(1);
+        EXPECT_GE(timeout, prev);
+        prev = timeout;
+    }
+    EXPECT_EQ(std::numeric_limits<int>::max(), prev);
+
+    // a single response still brings it back
+    estimator.AddSample(1, 1000000);
+    EXPECT_LT(estimator.GetTimeoutUs(1), 10000000);
+}
+
 class TConfigParserTest: public TLoggedFixture {};
 
 TEST_F(TConfigParserTest, Parse)
@@ -541,6 +778,30 @@ TEST_F(TConfigParserTest, ForceDebug)
     ASSERT_TRUE(config->Debug);
 }
 
+TEST_F(TConfigParserTest, SlaveIdRange)
+{
+    TConfigParser parser(GetDataFilePath("../config-test.json"), false);
+    Json::Value device_data;
+    device_data["slave_id"] = 0x011c;
+
+    PPortConfig modbus_port(new TPortConfig);
+    EXPECT_THROW(parser.LoadDevice(modbus_port, device_data, "dev"), TConfigParserException);
+    device_data["slave_id"] = -1;
+    EXPECT_THROW(parser.LoadDevice(modbus_port, device_data, "dev"), TConfigParserException);
+    device_data["slave_id"] = 247;
+    parser.LoadDevice(modbus_port, device_data, "dev");
+    EXPECT_EQ(1u, modbus_port->DeviceConfigs.size());
+
+    PPortConfig smartbus_port(new TPortConfig);
+    smartbus_port->Type = "smartbus";
+    device_data["slave_id"] = 0x011c;
+    parser.LoadDevice(smartbus_port, device_data, "dev");
+    ASSERT_EQ(1u, smartbus_port->DeviceConfigs.size());
+    EXPECT_EQ(0x011c, smartbus_port->DeviceConfigs[0]->SlaveId);
+    device_data["slave_id"] = 0x10000;
+    EXPECT_THROW(parser.LoadDevice(smartbus_port, device_data, "dev"), TConfigParserException);
+}
+
 class TModbusDeviceTest: public TLoggedFixture
 {
 protected:
@@ -644,4 +905,56 @@ TEST_F(TModbusDeviceTest, OnValue)
     modbus_observer->ModbusLoopOnce();
 
 }
+TEST_F(TModbusDeviceTest, Reconnect)
+{
+    FilterConfig("DDL24");
+    Connector->AddSlave(TFakeModbusConnector::PORT0,
+                        Config->PortConfigs[0]->DeviceConfigs[0]->SlaveId,
+                        TRegisterRange(),
+                        TRegisterRange(),
+                        TRegisterRange(4, 19),
+                        TRegisterRange());
+
+    PMQTTModbusObserver modbus_observer(new TMQTTModbusObserver(MQTTClient, Config, Connector));
+    modbus_observer->SetUp();
+
+    // the session is clean and the broker may have lost
+    // the retained meta, so everything is published again
+    MQTTClient->Disconnect();
+    MQTTClient->Connect();
+
+    MQTTClient->DoPublish(true, 0, "/devices/ddl24/controls/White/on", "42");
+    Note() << "ModbusLoopOnce()";
+    modbus_observer->ModbusLoopOnce();
+}
+
+TEST_F(TModbusDeviceTest, DeviceValues)
+{
+    FilterConfig("DDL24");
+    Config->PortConfigs[0]->PublishChannelValues = false;
+    Config->PortConfigs[0]->PublishDeviceValues = true;
+    PFakeSlave slave = Connector->AddSlave(TFakeModbusConnector::PORT0,
+                                           Config->PortConfigs[0]->DeviceConfigs[0]->SlaveId,
+                                           TRegisterRange(),
+                                           TRegisterRange(),
+                                           TRegisterRange(4, 19),
+                                           TRegisterRange());
+
+    PMQTTModbusObserver modbus_observer(new TMQTTModbusObserver(MQTTClient, Config, Connector));
+    modbus_observer->SetUp();
+
+    // all the values go in a single message
+    Note() << "ModbusLoopOnce()";
+    modbus_observer->ModbusLoopOnce();
+
+    // only the changed ones after that
+    MQTTClient->DoPublish(true, 0, "/devices/ddl24/controls/White/on", "42");
+    slave->Holding[8] = 50;
+    Note() << "ModbusLoopOnce()";
+    modbus_observer->ModbusLoopOnce();
+
+    Note() << "ModbusLoopOnce() (no changes)";
+    modbus_observer->ModbusLoopOnce();
+}
+
 // TBD: the code must check mosquitto return values
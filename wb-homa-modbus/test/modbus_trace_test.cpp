@@ -0,0 +1,159 @@
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "testlog.h"
+#include "fake_modbus.h"
+#include "../modbus_trace.h"
+
+namespace {
+    class TInterruptCountingContext: public TModbusStatusContext
+    {
+    public:
+        void Connect() {}
+        void Disconnect() {}
+        void SetDebug(bool) {}
+        void SetSlave(int) {}
+        void USleep(int) {}
+        void Interrupt() { ++Interrupts; }
+        TStatus Execute(uint8_t, int, int, uint16_t*, int&) { return OK; }
+
+        int Interrupts = 0;
+    };
+}
+
+class TModbusTraceTest: public TLoggedFixture
+{
+protected:
+    void SetUp();
+    void TearDown();
+    PModbusClient CreateClient(PModbusConnector connector);
+    void Run(PModbusClient client);
+    void DumpTrace();
+
+    std::string TracePath;
+    PFakeModbusConnector Connector;
+    PFakeSlave Slave;
+};
+
+void TModbusTraceTest::SetUp()
+{
+    TracePath = "/tmp/wb-homa-modbus-trace-test-" + std::to_string(getpid());
+    Connector = PFakeModbusConnector(new TFakeModbusConnector(*this));
+    Slave = Connector->AddSlave(TFakeModbusConnector::PORT0, 1,
+                                TRegisterRange(0, 10),
+                                TRegisterRange(10, 20),
+                                TRegisterRange(20, 30),
+                                TRegisterRange(30, 40));
+}
+
+void TModbusTraceTest::TearDown()
+{
+    unlink(TracePath.c_str());
+    Connector.reset();
+    TLoggedFixture::TearDown();
+}
+
+PModbusClient TModbusTraceTest::CreateClient(PModbusConnector connector)
+{
+    TModbusConnectionSettings settings(TFakeModbusConnector::PORT0, 115200, 'N', 8, 1);
+    PModbusClient client(new TModbusClient(settings, connector));
+    TModbusClient* c = client.get();
+    client->SetCallback([this, c](std::shared_ptr<TModbusRegister> reg) {
+            Emit() << "Modbus Callback: " << reg->ToString() << " becomes " <<
+                c->GetTextValue(reg);
+        });
+    client->SetErrorCallback([this](std::shared_ptr<TModbusRegister> reg) {
+            Emit() << "Modbus ErrorCallback: " << reg->ToString();
+        });
+    return client;
+}
+
+// The same sequence of polls and writes is used for
+// recording and replaying the trace
+void TModbusTraceTest::Run(PModbusClient client)
+{
+    auto holding20 = std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 20);
+    client->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::COIL, 0));
+    client->AddRegister(holding20);
+    client->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::INPUT_REGISTER, 30,
+                                                          TModbusRegister::S32));
+    client->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 40));
+
+    Note() << "Cycle()";
+    client->Cycle();
+
+    Slave->Coils[0] = 1;
+    Slave->Input[30] = 0xffff;
+    Slave->Input[31] = 0xfffe;
+    client->SetTextValue(holding20, "4242");
+    Note() << "Cycle()";
+    client->Cycle();
+}
+
+void TModbusTraceTest::DumpTrace()
+{
+    for (const auto& record: ReadTrace(TracePath)) {
+        Emit() << record.ToString() << " -> status " << (int)record.Status <<
+            ", " << record.Response.size() << " byte(s)";
+    }
+}
+
+TEST_F(TModbusTraceTest, RecordReplay)
+{
+    Note() << "record";
+    Run(CreateClient(PModbusConnector(new TModbusRecordingConnector(Connector, TracePath))));
+    DumpTrace();
+
+    // the fake slave doesn't take part in the replay, so only
+    // the callbacks are logged. They must be the same as above.
+    Note() << "replay";
+    PModbusClient client = CreateClient(PModbusConnector(new TModbusReplayConnector(TracePath, 0)));
+    Run(client);
+
+    Note() << "Cycle() (end of trace)";
+    client->Cycle();
+}
+
+TEST_F(TModbusTraceTest, Mismatch)
+{
+    PModbusClient client = CreateClient(PModbusConnector(new TModbusRecordingConnector(Connector, TracePath)));
+    client->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 20));
+    client->AddRegister(std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 21));
+    client->Cycle();
+    client.reset();
+
+    Note() << "replay in another order";
+    TModbusReplayContext context(TracePath, 0);
+    uint16_t value;
+    try {
+        context.SetSlave(1);
+        context.ReadHoldingRegisters(21, 1, &value);
+    } catch (const TModbusException& e) {
+        Emit() << e.what();
+    }
+    EXPECT_EQ(1, context.Mismatches());
+    EXPECT_EQ(2, context.Remaining());
+
+    context.ReadHoldingRegisters(20, 1, &value);
+    context.ReadHoldingRegisters(21, 1, &value);
+    EXPECT_EQ(0, context.Remaining());
+}
+
+TEST_F(TModbusTraceTest, BadFile)
+{
+    try {
+        TModbusReplayContext context("/nonexistent/trace", 0);
+        ADD_FAILURE() << "no exception";
+    } catch (const TModbusException& e) {
+        Emit() << e.what();
+    }
+}
+
+TEST_F(TModbusTraceTest, Interrupt)
+{
+    // the polling loop must still be woken up while recording
+    auto context = std::make_shared<TInterruptCountingContext>();
+    TModbusRecordingContext recording(context, TracePath);
+    recording.Interrupt();
+    EXPECT_EQ(1, context->Interrupts);
+}
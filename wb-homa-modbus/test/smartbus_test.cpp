@@ -0,0 +1,261 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "../smartbus_context.h"
+
+namespace {
+    const int Slave = 0x011c;
+
+    std::vector<uint8_t> MakeFrame(uint8_t src_subnet, uint8_t src_device, uint16_t opcode,
+                                   uint8_t dst_subnet, uint8_t dst_device,
+                                   const std::vector<uint8_t>& content)
+    {
+        std::vector<uint8_t> frame = {
+            0xaa, 0xaa, uint8_t(11 + content.size()), src_subnet, src_device, 0x00, 0x01,
+            uint8_t(opcode >> 8), uint8_t(opcode), dst_subnet, dst_device
+        };
+        frame.insert(frame.end(), content.begin(), content.end());
+        uint16_t crc = TSmartBus::CRC16(&frame[2], frame.size() - 2);
+        frame.push_back(crc >> 8);
+        frame.push_back(crc & 0xff);
+        return frame;
+    }
+}
+
+// Emulates a SmartBus device on the master side of a pty pair.
+// The bus blocks while waiting for responses, so the device is
+// served by a separate thread.
+class TSmartBusTest: public ::testing::Test
+{
+protected:
+    struct TRequest {
+        uint16_t Opcode;
+        int Slave;
+        std::vector<uint8_t> Content;
+    };
+
+    void SetUp();
+    void TearDown();
+    void CreateContext(bool read_status);
+    void Serve();
+    void HandleFrame(const std::vector<uint8_t>& frame);
+    std::vector<TRequest> Requests();
+
+    int MasterFd = -1;
+    std::unique_ptr<TSmartBusModbusContext> Context;
+    std::thread Device;
+    std::atomic<bool> Stop;
+    std::atomic<bool> Reply;
+    // send a frame of another device before each response
+    std::atomic<bool> Noise;
+    std::mutex Mutex;
+    std::vector<TRequest> ReceivedRequests;
+    std::vector<uint8_t> Levels = { 0, 100, 0, 50 };
+};
+
+void TSmartBusTest::SetUp()
+{
+    Stop = false;
+    Reply = true;
+    Noise = false;
+    MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(MasterFd, 0);
+    ASSERT_EQ(0, grantpt(MasterFd));
+    ASSERT_EQ(0, unlockpt(MasterFd));
+    fcntl(MasterFd, F_SETFL, fcntl(MasterFd, F_GETFL) | O_NONBLOCK);
+    CreateContext(true);
+    Device = std::thread([this]() { Serve(); });
+}
+
+void TSmartBusTest::TearDown()
+{
+    Stop = true;
+    if (Device.joinable())
+        Device.join();
+    Context.reset();
+    if (MasterFd >= 0)
+        close(MasterFd);
+}
+
+void TSmartBusTest::CreateContext(bool read_status)
+{
+    TModbusConnectionSettings settings(ptsname(MasterFd), 115200, 'N', 8, 1);
+    Context.reset(new TSmartBusModbusContext(settings, 100, read_status));
+    Context->Connect();
+    Context->SetSlave(Slave);
+}
+
+void TSmartBusTest::Serve()
+{
+    std::vector<uint8_t> buf;
+    while (!Stop) {
+        struct pollfd pfd = { MasterFd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+        uint8_t data[256];
+        int n = read(MasterFd, data, sizeof(data));
+        if (n <= 0)
+            continue;
+        buf.insert(buf.end(), data, data + n);
+        while (buf.size() >= 3 && buf.size() >= size_t(buf[2]) + 2) {
+            size_t size = buf[2] + 2;
+            HandleFrame(std::vector<uint8_t>(buf.begin(), buf.begin() + size));
+            buf.erase(buf.begin(), buf.begin() + size);
+        }
+    }
+}
+
+void TSmartBusTest::HandleFrame(const std::vector<uint8_t>& frame)
+{
+    ASSERT_EQ(0xaa, frame[0]);
+    ASSERT_EQ(0xaa, frame[1]);
+    uint16_t crc = (frame[frame.size() - 2] << 8) | frame.back();
+    ASSERT_EQ(crc, TSmartBus::CRC16(&frame[2], frame.size() - 4));
+
+    TRequest request;
+    request.Opcode = (frame[7] << 8) | frame[8];
+    request.Slave = (frame[9] << 8) | frame[10];
+    request.Content.assign(frame.begin() + 11, frame.end() - 2);
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        ReceivedRequests.push_back(request);
+    }
+    if (!Reply || request.Slave != Slave)
+        return;
+
+    std::vector<uint8_t> response;
+    if (Noise) {
+        // a status response of another device to another master
+        response = MakeFrame(0x01, 0x30, 0x0034, 0x01, 0x50, { 2, 100, 100 });
+        // followed by some garbage
+        response.push_back(0x55);
+    }
+    std::vector<uint8_t> content;
+    uint16_t opcode = 0;
+    if (request.Opcode == 0x0033) {
+        opcode = 0x0034;
+        content.push_back(Levels.size());
+    } else if (request.Opcode == 0x0031) {
+        ASSERT_EQ(4u, request.Content.size());
+        uint8_t channel = request.Content[0];
+        opcode = 0x0032;
+        Levels[channel - 1] = request.Content[1];
+        content = { channel, 0xf8, uint8_t(Levels.size()) };
+    } else
+        FAIL() << "unexpected opcode " << request.Opcode;
+    content.insert(content.end(), Levels.begin(), Levels.end());
+    std::vector<uint8_t> frame_out = MakeFrame(Slave >> 8, Slave & 0xff, opcode,
+                                               TSmartBus::SourceSubnet, TSmartBus::SourceDevice,
+                                               content);
+    response.insert(response.end(), frame_out.begin(), frame_out.end());
+    ASSERT_EQ(int(response.size()), write(MasterFd, response.data(), response.size()));
+}
+
+std::vector<TSmartBusTest::TRequest> TSmartBusTest::Requests()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::vector<TRequest> requests;
+    requests.swap(ReceivedRequests);
+    return requests;
+}
+
+TEST(TSmartBusCRCTest, CRC16)
+{
+    // switch channel 15 of device 1/0x1c on, as sent by smartbus.py
+    std::vector<uint8_t> frame = {
+        0x0f, 0x01, 0x14, 0x00, 0x95, 0x00, 0x31, 0x01, 0x1c, 0x0f, 0x64, 0x00, 0x00
+    };
+    EXPECT_EQ(0xe5a5, TSmartBus::CRC16(frame.data(), frame.size()));
+    // status request to the same device
+    frame = { 0x0b, 0x01, 0x14, 0x00, 0x95, 0x00, 0x33, 0x01, 0x1c };
+    EXPECT_EQ(0xcc71, TSmartBus::CRC16(frame.data(), frame.size()));
+}
+
+TEST_F(TSmartBusTest, ReadStatusOncePerCycle)
+{
+    for (int cycle = 0; cycle < 2; ++cycle) {
+        for (int channel = 1; channel <= 4; ++channel) {
+            uint8_t value = 0xff;
+            Context->ReadCoils(channel, 1, &value);
+            EXPECT_EQ(Levels[channel - 1] ? 1 : 0, value);
+        }
+        uint16_t level = 0;
+        // the levels come from the same status response
+        Context->ReadHoldingRegisters(4, 1, &level);
+        EXPECT_EQ(50, level);
+    }
+
+    // channel 1 is read again on each cycle, channel 4 is read again
+    // as a holding register
+    std::vector<TRequest> requests = Requests();
+    ASSERT_EQ(4u, requests.size());
+    for (const auto& request: requests) {
+        EXPECT_EQ(0x0033, request.Opcode);
+        EXPECT_EQ(Slave, request.Slave);
+        EXPECT_TRUE(request.Content.empty());
+    }
+}
+
+TEST_F(TSmartBusTest, Write)
+{
+    Context->WriteCoil(3, 1);
+    Context->WriteHoldingRegister(2, 30);
+    std::vector<TRequest> requests = Requests();
+    ASSERT_EQ(2u, requests.size());
+    EXPECT_EQ(0x0031, requests[0].Opcode);
+    EXPECT_EQ(std::vector<uint8_t>({ 3, 100, 0, 0 }), requests[0].Content);
+    EXPECT_EQ(0x0031, requests[1].Opcode);
+    EXPECT_EQ(std::vector<uint8_t>({ 2, 30, 0, 0 }), requests[1].Content);
+
+    uint8_t values[4];
+    Context->ReadCoils(1, 4, values);
+    EXPECT_EQ(std::vector<uint8_t>({ 0, 1, 1, 1 }), std::vector<uint8_t>(values, values + 4));
+    EXPECT_THROW(Context->WriteHoldingRegister(1, 101), TModbusException);
+}
+
+TEST_F(TSmartBusTest, SkipForeignFrames)
+{
+    Noise = true;
+    uint16_t levels[4];
+    Context->ReadHoldingRegisters(1, 4, levels);
+    EXPECT_EQ(std::vector<uint16_t>({ 0, 100, 0, 50 }), std::vector<uint16_t>(levels, levels + 4));
+    Context->WriteCoil(1, 1);
+    EXPECT_EQ(100, Levels[0]);
+}
+
+TEST_F(TSmartBusTest, Errors)
+{
+    Reply = false;
+    uint8_t value;
+    EXPECT_THROW(Context->ReadCoils(1, 1, &value), TModbusException);
+    EXPECT_THROW(Context->WriteCoil(1, 1), TModbusException);
+
+    Reply = true;
+    EXPECT_THROW(Context->ReadCoils(0, 1, &value), TModbusException);
+    EXPECT_THROW(Context->ReadCoils(5, 1, &value), TModbusException);
+    uint16_t reg;
+    EXPECT_THROW(Context->ReadInputRegisters(1, 1, &reg), TModbusException);
+    EXPECT_THROW(Context->ReadDisceteInputs(1, 1, &value), TModbusException);
+}
+
+TEST_F(TSmartBusTest, NoStatusRequests)
+{
+    CreateContext(false);
+    uint8_t values[4];
+    Context->ReadCoils(1, 4, values);
+    EXPECT_EQ(std::vector<uint8_t>({ 0, 0, 0, 0 }), std::vector<uint8_t>(values, values + 4));
+    Context->WriteCoil(4, 0);
+    Context->ReadCoils(1, 4, values);
+    // the levels reported by the control response
+    EXPECT_EQ(std::vector<uint8_t>({ 0, 1, 0, 0 }), std::vector<uint8_t>(values, values + 4));
+
+    std::vector<TRequest> requests = Requests();
+    ASSERT_EQ(1u, requests.size());
+    EXPECT_EQ(0x0031, requests[0].Opcode);
+}
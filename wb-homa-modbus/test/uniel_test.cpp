@@ -0,0 +1,205 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "../uniel_context.h"
+
+// Emulates a Uniel module on the master side of a pty pair.
+// Brightness written via 0x0A to WW is read back from WW + 0x40.
+class TUnielContextTest: public ::testing::Test
+{
+protected:
+    struct TCommand {
+        uint8_t Cmd;
+        uint8_t Address;
+        uint8_t Value;
+    };
+
+    void SetUp();
+    void TearDown();
+    void Serve();
+    void HandleCommand(const uint8_t* buf);
+    std::vector<TCommand> Commands();
+
+    int MasterFd = -1;
+    std::unique_ptr<TUnielModbusContext> Context;
+    std::thread Module;
+    std::atomic<bool> Stop;
+    // the module ignores all the commands while set
+    std::atomic<bool> Silent;
+    std::mutex Mutex;
+    std::vector<TCommand> ReceivedCommands;
+    uint8_t Registers[256];
+};
+
+void TUnielContextTest::SetUp()
+{
+    Stop = false;
+    Silent = false;
+    memset(Registers, 0, sizeof(Registers));
+    MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(MasterFd, 0);
+    ASSERT_EQ(0, grantpt(MasterFd));
+    ASSERT_EQ(0, unlockpt(MasterFd));
+    fcntl(MasterFd, F_SETFL, fcntl(MasterFd, F_GETFL) | O_NONBLOCK);
+    Context.reset(new TUnielModbusContext(ptsname(MasterFd), 100));
+    Context->Connect();
+    Context->SetSlave(1);
+    Module = std::thread([this]() { Serve(); });
+}
+
+void TUnielContextTest::TearDown()
+{
+    Stop = true;
+    if (Module.joinable())
+        Module.join();
+    Context.reset();
+    if (MasterFd >= 0)
+        close(MasterFd);
+}
+
+void TUnielContextTest::Serve()
+{
+    std::vector<uint8_t> buf;
+    while (!Stop) {
+        struct pollfd pfd = { MasterFd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+        uint8_t data[64];
+        int n = read(MasterFd, data, sizeof(data));
+        if (n <= 0)
+            continue;
+        buf.insert(buf.end(), data, data + n);
+        // all the commands are 8 bytes long
+        while (buf.size() >= 8) {
+            if (!Silent)
+                HandleCommand(buf.data());
+            buf.erase(buf.begin(), buf.begin() + 8);
+        }
+    }
+}
+
+void TUnielContextTest::HandleCommand(const uint8_t* buf)
+{
+    ASSERT_EQ(0xff, buf[0]);
+    ASSERT_EQ(0xff, buf[1]);
+    ASSERT_EQ(uint8_t(buf[2] + buf[3] + buf[4] + buf[5] + buf[6]), buf[7]);
+    TCommand command = { buf[2], buf[5], buf[4] };
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        ReceivedCommands.push_back(command);
+    }
+
+    uint8_t read_address = command.Address;
+    if (command.Cmd == 0x06)
+        Registers[read_address] = command.Value;
+    else if (command.Cmd == 0x0a) {
+        read_address += 0x40;
+        Registers[read_address] = command.Value;
+    }
+    uint8_t response[8] = {
+        0xff, 0xff, command.Cmd, 0x00,
+        // the write commands echo the written value
+        command.Cmd == 0x05 ? Registers[read_address] : command.Value, command.Address, 0x00
+    };
+    response[7] = response[2] + response[3] + response[4] + response[5] + response[6];
+    ASSERT_EQ(8, write(MasterFd, response, 8));
+}
+
+std::vector<TUnielContextTest::TCommand> TUnielContextTest::Commands()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::vector<TCommand> commands;
+    commands.swap(ReceivedCommands);
+    return commands;
+}
+
+TEST_F(TUnielContextTest, Cache)
+{
+    Registers[0x1a] = 0x10;
+    uint16_t value = 0;
+    Context->ReadHoldingRegisters(0x1a, 1, &value);
+    EXPECT_EQ(0x10, value);
+    ASSERT_EQ(1u, Commands().size());
+
+    // the poll right after the write is served from the cache
+    Context->WriteHoldingRegister(0x1a, 0x20);
+    Context->ReadHoldingRegisters(0x1a, 1, &value);
+    EXPECT_EQ(0x20, value);
+    std::vector<TCommand> commands = Commands();
+    ASSERT_EQ(1u, commands.size());
+    EXPECT_EQ(0x06, commands[0].Cmd);
+    EXPECT_EQ(0x1a, commands[0].Address);
+    EXPECT_EQ(0x20, commands[0].Value);
+
+    // the next one goes to the bus
+    Registers[0x1a] = 0x30;
+    Context->ReadHoldingRegisters(0x1a, 1, &value);
+    EXPECT_EQ(0x30, value);
+    ASSERT_EQ(1u, Commands().size());
+
+    // the register already holds the value
+    Context->WriteHoldingRegister(0x1a, 0x30);
+    EXPECT_TRUE(Commands().empty());
+
+    // relays
+    Context->WriteCoil(0x1b, 1);
+    Context->WriteCoil(0x1b, 1);
+    uint8_t bit = 0;
+    Context->ReadCoils(0x1b, 1, &bit);
+    EXPECT_EQ(1, bit);
+    commands = Commands();
+    ASSERT_EQ(1u, commands.size());
+    EXPECT_EQ(0xff, commands[0].Value);
+
+    // the cache is dropped on reconnect
+    Context->Disconnect();
+    Context->WriteCoil(0x1b, 1);
+    EXPECT_EQ(1u, Commands().size());
+}
+
+TEST_F(TUnielContextTest, Brightness)
+{
+    Context->WriteHoldingRegister(0x01000141, 0x80);
+    uint16_t value = 0;
+    Context->ReadHoldingRegisters(0x41, 1, &value);
+    EXPECT_EQ(0x80, value);
+    std::vector<TCommand> commands = Commands();
+    ASSERT_EQ(1u, commands.size());
+    EXPECT_EQ(0x0a, commands[0].Cmd);
+    EXPECT_EQ(0x01, commands[0].Address);
+
+    Context->WriteHoldingRegister(0x01000141, 0x80);
+    EXPECT_TRUE(Commands().empty());
+    Context->ReadHoldingRegisters(0x41, 1, &value);
+    EXPECT_EQ(0x80, value);
+    EXPECT_EQ(1u, Commands().size());
+}
+
+TEST_F(TUnielContextTest, SilentModule)
+{
+    TModbusClient client(TModbusConnectionSettings(ptsname(MasterFd), 9600, 'N', 8, 1, 20),
+                         PModbusConnector(new TUnielModbusConnector));
+    auto reg = std::make_shared<TModbusRegister>(1, TModbusRegister::HOLDING_REGISTER, 0x1a);
+    client.AddRegister(reg);
+    client.SetPollInterval(1);
+    client.Connect();
+
+    // timeouts of a module that doesn't respond aren't port failures
+    Silent = true;
+    for (int i = 0; i < 5; ++i)
+        client.Cycle();
+
+    // so the port is still open and the module is polled
+    // right away rather than after the reopen delay
+    Silent = false;
+    Registers[0x1a] = 0x42;
+    client.Cycle();
+    EXPECT_EQ("66", client.GetTextValue(reg));
+}
@@ -119,7 +119,7 @@ uint8_t TUnielBus::ReadByte()
         throw TUnielBusException("select() failed");
 
     if (!r)
-        throw TUnielBusTransientErrorException("timeout");
+        throw TUnielBusTimeoutException("timeout");
 
     uint8_t b;
     if (read(Fd, &b, 1) < 1)
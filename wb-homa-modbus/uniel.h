@@ -21,6 +21,11 @@ public:
     TUnielBusTransientErrorException(std::string message): TUnielBusException(message) {}
 };
 
+class TUnielBusTimeoutException: public TUnielBusTransientErrorException {
+public:
+    TUnielBusTimeoutException(std::string message): TUnielBusTransientErrorException(message) {}
+};
+
 class TUnielBus {
 public:
     static const int DefaultTimeoutMs = 1000;
@@ -1,7 +1,20 @@
 #include <unistd.h>
+#include <iostream>
 
 #include "uniel_context.h"
 
+namespace {
+    enum {
+        READ_COILS = 0x01,
+        READ_DISCRETE_INPUTS = 0x02,
+        READ_HOLDING_REGISTERS = 0x03,
+        READ_INPUT_REGISTERS = 0x04,
+        WRITE_SINGLE_COIL = 0x05,
+        WRITE_SINGLE_REGISTER = 0x06,
+        WRITE_MULTIPLE_REGISTERS = 0x10
+    };
+}
+
 TUnielModbusContext::TUnielModbusContext(const std::string& device, int timeout_ms):
     Bus(device, timeout_ms), SlaveAddr(1) {}
 
@@ -19,6 +32,8 @@ void TUnielModbusContext::Disconnect()
 {
     if (Bus.IsOpen())
         Bus.Close();
+    // the modules may be switched manually while we're away
+    Cache.clear();
 }
 
 void TUnielModbusContext::SetDebug(bool)
@@ -31,92 +46,116 @@ void TUnielModbusContext::SetSlave(int slave_addr)
     SlaveAddr = slave_addr;
 }
 
-void TUnielModbusContext::ReadCoils(int addr, int nb, uint8_t *dest)
+uint8_t TUnielModbusContext::ReadRegister(uint8_t address)
 {
-    try {
-        Connect();
-        for (int i = 0; i < nb; ++i)
-            *dest++ = Bus.ReadRegister(SlaveAddr, addr + i) == 0 ? 0 : 1;
-    } catch (const TUnielBusTransientErrorException& e) {
-        throw TModbusException(e.what());
-    } catch (const TUnielBusException& e) {
-        Disconnect();
-        throw TModbusException(e.what());
+    std::map<uint8_t, TCachedRegister>& registers = Cache[SlaveAddr];
+    auto it = registers.find(address);
+    if (it != registers.end() && it->second.Written) {
+        // skip the poll right after the write, the value
+        // is read from the bus again on the next one
+        it->second.Written = false;
+        return it->second.Value;
     }
+
+    uint8_t value = Bus.ReadRegister(SlaveAddr, address);
+    registers[address] = { value, false };
+    return value;
 }
 
-void TUnielModbusContext::WriteCoil(int addr, int value)
+bool TUnielModbusContext::IsCached(uint8_t address, uint8_t value) const
 {
-    try {
-        Connect();
-        Bus.WriteRegister(SlaveAddr, addr, value ? 0xff : 0);
-    } catch (const TUnielBusTransientErrorException& e) {
-        throw TModbusException(e.what());
-    } catch (const TUnielBusException& e) {
-        Disconnect();
-        throw TModbusException(e.what());
-    }
+    auto module = Cache.find(SlaveAddr);
+    if (module == Cache.end())
+        return false;
+    auto it = module->second.find(address);
+    return it != module->second.end() && it->second.Value == value;
 }
 
-void TUnielModbusContext::ReadDisceteInputs(int addr, int nb, uint8_t *dest)
+void TUnielModbusContext::UpdateCache(uint8_t address, uint8_t value)
 {
-    ReadCoils(addr, nb, dest);
+    Cache[SlaveAddr][address] = { value, true };
 }
 
-void TUnielModbusContext::ReadHoldingRegisters(int addr, int nb, uint16_t *dest)
+bool TUnielModbusContext::WriteRegister(int addr, uint16_t value)
 {
-    try {
-        Connect();
-        for (int i = 0; i < nb; ++i) {
-            // so far, all Uniel address types store register to read
-            // in the low byte
-            *dest++ = Bus.ReadRegister(SlaveAddr, (addr + i) & 0xFF );
-        }
-    } catch (const TUnielBusTransientErrorException& e) {
-        throw TModbusException(e.what());
-    } catch (const TUnielBusException& e) {
-        Disconnect();
-        throw TModbusException(e.what());
-    }
+	if ( (addr >= 0x00) && (addr <= 0xFF) ) {
+		// address is between 0x00 and 0xFF, so treat it as
+		// normal Uniel register (read via 0x05, write via 0x06)
+		if (IsCached(addr, value))
+			return true;
+		if (!Bus.IsOpen())
+			Bus.Open();
+		Bus.WriteRegister(SlaveAddr, addr, value);
+		UpdateCache(addr, value);
+		return true;
+	}
+
+	int addr_type = addr >> 24;
+	if (addr_type != ADDR_TYPE_BRIGHTNESS)
+		return false;
+
+	// address is 0x01XXWWRR, where RR is register to read
+	// via 0x05 cmd, WW - register to write via 0x0A cmd
+	uint8_t addr_write = (addr & 0xFF00) >> 8;
+	uint8_t addr_read = addr & 0xFF;
+	// the written brightness is read back from RR
+	if (IsCached(addr_read, value))
+		return true;
+	if (!Bus.IsOpen())
+		Bus.Open();
+	Bus.SetBrightness(SlaveAddr, addr_write, value);
+	UpdateCache(addr_read, value);
+	return true;
 }
 
-void TUnielModbusContext::WriteHoldingRegister(int addr, uint16_t value)
+TModbusContext::TStatus TUnielModbusContext::Execute(uint8_t function, int addr, int nb,
+                                                     uint16_t* data, int& exception_code)
 {
     try {
-        Connect();
-		if ( (addr >= 0x00) && (addr <= 0xFF) ) {
-			// address is between 0x00 and 0xFF, so treat it as
-			// normal Uniel register (read via 0x05, write via 0x06)
-			Bus.WriteRegister(SlaveAddr, addr, value);
-		} else {
-			int addr_type = addr >> 24;
-			if (addr_type == ADDR_TYPE_BRIGHTNESS ) {
-				// address is 0x01XXWWRR, where RR is register to read
-				// via 0x05 cmd, WW - register to write via 0x0A cmd
-				uint8_t addr_write = (addr & 0xFF00) >> 8;
-				Bus.SetBrightness(SlaveAddr, addr_write, value);
-			} else {
-				throw TModbusException("unsupported Uniel register address: " + std::to_string(addr));
-			}
-		}
-    } catch (const TUnielBusTransientErrorException& e) {
-        throw TModbusException(e.what());
+        switch (function) {
+        case READ_COILS:
+        case READ_DISCRETE_INPUTS:
+            if (!Bus.IsOpen())
+                Bus.Open();
+            for (int i = 0; i < nb; ++i)
+                data[i] = ReadRegister(addr + i) == 0 ? 0 : 1;
+            break;
+        case READ_HOLDING_REGISTERS:
+        case READ_INPUT_REGISTERS:
+            if (!Bus.IsOpen())
+                Bus.Open();
+            for (int i = 0; i < nb; ++i) {
+                // so far, all Uniel address types store register to read
+                // in the low byte
+                data[i] = ReadRegister((addr + i) & 0xFF);
+            }
+            break;
+        case WRITE_SINGLE_COIL:
+            WriteRegister(addr & 0xFF, data[0] ? 0xff : 0);
+            break;
+        case WRITE_SINGLE_REGISTER:
+        case WRITE_MULTIPLE_REGISTERS:
+            for (int i = 0; i < nb; ++i) {
+                if (!WriteRegister(addr + i, data[i])) {
+                    exception_code = TModbusSlaveException::ILLEGAL_DATA_ADDRESS;
+                    return SLAVE_EXCEPTION;
+                }
+            }
+            break;
+        default:
+            exception_code = TModbusSlaveException::ILLEGAL_FUNCTION;
+            return SLAVE_EXCEPTION;
+        }
+    } catch (const TUnielBusTimeoutException&) {
+        return TIMEOUT;
+    } catch (const TUnielBusTransientErrorException&) {
+        return BAD_RESPONSE;
     } catch (const TUnielBusException& e) {
+        std::cerr << "TUnielModbusContext: " << e.what() << std::endl;
         Disconnect();
-        throw TModbusException(e.what());
+        return IO_ERROR;
     }
-}
-
-void TUnielModbusContext::WriteHoldingRegisters(int addr, int nb, const uint16_t *data)
-{
-	for (int i = 0; i < nb; ++i) {
-		WriteHoldingRegister(addr + i, data[i]);
-	}
-}
-
-void TUnielModbusContext::ReadInputRegisters(int addr, int nb, uint16_t *dest)
-{
-    ReadHoldingRegisters(addr, nb, dest);
+    return OK;
 }
 
 void TUnielModbusContext::USleep(int usec)
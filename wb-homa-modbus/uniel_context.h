@@ -1,5 +1,7 @@
 #pragma once
 
+#include <map>
+
 #include "uniel.h"
 #include "modbus_client.h"
 
@@ -9,7 +11,13 @@ namespace {
     };
 }
 
-class TUnielModbusContext: public TModbusContext
+// Keeps the last known value of each register of each module.
+// An acknowledged write updates the cached value, and the next read
+// of the register returns it without a bus request. Writes of the
+// values the registers already hold aren't sent to the bus.
+// Timeouts and bad responses of a module are reported as TIMEOUT
+// and BAD_RESPONSE, so they don't count as port failures.
+class TUnielModbusContext: public TModbusStatusContext
 {
 public:
     TUnielModbusContext(const std::string& device, int timeoutMs);
@@ -17,18 +25,27 @@ public:
     void Disconnect();
     void SetDebug(bool debug);
     void SetSlave(int slave_addr);
-    void ReadCoils(int addr, int nb, uint8_t *dest);
-    void WriteCoil(int addr, int value);
-    void ReadDisceteInputs(int addr, int nb, uint8_t *dest);
-    void ReadHoldingRegisters(int addr, int nb, uint16_t *dest);
-    void WriteHoldingRegisters(int addr, int nb, const uint16_t *data);
-    void WriteHoldingRegister(int addr, uint16_t value);
-    void ReadInputRegisters(int addr, int nb, uint16_t *dest);
+    TStatus Execute(uint8_t function, int addr, int nb, uint16_t* data, int& exception_code);
     void USleep(int usec);
 
 private:
+    struct TCachedRegister {
+        uint8_t Value;
+        // written since the last read
+        bool Written;
+    };
+
+    uint8_t ReadRegister(uint8_t address);
+    // returns false if the address is not supported
+    bool WriteRegister(int addr, uint16_t value);
+    // address is the register to read the value back from
+    bool IsCached(uint8_t address, uint8_t value) const;
+    void UpdateCache(uint8_t address, uint8_t value);
+
     TUnielBus Bus;
     int SlaveAddr;
+    // module -> register -> value
+    std::map<int, std::map<uint8_t, TCachedRegister>> Cache;
 };
 
 class TUnielModbusConnector: public TModbusConnector
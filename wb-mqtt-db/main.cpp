@@ -1,11 +1,24 @@
 #include <wbmqtt/utils.h>
 #include <wbmqtt/mqtt_wrapper.h>
 #include <wbmqtt/mqttrpc.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
 #include <chrono>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <deque>
+#include <queue>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
 #include <ctime>
 #include <unistd.h>
+#include <signal.h>
 #include <fstream>
 
 #include "jsoncpp/json/json.h"
@@ -17,6 +30,64 @@ using namespace std::chrono;
 
 const float RingBufferClearThreshold = 0.02; // ring buffer will be cleared on limit * (1 + RingBufferClearThreshold) entries
 
+struct TRollupLevel
+{
+    // bucket size, s
+    int Interval;
+    // days, 0 to keep forever
+    int Retention;
+};
+
+// aggregates of the stored values, the finest level first
+const TRollupLevel RollupLevels[] = {{60, 31}, {3600, 731}, {86400, 0}};
+const int RollupLevelCount = sizeof(RollupLevels) / sizeof(RollupLevels[0]);
+
+namespace {
+    string FormatNumber(double value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.15g", value);
+        return buf;
+    }
+
+    // Binds the value to the value and value_text parameters starting
+    // at index. Numeric values are stored as numbers if they are restored
+    // to the same text, other ones are stored as text.
+    void BindValue(SQLite::Statement& query, int index, const string& value)
+    {
+        if (!value.empty()) {
+            char* end;
+            errno = 0;
+            long long integer = strtoll(value.c_str(), &end, 10);
+            if (*end == '\0' && errno == 0 && to_string(integer) == value) {
+                query.bind(index, static_cast<sqlite3_int64>(integer));
+                query.bind(index + 1);
+                return;
+            }
+
+            double number = strtod(value.c_str(), &end);
+            if (*end == '\0' && std::isfinite(number) && FormatNumber(number) == value) {
+                query.bind(index, number);
+                query.bind(index + 1);
+                return;
+            }
+        }
+        query.bind(index);
+        query.bind(index + 1, value);
+    }
+
+    // the value stored by BindValue
+    string ColumnValue(SQLite::Statement& query, int index)
+    {
+        SQLite::Column value = query.getColumn(index);
+        if (value.isInteger())
+            return to_string(value.getInt64());
+        if (value.isFloat())
+            return FormatNumber(value.getDouble());
+        return query.getColumn(index + 1).getText();
+    }
+}
+
 struct TLoggingChannel
 {
     string Pattern;
@@ -29,15 +100,187 @@ struct TLoggingGroup
     int ValuesTotal = 0;
     int MinInterval = 0;
     int MinUnchangedInterval = 0;
+    // If set, the rows of the group are stored in chunk tables
+    // of ChunkRows rows or ChunkInterval seconds each, and the oldest
+    // chunk is dropped when there are more than Chunks of them.
+    // Values and ValuesTotal aren't used then.
+    int ChunkRows = 0;
+    int ChunkInterval = 0;
+    int Chunks = 10;
+    // Keep the rollups for the RollupLevels retention after the rows
+    // they were computed from are deleted. Otherwise they're pruned
+    // along with the rows, so downsampled history is as deep as the raw one.
+    bool KeepRollups = false;
     string Id;
     int IntId;
 
+    bool IsChunked() const { return ChunkRows > 0 || ChunkInterval > 0; }
+
+};
+
+enum class TQueueOverflowPolicy
+{
+    Drop,   // drop the incoming message
+    Block   // wait for the writer thread, stalling message reception
 };
 
 struct TMQTTDBLoggerConfig
 {
     vector<TLoggingGroup> Groups;
     string DBFile;
+    // rows are written in a single transaction which is committed
+    // after CommitRows rows or CommitInterval ms, whichever comes first
+    int CommitRows = 100;
+    int CommitInterval = 1000;
+    // messages waiting for the writer thread
+    int QueueSize = 4096;
+    TQueueOverflowPolicy QueueOverflow = TQueueOverflowPolicy::Drop;
+};
+
+// Bounded lock-free queue for a single producer thread
+// and a single consumer thread
+template<typename T>
+class TSPSCQueue
+{
+    public:
+        explicit TSPSCQueue(size_t capacity)
+            : Items(capacity + 1)
+            , Head(0)
+            , Tail(0)
+        {}
+
+        // the item is left intact if the queue is full
+        bool Push(T& item)
+        {
+            size_t tail = Tail.load(memory_order_relaxed);
+            size_t next = (tail + 1) % Items.size();
+            if (next == Head.load(memory_order_acquire))
+                return false;
+            Items[tail] = std::move(item);
+            Tail.store(next, memory_order_release);
+            return true;
+        }
+
+        bool Pop(T& item)
+        {
+            size_t head = Head.load(memory_order_relaxed);
+            if (head == Tail.load(memory_order_acquire))
+                return false;
+            item = std::move(Items[head]);
+            Head.store((head + 1) % Items.size(), memory_order_release);
+            return true;
+        }
+
+        size_t Size() const
+        {
+            return (Tail.load(memory_order_acquire) + Items.size() - Head.load(memory_order_acquire)) % Items.size();
+        }
+
+        size_t Capacity() const
+        {
+            return Items.size() - 1;
+        }
+
+    private:
+        vector<T> Items;
+        atomic<size_t> Head;
+        atomic<size_t> Tail;
+};
+
+// MQTT subscription patterns ('+' and '#' wildcards) compiled into a
+// tree of topic levels, so a topic is matched against all of them
+// in a single pass over its levels
+class TSubscriptionTrie
+{
+    public:
+        void Add(const string& pattern, int value)
+        {
+            TNode* node = &Root;
+            for (const auto& level : StringSplit(pattern, '/')) {
+                auto& child = node->Children[level];
+                if (!child)
+                    child.reset(new TNode);
+                node = child.get();
+            }
+            node->Value = min(node->Value, value);
+        }
+
+        // the smallest value of the matching patterns, -1 if none match
+        int Match(const string& topic) const
+        {
+            int value = Match(Root, StringSplit(topic, '/'), 0);
+            return value == INT_MAX ? -1 : value;
+        }
+
+    private:
+        struct TNode
+        {
+            map<string, unique_ptr<TNode>> Children;
+            int Value = INT_MAX;
+        };
+
+        int Match(const TNode& node, const vector<string>& levels, size_t level) const
+        {
+            int value = INT_MAX;
+            // '#' also matches the parent level
+            auto it = node.Children.find("#");
+            if (it != node.Children.end())
+                value = it->second->Value;
+
+            if (level == levels.size())
+                return min(value, node.Value);
+
+            it = node.Children.find(levels[level]);
+            if (it != node.Children.end())
+                value = min(value, Match(*it->second, levels, level + 1));
+
+            it = node.Children.find("+");
+            if (it != node.Children.end())
+                value = min(value, Match(*it->second, levels, level + 1));
+
+            return value;
+        }
+
+        TNode Root;
+};
+
+struct TChunk
+{
+    int Id;
+    // julian days
+    double Created;
+    double TimestampMin = 0;
+    double TimestampMax = 0;
+    int Rows = 0;
+    int64_t UidMax = 0;
+    // changed since the last commit
+    bool Dirty = false;
+};
+
+// Aggregate of the values of a channel within a bucket of a rollup level.
+// Min, Max and Sum are computed over the numeric values only.
+struct TRollup
+{
+    int64_t Bucket = -1;
+    int Count = 0;
+    int NumericCount = 0;
+    double Sum = 0;
+    double Min = 0;
+    double Max = 0;
+    string Last;
+    // julian days
+    double LastTimestamp = 0;
+    int64_t UidMax = 0;
+    // changed since the last commit
+    bool Dirty = false;
+};
+
+struct TQueuedMessage
+{
+    string Topic;
+    string Payload;
+    system_clock::time_point Received;
+    steady_clock::time_point ReceivedSteady;
 };
 
 struct TChannel
@@ -51,6 +294,24 @@ struct TChannel
 };
 
 
+// MQTT connection of the RPC server. It runs its own network thread,
+// so slow history requests don't hold up the reception of the values.
+class TMQTTRPCConnection: public TMQTTWrapper
+{
+    public:
+        TMQTTRPCConnection(const TConfig& mqtt_config);
+
+        void OnConnect(int rc) {}
+        void OnMessage(const struct mosquitto_message *message) {}
+        void OnSubscribe(int mid, int qos_count, const int *granted_qos) {}
+};
+
+TMQTTRPCConnection::TMQTTRPCConnection(const TConfig& mqtt_config)
+    : TMQTTWrapper(mqtt_config)
+{
+    Connect();
+}
+
 class TMQTTDBLogger: public TMQTTWrapper
 
 {
@@ -63,8 +324,11 @@ class TMQTTDBLogger: public TMQTTWrapper
         void OnSubscribe(int mid, int qos_count, const int *granted_qos);
 
         void Init2();
+        // stores the queued messages and stops the writer thread
+        void Stop();
 
         Json::Value GetValues(const Json::Value& input);
+        Json::Value GetWriterStats(const Json::Value& input);
 
     private:
         void InitDB();
@@ -75,14 +339,74 @@ class TMQTTDBLogger: public TMQTTWrapper
         void InitDeviceIds();
         void InitGroupIds();
         void InitCounterCaches();
+        void InitChunks();
+        // the chunk to store the row of the group received at
+        // the given time, rotates the chunks if needed
+        TChunk& GetChunk(const TLoggingGroup& group, double julian_day);
+        void SaveChunks();
+        static string ChunkTableName(int chunk_id);
+        void CreateChunkTable(const string& table);
+        // copies the rows of the table of the previous versions
+        // to the table of the current layout
+        void ConvertRows(const string& from, const string& to);
+        void SetChannelGroup(int channel_int_id, int group_int_id);
+        // deletes count oldest rows of the channels from the data table
+        void DeleteOldestRows(const vector<int>& channel_int_ids, int count);
+        void UpdateRollups(int channel_int_id, const string& value, double julian_day, int64_t uid);
+        void SaveRollup(int level, int channel_int_id, TRollup& rollup);
+        void SaveRollups();
+        // removes the buckets that are older than the level retention
+        void PruneRollups(double julian_day);
+        // removes the buckets that are older than the oldest stored
+        // row of the channels, unless the group keeps its rollups
+        void PruneChannelRollups(const TLoggingGroup& group, const vector<int>& channel_int_ids);
+        vector<int> GetGroupChannelIds(int group_int_id) const;
+        // computes the rollups of the rows stored by the previous versions
+        void FillRollups();
+        Json::Value GetRollupValues(const Json::Value& params, int level, int min_interval_ms,
+                                    double timestamp_gt, double timestamp_lt, int64_t uid_gt,
+                                    int limit, int req_ver);
         int ReadDBVersion();
         void UpdateDB(int prev_version);
+        void BeginWrite();
+        void Commit();
+        // drops the state cached by the writer thread and reads it
+        // from the DB again, used after a transaction is rolled back
+        void ReloadCaches();
+        // commits the pending rows if the commit interval has passed
+        // or force is set
+        void Flush(bool force = false);
+        void WriterLoop();
+        void StoreMessage(const TQueuedMessage& message);
+        int GetChannelId(const TChannel& channel);
+
+        struct TTopicInfo
+        {
+            // nullptr if the topic isn't logged
+            const TLoggingGroup* Group;
+            int ChannelId;
+        };
+        // the first group matching the topic and the id of its channel,
+        // computed once per topic
+        const TTopicInfo& ResolveTopic(const string& topic);
+        // the statement of DB, prepared on the first use
+        SQLite::Statement& WriteQuery(const char* sql);
 
         string Mask;
+        // used by the writer thread only
         std::unique_ptr<SQLite::Database> DB;
+        // the prepared statements of DB, keyed by the SQL literal. Declared
+        // after DB, so they are finalized before the connection is closed.
+        map<const char*, unique_ptr<SQLite::Statement>> WriteQueries;
+        // used by the history requests
+        std::unique_ptr<SQLite::Database> ReadDB;
         TMQTTDBLoggerConfig LoggerConfig;
+        TConfig MQTTConfig;
+        shared_ptr<TMQTTRPCConnection> RPCConnection;
         shared_ptr<TMQTTRPCServer> RPCServer;
         map<TChannel, int> ChannelIds;
+        // channel int id -> group int id
+        map<int, int> ChannelGroupIds;
         map<string, int> DeviceIds;
 
         map<int, steady_clock::time_point> LastSavedTimestamps;
@@ -90,17 +414,59 @@ class TMQTTDBLogger: public TMQTTWrapper
         map<int, int> GroupRowNumberCache;
         map<int, string> ChannelValueCache;
 
-
-        const int DBVersion = 1;
+        // group patterns, the values are indexes in LoggerConfig.Groups
+        TSubscriptionTrie GroupPatterns;
+        unordered_map<string, TTopicInfo> TopicCache;
+
+        // group int id -> chunks, the oldest one first
+        map<int, deque<TChunk>> GroupChunks;
+        // for the last chunk of each group
+        map<int, unique_ptr<SQLite::Statement>> ChunkInsertQueries;
+        // uids are unique across the data table and the chunks
+        int64_t LastUid = 0;
+
+        // channel int id -> the last updated bucket of each rollup level
+        map<int, array<TRollup, RollupLevelCount>> Rollups;
+        // day of the last rollup retention pass
+        int64_t RollupsPrunedDay = -1;
+
+        std::unique_ptr<SQLite::Transaction> WriteTransaction;
+        steady_clock::time_point WriteTransactionStart;
+        int PendingRows = 0;
+
+        TSPSCQueue<TQueuedMessage> Queue;
+        std::thread Writer;
+        atomic<bool> StopWriter;
+        // backpressure statistics
+        atomic<uint64_t> EnqueuedMessages;
+        atomic<uint64_t> DroppedMessages;
+        atomic<uint64_t> BlockedMs;
+        atomic<size_t> MaxQueueDepth;
+        uint64_t ReportedDroppedMessages = 0;
+
+        const int DBVersion = 3;
 
 };
 
 TMQTTDBLogger::TMQTTDBLogger (const TMQTTDBLogger::TConfig& mqtt_config, const TMQTTDBLoggerConfig config)
     : TMQTTWrapper(mqtt_config)
     , LoggerConfig(config)
+    , MQTTConfig(mqtt_config)
+    , Queue(config.QueueSize)
+    , StopWriter(false)
+    , EnqueuedMessages(0)
+    , DroppedMessages(0)
+    , BlockedMs(0)
+    , MaxQueueDepth(0)
 {
 
+    for (size_t i = 0; i < LoggerConfig.Groups.size(); ++i) {
+        for (const auto& channel : LoggerConfig.Groups[i].Channels)
+            GroupPatterns.Add(channel.Pattern, i);
+    }
+
     InitDB();
+    Writer = std::thread(&TMQTTDBLogger::WriterLoop, this);
     Connect();
 }
 
@@ -108,6 +474,14 @@ TMQTTDBLogger::~TMQTTDBLogger()
 {
 }
 
+SQLite::Statement& TMQTTDBLogger::WriteQuery(const char* sql)
+{
+    unique_ptr<SQLite::Statement>& query = WriteQueries[sql];
+    if (!query)
+        query.reset(new SQLite::Statement(*DB, sql));
+    return *query;
+}
+
 
 void TMQTTDBLogger::CreateTables()
 {
@@ -119,7 +493,8 @@ void TMQTTDBLogger::CreateTables()
     DB->exec("CREATE TABLE IF NOT EXISTS channels ( "
              "int_id INTEGER PRIMARY KEY AUTOINCREMENT, "
              "device VARCHAR(255), "
-             "control VARCHAR(255) "
+             "control VARCHAR(255), "
+             "group_id INTEGER "
              ")  ");
 
     DB->exec("CREATE TABLE IF NOT EXISTS groups ( "
@@ -128,14 +503,18 @@ void TMQTTDBLogger::CreateTables()
              ")  ");
 
 
+    // the rows of a channel are stored in the timestamp order,
+    // the uid keeps the rows with the same timestamp apart.
+    // value has no type affinity, so the numbers are kept as they are
+    // bound (NUMERIC would turn e.g. 1e+15 and -0 into integers).
     DB->exec("CREATE TABLE IF NOT EXISTS data ("
-			 "uid INTEGER PRIMARY KEY AUTOINCREMENT, "
-			 "device INTEGER,"
 			 "channel INTEGER,"
-			 "value VARCHAR(255),"
 			 "timestamp REAL DEFAULT(julianday('now')),"
-			 "group_id INTEGER"
-			 ")"
+			 "uid INTEGER,"
+			 "value,"
+			 "value_text VARCHAR(255),"
+			 "PRIMARY KEY (channel, timestamp, uid)"
+			 ") WITHOUT ROWID"
 			);
 
     DB->exec("CREATE TABLE IF NOT EXISTS variables ("
@@ -144,11 +523,32 @@ void TMQTTDBLogger::CreateTables()
 			);
 
 
-    DB->exec("CREATE INDEX IF NOT EXISTS data_topic ON data (channel)");
-    DB->exec("CREATE INDEX IF NOT EXISTS data_topic_timestamp ON data (channel, timestamp)");
-
-    DB->exec("CREATE INDEX IF NOT EXISTS data_gid ON data (group_id)");
-    DB->exec("CREATE INDEX IF NOT EXISTS data_gid_timestamp ON data (group_id, timestamp)");
+    // chunk tables of the groups with partitioned storage
+    DB->exec("CREATE TABLE IF NOT EXISTS chunks ("
+             "int_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+             "group_id INTEGER, "
+             "created REAL, "
+             "rows INTEGER DEFAULT 0, "
+             "ts_min REAL, "
+             "ts_max REAL, "
+             "uid_max INTEGER DEFAULT 0"
+             ")");
+
+    // downsampled history, see RollupLevels
+    DB->exec("CREATE TABLE IF NOT EXISTS rollups ("
+             "level INTEGER, "
+             "channel INTEGER, "
+             "bucket INTEGER, "
+             "count INTEGER, "
+             "num_count INTEGER, "
+             "sum REAL, "
+             "min REAL, "
+             "max REAL, "
+             "last VARCHAR(255), "
+             "last_timestamp REAL, "
+             "uid_max INTEGER, "
+             "PRIMARY KEY (level, channel, bucket)"
+             ")");
 
 	{
 		SQLite::Statement query(*DB, "INSERT OR REPLACE INTO variables (name, value) VALUES ('db_version', ?)");
@@ -161,7 +561,8 @@ void TMQTTDBLogger::CreateTables()
 
 void TMQTTDBLogger::InitCounterCaches()
 {
-    SQLite::Statement count_group_query(*DB, "SELECT COUNT(*) as cnt, group_id FROM data GROUP BY group_id ");
+    SQLite::Statement count_group_query(*DB, "SELECT COUNT(*) as cnt, channels.group_id FROM data "
+                                             "JOIN channels ON channels.int_id = data.channel GROUP BY channels.group_id ");
 	while (count_group_query.executeStep()) {
         GroupRowNumberCache[count_group_query.getColumn(1)] = count_group_query.getColumn(0);
     }
@@ -172,13 +573,384 @@ void TMQTTDBLogger::InitCounterCaches()
     }
 }
 
+void TMQTTDBLogger::InitChunks()
+{
+    SQLite::Statement query(*DB, "SELECT int_id, group_id, created, rows, ts_min, ts_max, uid_max FROM chunks ORDER BY int_id");
+    while (query.executeStep()) {
+        TChunk chunk;
+        chunk.Id = query.getColumn(0);
+        chunk.Created = query.getColumn(2);
+        chunk.Rows = query.getColumn(3);
+        chunk.TimestampMin = query.getColumn(4);
+        chunk.TimestampMax = query.getColumn(5);
+        chunk.UidMax = static_cast<int64_t>(query.getColumn(6).getInt64());
+        GroupChunks[query.getColumn(1)].push_back(chunk);
+        LastUid = max(LastUid, chunk.UidMax);
+    }
+
+    SQLite::Statement uid_query(*DB, "SELECT MAX(uid) FROM data");
+    if (uid_query.executeStep())
+        LastUid = max(LastUid, static_cast<int64_t>(uid_query.getColumn(0).getInt64()));
+}
+
+string TMQTTDBLogger::ChunkTableName(int chunk_id)
+{
+    return "data_chunk_" + to_string(chunk_id);
+}
+
+void TMQTTDBLogger::CreateChunkTable(const string& table)
+{
+    // same layout as the data table
+    DB->exec("CREATE TABLE " + table + " ("
+             "channel INTEGER, "
+             "timestamp REAL, "
+             "uid INTEGER, "
+             "value, "
+             "value_text VARCHAR(255), "
+             "PRIMARY KEY (channel, timestamp, uid)"
+             ") WITHOUT ROWID");
+}
+
+TChunk& TMQTTDBLogger::GetChunk(const TLoggingGroup& group, double julian_day)
+{
+    deque<TChunk>& chunks = GroupChunks[group.IntId];
+    if (!chunks.empty()) {
+        const TChunk& last = chunks.back();
+        if (!((group.ChunkRows > 0 && last.Rows >= group.ChunkRows) ||
+              (group.ChunkInterval > 0 && (julian_day - last.Created) * 86400 >= group.ChunkInterval))) {
+            // the chunk left from the previous run
+            unique_ptr<SQLite::Statement>& insert_query = ChunkInsertQueries[group.IntId];
+            if (!insert_query)
+                insert_query.reset(new SQLite::Statement(*DB,
+                    "INSERT INTO " + ChunkTableName(last.Id) + " (channel, timestamp, uid, value, value_text) VALUES (?, ?, ?, ?, ?)"));
+            return chunks.back();
+        }
+    }
+
+    SQLite::Statement& create_chunk_query = WriteQuery("INSERT INTO chunks (group_id, created) VALUES (?, ?)");
+    create_chunk_query.reset();
+    create_chunk_query.bind(1, group.IntId);
+    create_chunk_query.bind(2, julian_day);
+    create_chunk_query.exec();
+
+    TChunk chunk;
+    chunk.Id = DB->getLastInsertRowid();
+    chunk.Created = julian_day;
+    const string& table = ChunkTableName(chunk.Id);
+    CreateChunkTable(table);
+    cout << "created chunk " << table << " for group " << group.Id << endl;
+
+    ChunkInsertQueries[group.IntId].reset(new SQLite::Statement(*DB,
+        "INSERT INTO " + table + " (channel, timestamp, uid, value, value_text) VALUES (?, ?, ?, ?, ?)"));
+    chunks.push_back(chunk);
+
+    // retention: whole chunks are dropped instead of deleting rows
+    bool dropped = false;
+    while (chunks.size() > static_cast<size_t>(max(group.Chunks, 1))) {
+        SQLite::Statement& delete_chunk_query = WriteQuery("DELETE FROM chunks WHERE int_id = ?");
+        delete_chunk_query.reset();
+        delete_chunk_query.bind(1, chunks.front().Id);
+        delete_chunk_query.exec();
+        DB->exec("DROP TABLE " + ChunkTableName(chunks.front().Id));
+        cout << "dropped chunk " << ChunkTableName(chunks.front().Id) << " of group " << group.Id << endl;
+        chunks.pop_front();
+        dropped = true;
+    }
+    if (dropped)
+        PruneChannelRollups(group, GetGroupChannelIds(group.IntId));
+    return chunks.back();
+}
+
+void TMQTTDBLogger::SaveChunks()
+{
+    SQLite::Statement& update_chunk_query = WriteQuery("UPDATE chunks SET rows = ?, ts_min = ?, ts_max = ?, uid_max = ? WHERE int_id = ?");
+    for (auto& item : GroupChunks) {
+        for (auto& chunk : item.second) {
+            if (!chunk.Dirty)
+                continue;
+            update_chunk_query.reset();
+            update_chunk_query.bind(1, chunk.Rows);
+            update_chunk_query.bind(2, chunk.TimestampMin);
+            update_chunk_query.bind(3, chunk.TimestampMax);
+            update_chunk_query.bind(4, static_cast<sqlite3_int64>(chunk.UidMax));
+            update_chunk_query.bind(5, chunk.Id);
+            update_chunk_query.exec();
+            chunk.Dirty = false;
+        }
+    }
+}
+
+void TMQTTDBLogger::UpdateRollups(int channel_int_id, const string& value, double julian_day, int64_t uid)
+{
+    char* end;
+    double number = strtod(value.c_str(), &end);
+    bool numeric = !value.empty() && *end == '\0' && std::isfinite(number);
+    double unix_time = (julian_day - 2440587.5) * 86400.0;
+
+    array<TRollup, RollupLevelCount>& rollups = Rollups[channel_int_id];
+    for (int level = 0; level < RollupLevelCount; ++level) {
+        TRollup& rollup = rollups[level];
+        int64_t bucket = static_cast<int64_t>(floor(unix_time / RollupLevels[level].Interval));
+        if (rollup.Bucket != bucket) {
+            if (rollup.Dirty)
+                SaveRollup(level, channel_int_id, rollup);
+
+            // the bucket may be already stored, e.g. by the previous run
+            SQLite::Statement& get_rollup_query = WriteQuery("SELECT count, num_count, sum, min, max, last, last_timestamp, uid_max "
+                                                             "FROM rollups WHERE level = ? AND channel = ? AND bucket = ?");
+            get_rollup_query.reset();
+            get_rollup_query.bind(1, RollupLevels[level].Interval);
+            get_rollup_query.bind(2, channel_int_id);
+            get_rollup_query.bind(3, static_cast<sqlite3_int64>(bucket));
+            rollup = TRollup();
+            rollup.Bucket = bucket;
+            if (get_rollup_query.executeStep()) {
+                rollup.Count = get_rollup_query.getColumn(0);
+                rollup.NumericCount = get_rollup_query.getColumn(1);
+                rollup.Sum = get_rollup_query.getColumn(2);
+                rollup.Min = get_rollup_query.getColumn(3);
+                rollup.Max = get_rollup_query.getColumn(4);
+                rollup.Last = get_rollup_query.getColumn(5).getText();
+                rollup.LastTimestamp = get_rollup_query.getColumn(6);
+                rollup.UidMax = static_cast<int64_t>(get_rollup_query.getColumn(7).getInt64());
+            }
+            // a pending statement keeps the tables locked,
+            // e.g. for dropping an expired chunk
+            get_rollup_query.reset();
+        }
+
+        if (numeric) {
+            rollup.Min = rollup.NumericCount ? min(rollup.Min, number) : number;
+            rollup.Max = rollup.NumericCount ? max(rollup.Max, number) : number;
+            rollup.Sum += number;
+            ++rollup.NumericCount;
+        }
+        if (!rollup.Count || julian_day >= rollup.LastTimestamp) {
+            rollup.Last = value;
+            rollup.LastTimestamp = julian_day;
+        }
+        ++rollup.Count;
+        rollup.UidMax = max(rollup.UidMax, uid);
+        rollup.Dirty = true;
+    }
+}
+
+void TMQTTDBLogger::SaveRollup(int level, int channel_int_id, TRollup& rollup)
+{
+    SQLite::Statement& save_rollup_query = WriteQuery("INSERT OR REPLACE INTO rollups "
+                                                      "(level, channel, bucket, count, num_count, sum, min, max, last, last_timestamp, uid_max) "
+                                                      "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    save_rollup_query.reset();
+    save_rollup_query.bind(1, RollupLevels[level].Interval);
+    save_rollup_query.bind(2, channel_int_id);
+    save_rollup_query.bind(3, static_cast<sqlite3_int64>(rollup.Bucket));
+    save_rollup_query.bind(4, rollup.Count);
+    save_rollup_query.bind(5, rollup.NumericCount);
+    save_rollup_query.bind(6, rollup.Sum);
+    save_rollup_query.bind(7, rollup.Min);
+    save_rollup_query.bind(8, rollup.Max);
+    save_rollup_query.bind(9, rollup.Last);
+    save_rollup_query.bind(10, rollup.LastTimestamp);
+    save_rollup_query.bind(11, static_cast<sqlite3_int64>(rollup.UidMax));
+    save_rollup_query.exec();
+    rollup.Dirty = false;
+}
+
+void TMQTTDBLogger::SaveRollups()
+{
+    for (auto& item : Rollups) {
+        for (int level = 0; level < RollupLevelCount; ++level) {
+            if (item.second[level].Dirty)
+                SaveRollup(level, item.first, item.second[level]);
+        }
+    }
+}
+
+void TMQTTDBLogger::PruneRollups(double julian_day)
+{
+    double unix_time = (julian_day - 2440587.5) * 86400.0;
+    int64_t day = static_cast<int64_t>(floor(unix_time / 86400));
+    if (day <= RollupsPrunedDay)
+        return;
+    RollupsPrunedDay = day;
+
+    SQLite::Statement& prune_rollups_query = WriteQuery("DELETE FROM rollups WHERE level = ? AND bucket < ?");
+    for (int level = 0; level < RollupLevelCount; ++level) {
+        if (!RollupLevels[level].Retention)
+            continue;
+        prune_rollups_query.reset();
+        prune_rollups_query.bind(1, RollupLevels[level].Interval);
+        prune_rollups_query.bind(2, static_cast<sqlite3_int64>(
+            floor((unix_time - RollupLevels[level].Retention * 86400.0) / RollupLevels[level].Interval)));
+        prune_rollups_query.exec();
+    }
+}
+
+void TMQTTDBLogger::PruneChannelRollups(const TLoggingGroup& group, const vector<int>& channel_int_ids)
+{
+    if (group.KeepRollups)
+        return;
+
+    // the rows may be left in the data table by the
+    // runs before the group was switched to chunks
+    vector<unique_ptr<SQLite::Statement>> chunk_queries;
+    for (const TChunk& chunk : GroupChunks[group.IntId]) {
+        chunk_queries.emplace_back(new SQLite::Statement(*DB,
+            "SELECT MIN(timestamp) FROM " + ChunkTableName(chunk.Id) + " WHERE channel = ?"));
+    }
+    SQLite::Statement& oldest_row_query = WriteQuery("SELECT MIN(timestamp) FROM data WHERE channel = ?");
+    SQLite::Statement& prune_rollups_query = WriteQuery("DELETE FROM rollups WHERE level = ? AND channel = ? AND bucket < ?");
+
+    for (int channel_int_id : channel_int_ids) {
+        bool found = false;
+        double oldest = 0;
+        oldest_row_query.reset();
+        oldest_row_query.bind(1, channel_int_id);
+        for (size_t i = 0; i <= chunk_queries.size(); ++i) {
+            SQLite::Statement& query = i ? *chunk_queries[i - 1] : oldest_row_query;
+            query.bind(1, channel_int_id);
+            if (query.executeStep() && !query.getColumn(0).isNull()) {
+                double timestamp = query.getColumn(0);
+                oldest = found ? min(oldest, timestamp) : timestamp;
+                found = true;
+            }
+            query.reset();
+        }
+
+        // a partially deleted bucket is kept
+        double unix_time = (oldest - 2440587.5) * 86400.0;
+        auto cached = Rollups.find(channel_int_id);
+        for (int level = 0; level < RollupLevelCount; ++level) {
+            int64_t bucket = found ? static_cast<int64_t>(floor(unix_time / RollupLevels[level].Interval)) : LLONG_MAX;
+            prune_rollups_query.reset();
+            prune_rollups_query.bind(1, RollupLevels[level].Interval);
+            prune_rollups_query.bind(2, channel_int_id);
+            prune_rollups_query.bind(3, static_cast<sqlite3_int64>(bucket));
+            prune_rollups_query.exec();
+            // don't save the deleted bucket again
+            if (cached != Rollups.end() && cached->second[level].Bucket < bucket)
+                cached->second[level] = TRollup();
+        }
+    }
+}
+
+vector<int> TMQTTDBLogger::GetGroupChannelIds(int group_int_id) const
+{
+    vector<int> channel_int_ids;
+    for (const auto& item : ChannelGroupIds) {
+        if (item.second == group_int_id)
+            channel_int_ids.push_back(item.first);
+    }
+    return channel_int_ids;
+}
+
+void TMQTTDBLogger::FillRollups()
+{
+    vector<string> tables = {"data"};
+    SQLite::Statement get_chunks_query(*DB, "SELECT int_id FROM chunks ORDER BY int_id");
+    while (get_chunks_query.executeStep())
+        tables.push_back(ChunkTableName(get_chunks_query.getColumn(0)));
+
+    for (const string& table : tables) {
+        SQLite::Statement query(*DB, "SELECT uid, channel, value, value_text, timestamp FROM " + table + " ORDER BY uid");
+        while (query.executeStep()) {
+            UpdateRollups(query.getColumn(1), ColumnValue(query, 2), query.getColumn(4),
+                          static_cast<int64_t>(query.getColumn(0).getInt64()));
+        }
+    }
+    SaveRollups();
+    Rollups.clear();
+}
 
 void TMQTTDBLogger::InitChannelIds()
 {
-	SQLite::Statement query(*DB, "SELECT int_id, device, control FROM channels");
+	SQLite::Statement query(*DB, "SELECT int_id, device, control, group_id FROM channels");
     while (query.executeStep()) {
         ChannelIds[{query.getColumn(1).getText(),
 					query.getColumn(2).getText()}] = query.getColumn(0);
+        ChannelGroupIds[query.getColumn(0)] = query.getColumn(3);
+    }
+}
+
+void TMQTTDBLogger::SetChannelGroup(int channel_int_id, int group_int_id)
+{
+	// the group ring buffers are cleaned up by the channels of the group
+	auto it = ChannelGroupIds.find(channel_int_id);
+	if (it != ChannelGroupIds.end() && it->second == group_int_id)
+		return;
+
+	SQLite::Statement& query = WriteQuery("UPDATE channels SET group_id = ? WHERE int_id = ?");
+	query.reset();
+	query.bind(1, group_int_id);
+	query.bind(2, channel_int_id);
+	query.exec();
+	ChannelGroupIds[channel_int_id] = group_int_id;
+}
+
+void TMQTTDBLogger::DeleteOldestRows(const vector<int>& channel_int_ids, int count)
+{
+    // The rows of each channel are read in the primary key order and
+    // merged, so nothing is sorted. The oldest rows of each channel
+    // are then deleted by their key range.
+    struct TCursor
+    {
+        unique_ptr<SQLite::Statement> Query;
+        int ChannelId;
+        double Timestamp;
+        int64_t Uid;
+        // the last row to delete
+        bool Found;
+        double LastTimestamp;
+        int64_t LastUid;
+
+        bool Next()
+        {
+            if (!Query->executeStep())
+                return false;
+            Timestamp = Query->getColumn(0);
+            Uid = static_cast<int64_t>(Query->getColumn(1).getInt64());
+            return true;
+        }
+    };
+    vector<TCursor> cursors(channel_int_ids.size());
+    auto later = [](const TCursor* a, const TCursor* b) {
+        return a->Timestamp > b->Timestamp || (a->Timestamp == b->Timestamp && a->Uid > b->Uid);
+    };
+    priority_queue<TCursor*, vector<TCursor*>, decltype(later)> oldest(later);
+    for (size_t i = 0; i < channel_int_ids.size(); ++i) {
+        TCursor& cursor = cursors[i];
+        cursor.Query.reset(new SQLite::Statement(*DB, "SELECT timestamp, uid FROM data WHERE channel = ? "
+                                                      "ORDER BY timestamp ASC, uid ASC"));
+        cursor.Query->bind(1, channel_int_ids[i]);
+        cursor.ChannelId = channel_int_ids[i];
+        cursor.Found = false;
+        if (cursor.Next())
+            oldest.push(&cursor);
+    }
+
+    for (int i = 0; i < count && !oldest.empty(); ++i) {
+        TCursor* cursor = oldest.top();
+        oldest.pop();
+        cursor->Found = true;
+        cursor->LastTimestamp = cursor->Timestamp;
+        cursor->LastUid = cursor->Uid;
+        if (cursor->Next())
+            oldest.push(cursor);
+    }
+
+    SQLite::Statement& delete_query = WriteQuery("DELETE FROM data WHERE channel = ? AND timestamp <= ? "
+                                                 "AND (timestamp < ? OR uid <= ?)");
+    for (auto& cursor : cursors) {
+        // the pending reads would keep the table locked
+        cursor.Query.reset();
+        if (!cursor.Found)
+            continue;
+        delete_query.reset();
+        delete_query.bind(1, cursor.ChannelId);
+        delete_query.bind(2, cursor.LastTimestamp);
+        delete_query.bind(3, cursor.LastTimestamp);
+        delete_query.bind(4, static_cast<sqlite3_int64>(cursor.LastUid));
+        delete_query.exec();
     }
 }
 
@@ -207,7 +979,7 @@ void TMQTTDBLogger::InitGroupIds()
 		} else {
 			// new group, no id is stored
 
-			static SQLite::Statement query(*DB, "INSERT INTO groups (group_id) VALUES (?) ");
+			SQLite::Statement& query = WriteQuery("INSERT INTO groups (group_id) VALUES (?) ");
 			query.reset();
 			query.bind(1, group.Id);
 			query.exec();
@@ -230,50 +1002,103 @@ int TMQTTDBLogger::ReadDBVersion()
 	return 0;
 }
 
+void TMQTTDBLogger::ConvertRows(const string& from, const string& to)
+{
+	SQLite::Statement select_query(*DB, "SELECT channel, timestamp, uid, value FROM " + from +
+	                                    " WHERE channel IS NOT NULL AND timestamp IS NOT NULL");
+	SQLite::Statement insert_query(*DB, "INSERT INTO " + to + " (channel, timestamp, uid, value, value_text) VALUES (?, ?, ?, ?, ?)");
+	while (select_query.executeStep()) {
+		insert_query.reset();
+		insert_query.bind(1, select_query.getColumn(0).getInt());
+		insert_query.bind(2, select_query.getColumn(1).getDouble());
+		insert_query.bind(3, select_query.getColumn(2).getInt64());
+		BindValue(insert_query, 4, select_query.getColumn(3).getText());
+		insert_query.exec();
+	}
+}
+
 void TMQTTDBLogger::UpdateDB(int prev_version)
 {
-	if (prev_version == 0) {
+	if (prev_version > 2) {
+		throw TBaseException("Unsupported DB version. Please consider deleting DB file.");
+	}
+
+	{
 	    // Begin transaction
 	    SQLite::Transaction transaction(*DB);
 
-	    DB->exec("ALTER TABLE data RENAME TO tmp");
+		if (prev_version == 0) {
+		    DB->exec("ALTER TABLE data RENAME TO tmp");
 
-		// drop existing indexes
-		DB->exec("DROP INDEX data_topic");
-		DB->exec("DROP INDEX data_topic_timestamp");
-		DB->exec("DROP INDEX data_gid");
-		DB->exec("DROP INDEX data_gid_timestamp");
+			// drop existing indexes
+			DB->exec("DROP INDEX data_topic");
+			DB->exec("DROP INDEX data_topic_timestamp");
+			DB->exec("DROP INDEX data_gid");
+			DB->exec("DROP INDEX data_gid_timestamp");
 
-		// create tables with most recent schema
-		CreateTables();
+			// create tables with most recent schema
+			CreateTables();
 
-		// generate internal integer ids from old data table
-	    DB->exec("INSERT OR IGNORE INTO devices (device) SELECT device FROM tmp GROUP BY device");
-	    DB->exec("INSERT OR IGNORE INTO channels (device, control) SELECT device, control FROM tmp GROUP BY device, control");
-	    DB->exec("INSERT OR IGNORE INTO groups (group_id) SELECT group_id FROM tmp GROUP BY group_id");
+			// generate internal integer ids from old data table
+		    DB->exec("INSERT OR IGNORE INTO devices (device) SELECT device FROM tmp GROUP BY device");
+		    DB->exec("INSERT OR IGNORE INTO channels (device, control) SELECT device, control FROM tmp GROUP BY device, control");
+		    DB->exec("INSERT OR IGNORE INTO groups (group_id) SELECT group_id FROM tmp GROUP BY group_id");
 
-		// populate data table using values from old data table
-		DB->exec("INSERT INTO data(uid, device, channel,value,timestamp,group_id) "
-                  "SELECT uid, devices.int_id, channels.int_id, value, julianday(timestamp), groups.int_id FROM tmp "
-                  "LEFT JOIN devices ON tmp.device = devices.device "
-                  "LEFT JOIN channels ON tmp.device = channels.device AND tmp.control = channels.control "
-                  "LEFT JOIN groups ON tmp.group_id = groups.group_id ");
+			// the rows in the version 1 layout, converted below
+			DB->exec("CREATE TABLE old_data (uid INTEGER, channel INTEGER, value VARCHAR(255), timestamp REAL, group_id INTEGER)");
+			DB->exec("INSERT INTO old_data (uid, channel, value, timestamp, group_id) "
+	                  "SELECT uid, channels.int_id, value, julianday(timestamp), groups.int_id FROM tmp "
+	                  "LEFT JOIN channels ON tmp.device = channels.device AND tmp.control = channels.control "
+	                  "LEFT JOIN groups ON tmp.group_id = groups.group_id ");
+			DB->exec("CREATE INDEX old_data_channel ON old_data (channel)");
 
-	    DB->exec("DROP TABLE tmp");
+		    DB->exec("DROP TABLE tmp");
+		} else {
+			// versions 1 and 2 differ by the rollups table only
+		    DB->exec("ALTER TABLE data RENAME TO old_data");
+		    DB->exec("ALTER TABLE channels ADD COLUMN group_id INTEGER");
 
-		transaction.commit();
+			// create tables with most recent schema
+			CreateTables();
+		}
 
-		// defragment database
-		DB->exec("VACUUM");
+		// the rows keep the channel only, the group of a channel
+		// is the group of its last row
+		DB->exec("UPDATE channels SET group_id = "
+		         "(SELECT group_id FROM old_data WHERE old_data.channel = channels.int_id ORDER BY uid DESC LIMIT 1)");
 
-	} else {
-		throw TBaseException("Unsupported DB version. Please consider deleting DB file.");
+		ConvertRows("old_data", "data");
+		DB->exec("DROP TABLE old_data");
+
+		vector<int> chunk_ids;
+		{
+			SQLite::Statement query(*DB, "SELECT int_id FROM chunks");
+			while (query.executeStep())
+				chunk_ids.push_back(query.getColumn(0));
+		}
+		for (int chunk_id : chunk_ids) {
+			const string& table = ChunkTableName(chunk_id);
+			DB->exec("ALTER TABLE " + table + " RENAME TO old_chunk");
+			CreateChunkTable(table);
+			ConvertRows("old_chunk", table);
+			DB->exec("DROP TABLE old_chunk");
+		}
+
+		if (prev_version < 2)
+			FillRollups();
+
+		transaction.commit();
 	}
+
+	// defragment database
+	DB->exec("VACUUM");
 }
 
 void TMQTTDBLogger::InitDB()
 {
 	DB.reset(new SQLite::Database(LoggerConfig.DBFile, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE));
+	// lets the history requests read while the writer thread commits
+	DB->exec("PRAGMA journal_mode=WAL");
 
 	if (!DB->tableExists("data")) {
 		// new DB file created
@@ -303,6 +1128,11 @@ void TMQTTDBLogger::InitDB()
 
 	std::cerr << "Getting and assigning group ids" << std::endl;
 	InitGroupIds();
+
+	std::cerr << "Loading chunks" << std::endl;
+	InitChunks();
+
+	ReadDB.reset(new SQLite::Database(LoggerConfig.DBFile, SQLITE_OPEN_READONLY));
 }
 
 int TMQTTDBLogger::GetOrCreateChannelId(const TChannel & channel)
@@ -312,7 +1142,7 @@ int TMQTTDBLogger::GetOrCreateChannelId(const TChannel & channel)
 		return it->second;
 	} else {
 
-		static SQLite::Statement query(*DB, "INSERT INTO channels (device, control) VALUES (?, ?) ");
+		SQLite::Statement& query = WriteQuery("INSERT INTO channels (device, control) VALUES (?, ?) ");
 
 		query.reset();
 		query.bind(1, channel.Device);
@@ -333,7 +1163,7 @@ int TMQTTDBLogger::GetOrCreateDeviceId(const string& device)
 		return it->second;
 	} else {
 
-		static SQLite::Statement query(*DB, "INSERT INTO devices (device) VALUES (?) ");
+		SQLite::Statement& query = WriteQuery("INSERT INTO devices (device) VALUES (?) ");
 
 		query.reset();
 		query.bind(1, device);
@@ -347,6 +1177,81 @@ int TMQTTDBLogger::GetOrCreateDeviceId(const string& device)
 }
 
 
+void TMQTTDBLogger::BeginWrite()
+{
+    if (WriteTransaction)
+        return;
+    WriteTransaction.reset(new SQLite::Transaction(*DB));
+    WriteTransactionStart = steady_clock::now();
+}
+
+void TMQTTDBLogger::Commit()
+{
+    // the transaction is rolled back if the commit fails
+    std::unique_ptr<SQLite::Transaction> transaction(std::move(WriteTransaction));
+    int rows = PendingRows;
+    PendingRows = 0;
+    try {
+        // chunk bounds and rollups are committed along with their rows
+        SaveChunks();
+        SaveRollups();
+        transaction->commit();
+    } catch (const std::exception&) {
+        // SQLite rolls the transaction back by itself on some errors,
+        // then an empty one is started for the rollback not to fail
+        try {
+            DB->exec("BEGIN");
+        } catch (const SQLite::Exception&) {
+            // still in the transaction
+        }
+        transaction.reset();
+        // the counters, chunks and rollups must match the rows that are left
+        ReloadCaches();
+        throw;
+    }
+    cout << "committed " << rows << " rows" << endl;
+}
+
+void TMQTTDBLogger::ReloadCaches()
+{
+    ChannelIds.clear();
+    ChannelGroupIds.clear();
+    DeviceIds.clear();
+    TopicCache.clear();
+    ChannelRowNumberCache.clear();
+    GroupRowNumberCache.clear();
+    LastSavedTimestamps.clear();
+    ChannelValueCache.clear();
+    ChunkInsertQueries.clear();
+    GroupChunks.clear();
+    LastUid = 0;
+    Rollups.clear();
+
+    InitDeviceIds();
+    InitChannelIds();
+    InitCounterCaches();
+    InitChunks();
+}
+
+void TMQTTDBLogger::Flush(bool force)
+{
+    if (WriteTransaction && (force ||
+        duration_cast<milliseconds>(steady_clock::now() - WriteTransactionStart).count() >= LoggerConfig.CommitInterval))
+        Commit();
+}
+
+int TMQTTDBLogger::GetChannelId(const TChannel& channel)
+{
+	// ChannelIds belongs to the writer thread. Channels that
+	// aren't in the DB yet have no rows.
+	SQLite::Statement query(*ReadDB, "SELECT int_id FROM channels WHERE device = ? AND control = ?");
+	query.bind(1, channel.Device);
+	query.bind(2, channel.Control);
+	if (query.executeStep())
+		return query.getColumn(0);
+	return -1;
+}
+
 void TMQTTDBLogger::OnConnect(int rc){
     for (const auto& group : LoggerConfig.Groups) {
         for (const auto& channel : group.Channels) {
@@ -364,103 +1269,206 @@ void TMQTTDBLogger::OnMessage(const struct mosquitto_message *message)
     if (!message->payload)
         return;
 
-    high_resolution_clock::time_point t1 = high_resolution_clock::now(); //FIXME: debug
+    TQueuedMessage item = {
+        message->topic, static_cast<const char*>(message->payload),
+        system_clock::now(), steady_clock::now()
+    };
 
+    if (!Queue.Push(item)) {
+        if (LoggerConfig.QueueOverflow == TQueueOverflowPolicy::Drop) {
+            ++DroppedMessages;
+            return;
+        }
+        const auto& blocked_since = steady_clock::now();
+        while (!Queue.Push(item))
+            this_thread::sleep_for(milliseconds(1));
+        BlockedMs += duration_cast<milliseconds>(steady_clock::now() - blocked_since).count();
+    }
+    ++EnqueuedMessages;
 
-    string topic = message->topic;
-    string payload = static_cast<const char*>(message->payload);
+    size_t depth = Queue.Size();
+    if (depth > MaxQueueDepth)
+        MaxQueueDepth = depth;
+}
 
+void TMQTTDBLogger::WriterLoop()
+{
+    TQueuedMessage message;
+    for (;;) {
+        try {
+            if (Queue.Pop(message)) {
+                StoreMessage(message);
+                Flush();
+                continue;
+            }
 
-    bool match;
+            uint64_t dropped = DroppedMessages;
+            if (dropped != ReportedDroppedMessages) {
+                cerr << "warning: queue overflow, " << dropped - ReportedDroppedMessages
+                     << " messages dropped" << endl;
+                ReportedDroppedMessages = dropped;
+            }
 
-    for (const auto& group : LoggerConfig.Groups) {
-        match = false;
-        for (const auto& channel : group.Channels) {
-            if (TopicMatchesSub(channel.Pattern, message->topic)) {
-                match = true;
+            // the producer is stopped before StopWriter is set,
+            // so the queue is drained here
+            if (StopWriter) {
+                Flush(true);
                 break;
             }
+            Flush();
+        } catch (const std::exception& e) {
+            cerr << "error: " << e.what() << endl;
         }
+        this_thread::sleep_for(milliseconds(10));
+    }
+}
+
+void TMQTTDBLogger::Stop()
+{
+    // waits for the request being served
+    if (RPCConnection) {
+        RPCConnection->disconnect();
+        RPCConnection->loop_stop();
+    }
 
-        if (match) {
-            const vector<string>& tokens = StringSplit(topic, '/');
-            int channel_int_id = GetOrCreateChannelId({tokens[2], tokens[4]});
-            int device_int_id = GetOrCreateDeviceId(tokens[2]);
+    StopWriter = true;
+    if (Writer.joinable())
+        Writer.join();
+}
+
+const TMQTTDBLogger::TTopicInfo& TMQTTDBLogger::ResolveTopic(const string& topic)
+{
+    auto it = TopicCache.find(topic);
+    if (it != TopicCache.end())
+        return it->second;
+
+    TTopicInfo info = { nullptr, 0 };
+    int group_index = GroupPatterns.Match(topic);
+    const vector<string>& tokens = StringSplit(topic, '/');
+    // /devices/<device>/controls/<control>
+    if (group_index >= 0 && tokens.size() >= 5) {
+        info.Group = &LoggerConfig.Groups[group_index];
+        info.ChannelId = GetOrCreateChannelId({tokens[2], tokens[4]});
+        GetOrCreateDeviceId(tokens[2]);
+        SetChannelGroup(info.ChannelId, info.Group->IntId);
+    }
+    return TopicCache[topic] = info;
+}
 
+void TMQTTDBLogger::StoreMessage(const TQueuedMessage& message)
+{
+    high_resolution_clock::time_point t1 = high_resolution_clock::now(); //FIXME: debug
 
-            if ((group.MinInterval > 0) || (group.MinUnchangedInterval > 0)) {
-                auto  last_saved = LastSavedTimestamps[channel_int_id];
-                const auto& now = steady_clock::now();
 
-                if (group.MinInterval > 0) {
-                    if (duration_cast<milliseconds>(now - last_saved).count() < group.MinInterval * 1000) {
-                        //limit rate, i.e. ignore this message
-                        cout << "warning: rate limit for topic: " << topic <<  endl;
-                        return;
-                    }
-                }
+    const string& topic = message.Topic;
+    const string& payload = message.Payload;
 
 
-                if (group.MinUnchangedInterval > 0) {
-                    if (ChannelValueCache[channel_int_id] == payload) {
-                        if (duration_cast<milliseconds>(now - last_saved).count() < group.MinUnchangedInterval * 1000) {
-                            cout << "warning: rate limit (unchanged value) for topic: " << topic <<  endl;
-                            return;
-                        }
-                    }
+    // the new ids, the row and the ring buffer cleanup
+    // go to the same transaction
+    BeginWrite();
 
-                    ChannelValueCache[channel_int_id] = payload;
-                }
+    const TTopicInfo& topic_info = ResolveTopic(topic);
+    if (!topic_info.Group)
+        return;
+    const TLoggingGroup& group = *topic_info.Group;
 
-                LastSavedTimestamps[channel_int_id] = now;
+    int channel_int_id = topic_info.ChannelId;
+
+
+    if ((group.MinInterval > 0) || (group.MinUnchangedInterval > 0)) {
+        auto  last_saved = LastSavedTimestamps[channel_int_id];
+        const auto& now = message.ReceivedSteady;
+
+        if (group.MinInterval > 0) {
+            if (duration_cast<milliseconds>(now - last_saved).count() < group.MinInterval * 1000) {
+                //limit rate, i.e. ignore this message
+                cout << "warning: rate limit for topic: " << topic <<  endl;
+                return;
             }
+        }
 
 
+        if (group.MinUnchangedInterval > 0) {
+            if (ChannelValueCache[channel_int_id] == payload) {
+                if (duration_cast<milliseconds>(now - last_saved).count() < group.MinUnchangedInterval * 1000) {
+                    cout << "warning: rate limit (unchanged value) for topic: " << topic <<  endl;
+                    return;
+                }
+            }
 
-            static SQLite::Statement insert_row_query(*DB, "INSERT INTO data (device, channel, value, group_id) VALUES (?, ?, ?, ?)");
+            ChannelValueCache[channel_int_id] = payload;
+        }
 
-            insert_row_query.reset();
-            insert_row_query.bind(1, device_int_id);
-            insert_row_query.bind(2, channel_int_id);
-            insert_row_query.bind(3, payload);
-            insert_row_query.bind(4, group.IntId);
+        LastSavedTimestamps[channel_int_id] = now;
+    }
 
-            insert_row_query.exec();
-            cout << insert_row_query.getQuery() << endl;
 
 
-            // local cache is needed here since SELECT COUNT are extremely slow in sqlite
-            // so we only ask DB at startup. This applies to two if blocks below.
+    // the message may have waited in the queue, so the time
+    // of reception is stored instead of the insertion time
+    double julian_day = duration<double>(message.Received.time_since_epoch()).count() / 86400.0 + 2440587.5;
+    int64_t uid = ++LastUid;
+
+    if (group.IsChunked()) {
+        TChunk& chunk = GetChunk(group, julian_day);
+        SQLite::Statement& insert_chunk_row_query = *ChunkInsertQueries[group.IntId];
+        insert_chunk_row_query.reset();
+        insert_chunk_row_query.bind(1, channel_int_id);
+        insert_chunk_row_query.bind(2, julian_day);
+        insert_chunk_row_query.bind(3, static_cast<sqlite3_int64>(uid));
+        BindValue(insert_chunk_row_query, 4, payload);
+        insert_chunk_row_query.exec();
+        cout << insert_chunk_row_query.getQuery() << endl;
+
+        chunk.TimestampMin = chunk.Rows ? min(chunk.TimestampMin, julian_day) : julian_day;
+        chunk.TimestampMax = chunk.Rows ? max(chunk.TimestampMax, julian_day) : julian_day;
+        chunk.UidMax = uid;
+        ++chunk.Rows;
+        chunk.Dirty = true;
+    } else {
+        SQLite::Statement& insert_row_query = WriteQuery("INSERT INTO data (channel, timestamp, uid, value, value_text) VALUES (?, ?, ?, ?, ?)");
+
+        insert_row_query.reset();
+        insert_row_query.bind(1, channel_int_id);
+        insert_row_query.bind(2, julian_day);
+        insert_row_query.bind(3, static_cast<sqlite3_int64>(uid));
+        BindValue(insert_row_query, 4, payload);
+
+        insert_row_query.exec();
+        cout << insert_row_query.getQuery() << endl;
+    }
 
-            if (group.Values > 0) {
-                if ((++ChannelRowNumberCache[channel_int_id]) > group.Values * (1 + RingBufferClearThreshold) ) {
-                    static SQLite::Statement clean_channel_query(*DB, "DELETE FROM data WHERE channel = ? ORDER BY rowid ASC LIMIT ?");
-                    clean_channel_query.reset();
-                    clean_channel_query.bind(1, channel_int_id);
-                    clean_channel_query.bind(2, ChannelRowNumberCache[channel_int_id] - group.Values);
+    UpdateRollups(channel_int_id, payload, julian_day, uid);
+    PruneRollups(julian_day);
 
-                    clean_channel_query.exec();
-                    cout << clean_channel_query.getQuery() << endl;
-                    ChannelRowNumberCache[channel_int_id] = group.Values;
-                }
-            }
 
-            if (group.ValuesTotal > 0) {
-                if ((++GroupRowNumberCache[group.IntId]) > group.ValuesTotal * (1 + RingBufferClearThreshold)) {
-                    static SQLite::Statement clean_group_query(*DB, "DELETE FROM data WHERE group_id = ? ORDER BY rowid ASC LIMIT ?");
-                    clean_group_query.reset();
-                    clean_group_query.bind(1, group.IntId);
-                    clean_group_query.bind(2, GroupRowNumberCache[group.IntId] - group.ValuesTotal);
-                    clean_group_query.exec();
-                    cout << clean_group_query.getQuery() << endl;
-                    GroupRowNumberCache[group.IntId] = group.ValuesTotal;
-                }
-            }
+    // local cache is needed here since SELECT COUNT are extremely slow in sqlite
+    // so we only ask DB at startup. This applies to two if blocks below.
+    // The chunked groups are cleaned up by dropping whole chunks in GetChunk.
 
-            break;
+    if (group.Values > 0 && !group.IsChunked()) {
+        if ((++ChannelRowNumberCache[channel_int_id]) > group.Values * (1 + RingBufferClearThreshold) ) {
+            DeleteOldestRows({channel_int_id}, ChannelRowNumberCache[channel_int_id] - group.Values);
+            PruneChannelRollups(group, {channel_int_id});
+            cout << "cleaned up channel " << channel_int_id << endl;
+            ChannelRowNumberCache[channel_int_id] = group.Values;
         }
     }
 
+    if (group.ValuesTotal > 0 && !group.IsChunked()) {
+        if ((++GroupRowNumberCache[group.IntId]) > group.ValuesTotal * (1 + RingBufferClearThreshold)) {
+            vector<int> channel_int_ids = GetGroupChannelIds(group.IntId);
+            DeleteOldestRows(channel_int_ids, GroupRowNumberCache[group.IntId] - group.ValuesTotal);
+            PruneChannelRollups(group, channel_int_ids);
+            cout << "cleaned up group " << group.Id << endl;
+            GroupRowNumberCache[group.IntId] = group.ValuesTotal;
+        }
+    }
+
+    if (++PendingRows >= LoggerConfig.CommitRows)
+        Commit();
+
     //FIXME: debug
     high_resolution_clock::time_point t2 = high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
@@ -470,9 +1478,22 @@ void TMQTTDBLogger::OnMessage(const struct mosquitto_message *message)
 
 void TMQTTDBLogger::Init2()
 {
-    RPCServer = make_shared<TMQTTRPCServer>(shared_from_this(), "db_logger");
+    // the requests are served by the network thread of the connection,
+    // ReadDB is only used there
+    TConfig rpc_config = MQTTConfig;
+    if (!rpc_config.Id.empty())
+        rpc_config.Id += "-rpc";
+    RPCConnection = make_shared<TMQTTRPCConnection>(rpc_config);
+    RPCConnection->Init();
+
+    RPCServer = make_shared<TMQTTRPCServer>(RPCConnection, "db_logger");
     RPCServer->RegisterMethod("history", "get_values", std::bind(&TMQTTDBLogger::GetValues, this, placeholders::_1));
+    RPCServer->RegisterMethod("writer", "get_stats", std::bind(&TMQTTDBLogger::GetWriterStats, this, placeholders::_1));
     RPCServer->Init();
+
+    int rc = RPCConnection->loop_start();
+    if (rc != 0)
+        throw TBaseException("couldn't start the RPC thread: " + to_string(rc));
 }
 
 Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
@@ -524,15 +1545,49 @@ Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
     if (! params.isMember("channels"))
         throw TBaseException("no channels specified");
 
-    result["values"] = Json::Value(Json::arrayValue);
+    // downsampled requests are answered from the coarsest rollup level
+    // with buckets not longer than min_interval, if it covers the range
+    if (min_interval_ms > 0) {
+        int level = -1;
+        for (int i = 0; i < RollupLevelCount; ++i) {
+            if (RollupLevels[i].Interval * 1000LL <= min_interval_ms)
+                level = i;
+        }
+        if (level >= 0 && (!RollupLevels[level].Retention ||
+                           timestamp_gt >= time(NULL) - RollupLevels[level].Retention * 86400.0))
+            return GetRollupValues(params, level, min_interval_ms, timestamp_gt, timestamp_lt, uid_gt, limit, req_ver);
+    }
 
-    string get_values_query_str = "SELECT uid, device, channel, value,  (timestamp - 2440587.5)*86400.0  FROM data WHERE (0  ";
+    result["values"] = Json::Value(Json::arrayValue);
 
+    // the chunks can't be dropped by the writer while we're reading
+    SQLite::Transaction snapshot(*ReadDB);
+
+    // the rows are stored in the data table and in the chunks of the
+    // chunked groups, only the chunks that overlap the requested range are read
+    vector<string> tables = {"data"};
+    SQLite::Statement get_chunks_query(*ReadDB, "SELECT int_id FROM chunks WHERE rows > 0 AND "
+                                       "ts_max > julianday(datetime(?,'unixepoch')) AND ts_min < julianday(datetime(?,'unixepoch')) AND uid_max > ?");
+    get_chunks_query.bind(1, timestamp_gt);
+    get_chunks_query.bind(2, timestamp_lt);
+    get_chunks_query.bind(3, static_cast<sqlite3_int64>(uid_gt));
+    while (get_chunks_query.executeStep())
+        tables.push_back(ChunkTableName(get_chunks_query.getColumn(0)));
+
+    // IN lets sqlite read the (channel, timestamp) range of each channel
+    string table_where_str = " WHERE channel IN ( ";
     for (size_t i = 0; i < params["channels"].size(); ++i) {
-        get_values_query_str += " OR channel = ? ";
+        table_where_str += i ? ", ?" : "?";
     }
+    table_where_str += " ) AND timestamp > julianday(datetime(?,'unixepoch')) AND timestamp < julianday(datetime(?,'unixepoch')) AND uid > ? ";
 
-    get_values_query_str += " ) AND timestamp > julianday(datetime(?,'unixepoch')) AND timestamp < julianday(datetime(?,'unixepoch')) AND uid > ? ";
+    string get_values_query_str = "SELECT uid, channel, value, value_text,  (timestamp - 2440587.5)*86400.0  FROM (";
+    for (size_t i = 0; i < tables.size(); ++i) {
+        if (i)
+            get_values_query_str += " UNION ALL ";
+        get_values_query_str += "SELECT uid, channel, value, value_text, timestamp FROM " + tables[i] + table_where_str;
+    }
+    get_values_query_str += ") ";
 
 
 	if (min_interval_ms > 0) {
@@ -541,12 +1596,12 @@ Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
 
 	get_values_query_str += " ORDER BY uid ASC LIMIT ?";
 
-    SQLite::Statement get_values_query(*DB, get_values_query_str);
+    SQLite::Statement get_values_query(*ReadDB, get_values_query_str);
     get_values_query.reset();
 
-    int param_num = 0;
 	std::map<int,int> query_channel_ids; // map channel ids to they serial number in the request
 	std::map<int, TChannel> channel_names; // map channel ids to the their names  ((device, control) pairs)
+	vector<int> channel_int_ids;
 	size_t i = 0;
     for (const auto& channel_item : params["channels"]) {
         if (!(channel_item.isArray() && (channel_item.size() == 2)))
@@ -554,17 +1609,22 @@ Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
 
         const TChannel channel = {channel_item[0u].asString(), channel_item[1u].asString()};
 
-		int channel_int_id = GetOrCreateChannelId(channel);
-
-        get_values_query.bind(++param_num, channel_int_id);
+		int channel_int_id = GetChannelId(channel);
+        channel_int_ids.push_back(channel_int_id);
 
         query_channel_ids[channel_int_id] = (i++);
         channel_names[channel_int_id] = channel;
     }
 
-    get_values_query.bind(++param_num, timestamp_gt);
-    get_values_query.bind(++param_num, timestamp_lt);
-    get_values_query.bind(++param_num, static_cast<sqlite3_int64>(uid_gt));
+    int param_num = 0;
+    for (size_t table = 0; table < tables.size(); ++table) {
+        for (int channel_int_id : channel_int_ids)
+            get_values_query.bind(++param_num, channel_int_id);
+
+        get_values_query.bind(++param_num, timestamp_gt);
+        get_values_query.bind(++param_num, timestamp_lt);
+        get_values_query.bind(++param_num, static_cast<sqlite3_int64>(uid_gt));
+    }
 
 	if (min_interval_ms > 0) {
 		double day_fraction =   86400000. / min_interval_ms /* ms in day */;
@@ -587,15 +1647,15 @@ Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
         row[(req_ver == 1) ? "i" : "uid"] = static_cast<int>(get_values_query.getColumn(0));
 
         if (req_ver == 0) {
-			const TChannel& channel = channel_names[get_values_query.getColumn(2)];
+			const TChannel& channel = channel_names[get_values_query.getColumn(1)];
 			row["device"] = channel.Device;
 			row["control"] = channel.Control;
 		} else if (req_ver == 1) {
-			row["c"] = query_channel_ids[get_values_query.getColumn(2)];
+			row["c"] = query_channel_ids[get_values_query.getColumn(1)];
 		}
 
 
-        row[(req_ver == 1) ? "v" : "value"] = get_values_query.getColumn(3).getText();
+        row[(req_ver == 1) ? "v" : "value"] = ColumnValue(get_values_query, 2);
         row[(req_ver == 1) ? "t" : "timestamp"] = static_cast<double>(get_values_query.getColumn(4));
         result["values"].append(row);
         row_count += 1;
@@ -609,6 +1669,146 @@ Json::Value TMQTTDBLogger::GetValues(const Json::Value& params)
     return result;
 }
 
+Json::Value TMQTTDBLogger::GetRollupValues(const Json::Value& params, int level, int min_interval_ms,
+                                           double timestamp_gt, double timestamp_lt, int64_t uid_gt,
+                                           int limit, int req_ver)
+{
+    struct TPoint
+    {
+        int Channel;
+        int64_t Interval;
+        TRollup Rollup;
+    };
+
+    const int level_interval = RollupLevels[level].Interval;
+    cout << "using rollups of " << level_interval << "s" << endl;
+
+    SQLite::Statement get_rollups_query(*ReadDB, "SELECT bucket, count, num_count, sum, min, max, last, last_timestamp, uid_max "
+                                                 "FROM rollups WHERE level = ? AND channel = ? AND bucket >= ? AND bucket <= ? ORDER BY bucket");
+
+    // the buckets of the level are merged into min_interval ones
+    vector<TPoint> points;
+    std::map<int, int> query_channel_ids; // map channel ids to they serial number in the request
+    std::map<int, TChannel> channel_names;
+    size_t i = 0;
+    for (const auto& channel_item : params["channels"]) {
+        if (!(channel_item.isArray() && (channel_item.size() == 2)))
+            throw TBaseException("'channels' items must be an arrays of size two ");
+
+        const TChannel channel = {channel_item[0u].asString(), channel_item[1u].asString()};
+        int channel_int_id = GetChannelId(channel);
+        query_channel_ids[channel_int_id] = (i++);
+        channel_names[channel_int_id] = channel;
+
+        get_rollups_query.reset();
+        get_rollups_query.bind(1, level_interval);
+        get_rollups_query.bind(2, channel_int_id);
+        get_rollups_query.bind(3, static_cast<sqlite3_int64>(floor(timestamp_gt / level_interval)));
+        get_rollups_query.bind(4, static_cast<sqlite3_int64>(floor(timestamp_lt / level_interval)));
+
+        size_t first = points.size();
+        while (get_rollups_query.executeStep()) {
+            int64_t bucket = get_rollups_query.getColumn(0).getInt64();
+            int64_t interval = bucket * level_interval * 1000 / min_interval_ms;
+
+            TRollup rollup;
+            rollup.Count = get_rollups_query.getColumn(1);
+            rollup.NumericCount = get_rollups_query.getColumn(2);
+            rollup.Sum = get_rollups_query.getColumn(3);
+            rollup.Min = get_rollups_query.getColumn(4);
+            rollup.Max = get_rollups_query.getColumn(5);
+            rollup.Last = get_rollups_query.getColumn(6).getText();
+            rollup.LastTimestamp = get_rollups_query.getColumn(7);
+            rollup.UidMax = static_cast<int64_t>(get_rollups_query.getColumn(8).getInt64());
+
+            if (points.size() == first || points.back().Interval != interval) {
+                points.push_back({channel_int_id, interval, rollup});
+                continue;
+            }
+
+            TRollup& point = points.back().Rollup;
+            if (rollup.NumericCount) {
+                point.Min = point.NumericCount ? min(point.Min, rollup.Min) : rollup.Min;
+                point.Max = point.NumericCount ? max(point.Max, rollup.Max) : rollup.Max;
+                point.Sum += rollup.Sum;
+                point.NumericCount += rollup.NumericCount;
+            }
+            if (rollup.LastTimestamp >= point.LastTimestamp) {
+                point.Last = rollup.Last;
+                point.LastTimestamp = rollup.LastTimestamp;
+            }
+            point.Count += rollup.Count;
+            point.UidMax = max(point.UidMax, rollup.UidMax);
+        }
+    }
+
+    // a point is returned again with the new uid if its buckets are updated
+    points.erase(remove_if(points.begin(), points.end(),
+                           [uid_gt](const TPoint& point) { return point.Rollup.UidMax <= uid_gt; }),
+                 points.end());
+    sort(points.begin(), points.end(),
+         [](const TPoint& a, const TPoint& b) { return a.Rollup.UidMax < b.Rollup.UidMax; });
+
+    Json::Value result;
+    result["values"] = Json::Value(Json::arrayValue);
+    size_t count = (limit >= 0) ? min(points.size(), static_cast<size_t>(limit)) : points.size();
+    for (size_t n = 0; n < count; ++n) {
+        const TPoint& point = points[n];
+        Json::Value row;
+        row[(req_ver == 1) ? "i" : "uid"] = static_cast<int>(point.Rollup.UidMax);
+
+        if (req_ver == 0) {
+            const TChannel& channel = channel_names[point.Channel];
+            row["device"] = channel.Device;
+            row["control"] = channel.Control;
+        } else if (req_ver == 1) {
+            row["c"] = query_channel_ids[point.Channel];
+        }
+
+        // the average of numeric values, the last value otherwise
+        if (point.Rollup.NumericCount) {
+            ostringstream value;
+            value.precision(15);
+            value << point.Rollup.Sum / point.Rollup.NumericCount;
+            row[(req_ver == 1) ? "v" : "value"] = value.str();
+            row["min"] = point.Rollup.Min;
+            row["max"] = point.Rollup.Max;
+        } else {
+            row[(req_ver == 1) ? "v" : "value"] = point.Rollup.Last;
+        }
+        // start of the interval
+        row[(req_ver == 1) ? "t" : "timestamp"] = point.Interval * (min_interval_ms / 1000.0);
+        result["values"].append(row);
+    }
+
+    if (count < points.size()) {
+        result["has_more"] = true;
+    }
+
+    return result;
+}
+
+namespace {
+    volatile sig_atomic_t StopRequested = 0;
+
+    void OnSignal(int)
+    {
+        StopRequested = 1;
+    }
+}
+
+Json::Value TMQTTDBLogger::GetWriterStats(const Json::Value& params)
+{
+    Json::Value result;
+    result["queue_size"] = static_cast<Json::UInt64>(Queue.Capacity());
+    result["queue_depth"] = static_cast<Json::UInt64>(Queue.Size());
+    result["max_queue_depth"] = static_cast<Json::UInt64>(MaxQueueDepth);
+    result["enqueued"] = static_cast<Json::UInt64>(EnqueuedMessages);
+    result["dropped"] = static_cast<Json::UInt64>(DroppedMessages);
+    result["blocked_ms"] = static_cast<Json::UInt64>(BlockedMs);
+    result["overflow"] = (LoggerConfig.QueueOverflow == TQueueOverflowPolicy::Drop) ? "drop" : "block";
+    return result;
+}
 
 int main (int argc, char *argv[])
 {
@@ -682,6 +1882,34 @@ int main (int argc, char *argv[])
 
         config.DBFile = root["database"].asString();
 
+        if (root.isMember("commit_rows")) {
+            if (root["commit_rows"].asInt() < 0)
+                throw TBaseException("'commit_rows' must be positive or zero");
+            config.CommitRows = root["commit_rows"].asInt();
+        }
+
+        if (root.isMember("commit_interval")) {
+            if (root["commit_interval"].asInt() < 0)
+                throw TBaseException("'commit_interval' must be positive or zero");
+            config.CommitInterval = root["commit_interval"].asInt();
+        }
+
+        if (root.isMember("queue_size")) {
+            if (root["queue_size"].asInt() <= 0)
+                throw TBaseException("'queue_size' must be positive");
+            config.QueueSize = root["queue_size"].asInt();
+        }
+
+        if (root.isMember("queue_overflow")) {
+            const string& policy = root["queue_overflow"].asString();
+            if (policy == "drop")
+                config.QueueOverflow = TQueueOverflowPolicy::Drop;
+            else if (policy == "block")
+                config.QueueOverflow = TQueueOverflowPolicy::Block;
+            else
+                throw TBaseException("'queue_overflow' must be either 'drop' or 'block'");
+        }
+
 
         for(auto group_it = root["groups"].begin(); group_it !=root["groups"].end(); ++group_it) {
             const auto & group_item = *group_it;
@@ -722,6 +1950,30 @@ int main (int argc, char *argv[])
                 group.MinUnchangedInterval = group_item["min_unchanged_interval"].asInt();
             }
 
+            if (group_item.isMember("chunk_rows")) {
+                if (group_item["chunk_rows"].asInt() < 0)
+                    throw TBaseException("'chunk_rows' must be positive or zero");
+                group.ChunkRows = group_item["chunk_rows"].asInt();
+            }
+
+            if (group_item.isMember("chunk_interval")) {
+                if (group_item["chunk_interval"].asInt() < 0)
+                    throw TBaseException("'chunk_interval' must be positive or zero");
+                group.ChunkInterval = group_item["chunk_interval"].asInt();
+            }
+
+            if (group_item.isMember("chunks")) {
+                if (group_item["chunks"].asInt() <= 0)
+                    throw TBaseException("'chunks' must be positive");
+                group.Chunks = group_item["chunks"].asInt();
+            }
+
+            if (group_item.isMember("keep_rollups")) {
+                if (!group_item["keep_rollups"].isBool())
+                    throw TBaseException("'keep_rollups' must be a boolean");
+                group.KeepRollups = group_item["keep_rollups"].asBool();
+            }
+
 
 
             config.Groups.push_back(group);
@@ -737,12 +1989,17 @@ int main (int argc, char *argv[])
     mqtt_db_logger->Init2();
 
 
-    while(1) {
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    while(!StopRequested) {
         rc = mqtt_db_logger->loop();
         if (rc != 0) {
             mqtt_db_logger->reconnect();
         }
     }
+
+    mqtt_db_logger->Stop();
     return 0;
 }
 